@@ -10,14 +10,52 @@
  * Tac gia      : Hoang Minh Tri - Nguyen Huu Phong
  * Ngay sua     : 17/04/2025
  * Mo ta        : Du an xe dap qua la dep trai cua hmtri va phong:))
+ * Bien dich    : g++ -std=c++11 projectxedap.cpp -lglut -lGLU -lGL -pthread
+ *                Chay ngam (khong man hinh): them -DXEDAP_HEADLESS -lEGL
+ *                roi chay voi --headless
+ *                Dem cap phat (--alloc-check): them ca -DXEDAP_ALLOC_TRACK
+ *                Nhan dong hoc AVX2 (8 xe mot luc): them -O2 -mavx2
  **************************************************************************/
 
 #include <GL/glut.h>
+#include <GL/glext.h>
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600     // CONDITION_VARIABLE cho nhom luong
+#endif
+#include <windows.h>
+#else
+#include <GL/glx.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(XEDAP_ALLOC_TRACK) && defined(__GLIBC__)
+#include <link.h>
+#endif
+#ifdef XEDAP_HEADLESS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #define PI              3.141592653589793
 #define WIN_WIDTH       1200
@@ -26,6 +64,9 @@
 #define ROD_RADIUS      0.05f
 #define NUM_SPOKES      20
 #define SPOKE_ANGLE     (360.0f / NUM_SPOKES)
+#define CHAINRING_TEETH 30      // Banh rang dia
+#define SPROCKET_TEETH  20      // Lip sau
+#define GEAR_FLAT_TEETH 8       // Muc LOD cuoi cua banh rang: dia 8 canh
 #define RADIUS_WHEEL    1.0f
 #define TUBE_WIDTH      0.08f
 #define RIGHT_ROD       1.6f
@@ -49,33 +90,747 @@
 #define MIN_SPEED      -0.13f
 #define WHEELIE_ANGLE   30.0f
 #define WHEELIE_DURATION 1000
+#define SIM_RATE         60     // So buoc mo phong moi giay (khong phu thuoc FPS)
+#define SIM_DT           (1.0 / SIM_RATE)
+#define MAX_SIM_STEPS    8      // Gioi han so buoc bu moi khung khi may bi cham
+#define DECELERATION     0.02f  // Giam toc moi buoc mo phong
+#define STEER_RATE       60.0f  // Do/giay khi giu A/D (bang lap phim ~30 Hz cu)
+#define MAX_INPUT_SAMPLES 1024  // So mau do tre nhap -> hien giu lai (vong tron)
+#define TIMING_WINDOW    120    // So khung dung de tinh min/tb/p99
+#define GPU_QUERY_LAG    4      // Doc ket qua truy van GPU tre 4 khung de khong dung ong
+#define FRAME_ARENA_SIZE (256 * 1024) // Vung nho tam moi khung luc dau (byte)
+#define ALLOC_WARMUP_FRAMES 120 // Khung khoi dong: bo dem, bo nho dem con lon dan
+#define MAT_STACK_DEPTH  32     // Do sau ngan xep ma tran phia CPU
+#define MAX_BATCHES      32     // So lo instancing ban dau (moi luoi mot lo), tang khi can
+#define GRID_CHUNK_SIZE  32     // So o luoi (1 don vi) moi canh cua mot khoi
+#define GRID_VIEW_CHUNKS 4      // So khoi moi phia quanh nguoi lai
+#define GRID_CACHE_DIM   (2 * GRID_VIEW_CHUNKS + 2)
+#define TERRAIN_CACHE_TILES 256 // So o dia hinh anh xa cung luc (LRU); tang khi tat ca dang giu
+#define TERRAIN_REACH    2.0f   // Ban kinh quanh xe chua ca hai diem tiep dat
+#define REAR_WHEEL_X     (-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH))
+#define FRONT_WHEEL_X    1.29f  // Tam banh truoc, tinh theo chuoi thanh khung
 
 /*****************************************
  * Bien toan cuc
  ****************************************/
-GLfloat pedalAngle, speed, steering;
 GLfloat camx, camy, camz;
 GLfloat anglex, angley, anglez;
 int prevx, prevy;
 GLenum Mouse;
-GLfloat xpos, zpos, direction;
-GLfloat wheelieAngle = 0.0f;
 int wheelieActive = 0;
-int wheelieTimer = 0;
-int autoMove = 0; // Bien kiem tra che do tu dong chay
+int wheelieTimer = 0;           // So buoc mo phong con lai cua wheelie
+
+/*****************************************
+ * Doan xe: trang thai tung xe luu theo mang (cau truc cua mang),
+ * xe 0 la xe nguoi choi dieu khien bang ban phim
+ ****************************************/
+#define PLAYER 0
+
+typedef struct
+{
+    int      count;
+    GLfloat *xpos, *zpos, *direction;
+    GLfloat *speed, *steering, *pedalAngle, *wheelieAngle;
+    int     *autoMove;                  // Che do tu dong chay
+    GLfloat *groundY, *pitch;           // Mat dat duoi banh sau, goc doc (do)
+} Fleet;
+
+// Bo dem doi: buoc mo phong doc 'fleet' va ghi vao 'fleetBack', xong thi
+// doi cho. Sau khi doi, fleetBack giu trang thai truoc de noi suy khi ve.
+Fleet fleet;
+Fleet fleetBack;
+
+/*****************************************
+ * Tu the xe dap dung de ve: noi suy giua hai buoc mo phong
+ ****************************************/
+typedef struct
+{
+    GLfloat xpos, zpos, direction;
+    GLfloat pedalAngle, steering, wheelieAngle;
+    GLfloat speed;
+    GLfloat groundY, pitch;
+} BikePose;
+
+BikePose pose;              // Tu the cua xe dang ve
+BikePose *poses = NULL;     // Tu the cua ca doan xe trong khung hien tai
+double simAccumulator = 0.0;
+double simLastTime = -1.0;
+unsigned long simTicks = 0;
+
+/*****************************************
+ * Ve theo yeu cau: chi ve lai khi mo phong, camera hoac cua so
+ * thay doi; su kien chuot don lai toi da mot lan ve moi khung
+ ****************************************/
+int onDemand = 1;               // --continuous: ve lien tuc bang idle nhu cu
+int fpsCap = 60;                // --fps N: gioi han khung/giay (0 = khong gioi han)
+int vsync = 0;                  // --vsync: doi dong bo man hinh khi doi bo dem
+int redrawPending = 0;          // Da co thay doi chua ve
+int tickScheduled = 0;          // Da hen frameTick()
+int simActive = 0;              // Buoc mo phong gan nhat con lam thay doi trang thai
+double nextFrameTime = 0.0;     // Thoi diem khung ke tiep theo nhip fpsCap
+
+/*****************************************
+ * Nhap lieu: trang thai phim giu duoc lay mau moi buoc mo phong;
+ * moi lan nhan phim co moc thoi gian de do tre den luc hien
+ ****************************************/
+unsigned char keyHeld[256];     // Phim dang giu
+unsigned char keyLatched[256];  // Da nhan tu buoc truoc (giu ca lan nhan-nha nhanh)
+double inputPendingTime = -1.0; // Lan nhan som nhat chua qua buoc mo phong nao
+double inputAppliedTime = -1.0; // Lan nhan da mo phong, cho khung hien ra
+int inputPendingKey = 0, inputAppliedKey = 0;
+unsigned long inputAppliedTick = 0;
+double inputShownTime = -1.0;   // Lan nhan co trong khung dang ve (luong ve)
+int inputShownKey = 0;
+unsigned long inputShownTick = 0;
+double inputLastShown = -1.0;   // Lan nhan moi nhat da dua vao mot khung
+unsigned long presentCount = 0; // So khung da dua ra man hinh
+double inputLatency[MAX_INPUT_SAMPLES]; // ms, vong tron
+int inputLatencyCount = 0;
+const char *inputLogPath = NULL; // --input-log FILE: ghi tung lan nhan phim (CSV)
+FILE *inputLog = NULL;
+
+/*****************************************
+ * Ghi / phat lai nhap lieu: trang thai dau sau reset() roi tung su
+ * kien ban phim, chuot kem so buoc mo phong, trong mot file nhi phan
+ * gon. Su kien ghi luc da xong buoc N duoc phat lai ngay truoc buoc N+1
+ ****************************************/
+#define LOG_MAGIC        "XDRL"
+#define LOG_VERSION      1
+#define LOG_FLEET_FIELDS 7      // xpos zpos direction speed steering pedalAngle wheelieAngle
+
+enum InputEventType
+{
+    EV_END,             // Ket thuc: + ma bam trang thai cuoi (u32)
+    EV_KEY_DOWN,        // + phim (u8)
+    EV_KEY_UP,          // + phim (u8)
+    EV_SPECIAL,         // + phim dac biet GLUT (u8)
+    EV_MOUSE,           // + nut, trang thai (u8, u8), x, y (s16, s16)
+    EV_MOTION           // + x, y (s16, s16)
+};
+
+typedef struct
+{
+    unsigned long tick;         // Su kien xay ra sau 'tick' buoc mo phong
+    int type;
+    int a, b;                   // Phim / nut chuot, trang thai nut
+    int x, y;
+    double time;                // Luc GLUT nhan (chi hang doi luong mo phong)
+} InputEvent;
+
+const char *recordPath = NULL;  // --record FILE: ghi phien choi
+const char *replayPath = NULL;  // --replay FILE: phat lai phien da ghi
+int replayFast = 0;             // --replay-fast FILE: phat lai het toc do, khong ve
+int replayCheck = 0;            // --replay-check: ghi roi phat lai phien mau (toa do am)
+int windowed = 0;               // Dang chay vong GLUT co cua so
+FILE *recordLog = NULL;
+unsigned long recordTick = 0;   // Buoc cua su kien ghi gan nhat (ghi hieu so)
+unsigned long recordEvents = 0;
+FILE *replayLog = NULL;
+InputEvent replayNext;          // Su kien ke tiep can phat
+unsigned long replayEvents = 0;
+int replayDone = 0;
+int replayOk = 1;               // Trang thai cuoi khop voi luc ghi
+
+/*****************************************
+ * Luong mo phong rieng (mac dinh khi co cua so): mo phong chay theo
+ * dong ho cua no va dua anh chup trang thai qua bo dem ba khong khoa;
+ * luong GLUT chi ve anh chup moi nhat. Su kien ban phim, chuot di
+ * qua hang doi va duoc xu ly dau buoc mo phong ke tiep
+ ****************************************/
+#define SNAP_INDEX       3      // Hai bit thap cua snapState: o dang cho
+#define SNAP_FRESH       4      // O dang cho co anh chup luong ve chua lay
+#define INPUT_QUEUE_SIZE 256
+
+typedef struct
+{
+    Fleet prev, cur;            // Hai buoc lien tiep de noi suy
+    double time;                // Luc 'cur' bat dau dung (nowSeconds)
+    GLfloat camera[6];          // camx camy camz anglex angley anglez
+    unsigned long tick;
+    double simMs;               // Tong thoi gian buoc mo phong tu luc bat dau
+    unsigned long simSteps;
+    double inputTime;           // Lan nhan moi nhat da vao mo phong
+    int inputKey;
+    unsigned long inputTick;
+} SimSnapshot;
+
+int simThreadMode = -1;         // --sim-thread / --no-sim-thread (-1: chi khi co cua so)
+int simThreaded = 0;            // Mo phong o luong rieng (dat truoc khi tao luong)
+int simThreadRunning = 0;
+SimSnapshot snapshots[3];
+std::atomic<int> snapState(1);  // O dang cho + SNAP_FRESH
+int snapWrite = 2;              // O luong mo phong dang ghi
+int snapRead = 0;               // O luong ve dang doc
+std::atomic<int> simQuit(0);
+std::atomic<int> simAsleep(0);  // Luong mo phong ngu cho su kien (sau anh chup cuoi)
+double simWorkMs = 0.0;         // Cac bien sim* duoi day chi luong mo phong dung
+unsigned long simWorkSteps = 0;
+double simInputTime = -1.0;
+int simInputKey = 0;
+unsigned long simInputTick = 0;
+double inputEventTime = -1.0;   // Luc GLUT nhan su kien dang xu ly (-1: ngay luc nay)
+InputEvent inputQueue[INPUT_QUEUE_SIZE];
+int inputQueueHead = 0;
+int inputQueueCount = 0;
+unsigned long inputQueueDropped = 0;
+#ifdef _WIN32
+HANDLE simThreadHandle = NULL;
+CRITICAL_SECTION simLock;
+CONDITION_VARIABLE simWake;
+#else
+pthread_t simThreadHandle;
+pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t simWake = PTHREAD_COND_INITIALIZER;
+#endif
+
+/*****************************************
+ * Ghi quy dao: trang thai moi xe moi buoc theo cot, gom thanh khoi
+ * TRACE_CHUNK_TICKS buoc, cuoi file co bang chi muc cac khoi
+ ****************************************/
+#define TRACE_MAGIC       "XDTR"
+#define TRACE_INDEX_MAGIC "XDTI"
+#define TRACE_VERSION     1
+#define TRACE_CHUNK_TICKS 64    // So buoc mo phong moi khoi
+
+typedef struct
+{
+    unsigned long long offset;  // Vi tri khoi trong file
+    unsigned int firstTick;     // Buoc dau tien cua khoi
+    unsigned int ticks;         // So buoc trong khoi
+} TraceChunk;
+
+const char *fleetFieldNames[LOG_FLEET_FIELDS] =
+{
+    "xpos", "zpos", "direction", "speed", "steering", "pedalAngle", "wheelieAngle"
+};
+
+const char *tracePath = NULL;     // --trace FILE: ghi quy dao moi buoc
+const char *traceDumpPath = NULL; // --trace-dump FILE: in quy dao ra CSV
+double traceFrom = 0.0;           // --from S: giay dau cua doan can in
+double traceTo = -1.0;            // --to S: giay cuoi (-1 = den het)
+int traceBike = -1;               // --bike N: chi in xe N (-1 = ca doan)
+FILE *traceFile = NULL;
+GLfloat *traceBuffer = NULL;      // Khoi dang gom: [cot][buoc][xe]
+int traceTicks = 0;               // So buoc da gom trong khoi
+unsigned int traceFirstTick = 0;
+unsigned long long traceOffset = 0; // Vi tri ghi ke tiep trong file
+TraceChunk *traceIndex = NULL;
+int traceChunks = 0, traceIndexCap = 0;
+
+/*****************************************
+ * Do thoi gian tung giai doan cua khung hinh
+ ****************************************/
+enum
+{
+    PHASE_SIM,          // updateScene() (tong cac buoc trong khung)
+    PHASE_LANDMARKS,
+    PHASE_FRAME,
+    PHASE_CHAIN,
+    PHASE_PEDALS,
+    PHASE_PERSON,
+    PHASE_INSTANCES,    // flushInstances(): ve tat ca lo instancing
+    PHASE_HUD,
+    PHASE_SWAP,
+    PHASE_TOTAL,        // Khoang cach giua hai khung lien tiep
+    NUM_PHASES
+};
+
+const char *phaseNames[NUM_PHASES] =
+{
+    "sim", "landmarks", "drawFrame", "drawChain", "drawPedals",
+    "drawPerson", "instances", "drawControlsText", "swap", "total"
+};
+
+typedef struct
+{
+    unsigned long frame;
+    int    simSteps;
+    double cpu[NUM_PHASES];     // ms, < 0 neu khong do (tong cua khung dau)
+    double gpu[NUM_PHASES];     // ms, < 0 neu khong do
+} FrameTiming;
+
+FrameTiming timingCurrent;                      // Khung dang do
+FrameTiming timingPending[GPU_QUERY_LAG];       // Khung cho ket qua GPU
+double timingHistory[2][NUM_PHASES][TIMING_WINDOW]; // [cpu/gpu][giai doan][khung]
+int timingCount = 0;
+unsigned long timingFrames = 0;
+double timingStart[NUM_PHASES];
+double timingLastFrameEnd = -1.0;
+GLuint gpuQueries[GPU_QUERY_LAG][NUM_PHASES];
+int gpuTimers = 0;                              // Co GL_TIME_ELAPSED
+int showTiming = 1;                             // Phim T: bat/tat bang thoi gian
+FILE *timingCsv = NULL;
+
+/*****************************************
+ * Vung nho tam cua khung (luong ve): cap bang cach day con tro,
+ * bo het mot lan cuoi display(). Khung nao xin qua vung nho thi
+ * phan du lay tu heap, khung sau vung nho lon bang dinh do
+ ****************************************/
+typedef struct
+{
+    unsigned char *base;
+    size_t size, used;
+    size_t wanted;              // Tong byte da xin trong khung (ca phan tran)
+    void *last;                 // Lan cap gan nhat (noi rong tai cho duoc)
+    void *overflow;             // Cac khoi heap khi vung nho day (danh sach)
+} FrameArena;
+
+FrameArena frameArena;
+
+/*****************************************
+ * Dem cap phat heap (chi ban dich -DXEDAP_ALLOC_TRACK): moi luong bat
+ * allocTracking trong doan can theo doi (khung ve, buoc mo phong). Sau
+ * ALLOC_WARMUP_FRAMES khung, khung nao con cap phat thi bao ra stderr;
+ * --alloc-check tra ve loi
+ ****************************************/
+std::atomic<unsigned long> allocCount(0);       // Cap phat tu cuoi khung truoc
+std::atomic<unsigned long> driverAllocCount(0); // ... ben trong driver OpenGL (chi bao)
+thread_local int allocTracking = 0;
+unsigned long frameAllocs = 0;                  // Cap phat cua khung vua xong
+unsigned long frameDriverAllocs = 0;
+unsigned long driverAllocs = 0;                 // Tong cap phat cua driver sau khoi dong
+unsigned long steadyAllocs = 0;                 // Tong cap phat sau khoi dong
+unsigned long steadyAllocFrames = 0;            // So khung co cap phat sau khoi dong
+int allocCheck = 0;                             // --alloc-check
+
+PFNGLGENQUERIESPROC          pglGenQueries = NULL;
+PFNGLBEGINQUERYPROC          pglBeginQuery = NULL;
+PFNGLENDQUERYPROC            pglEndQuery = NULL;
+PFNGLGETQUERYOBJECTUI64VPROC pglGetQueryObjectui64v = NULL;
+
+/*****************************************
+ * Tuy chon dong lenh
+ ****************************************/
+int headless = 0;               // --headless: ve vao bo dem ngoai man hinh
+int runFrames = 300;            // --frames N: so khung khi chay ngam / do hieu nang
+int headlessSaveEvery = 0;      // --save-every K: ghi anh moi K khung (0 = khong ghi)
+const char *headlessOut = "frame"; // --out PREFIX: ten file anh PREFIX_000123.ppm
+int startAuto = 0;              // --auto: bat che do tu dong chay ngay tu dau
+int fleetSize = 1;              // --bikes N: so xe trong doan
+int useInstancing = 1;          // --no-instancing: luon ve tung xe bang ham co dinh
+int lodForce = -1;              // --lod N: co dinh muc chi tiet (-1 = theo khoang cach)
+int simdCheck = 0;              // --simd-check: so sanh loi SIMD voi mo hinh vo huong
+int geometryCheck = 0;          // --geometry-check: so bang hinh hoc tinh san voi luc chay
+int simdBenchRiders = 0;        // --simd-bench N: do thong luong xe/giay, N xe
+int threadCount = 0;            // --threads N: so luong mo phong (0 = so loi CPU)
+int simScalingRiders = 0;       // --sim-scaling N: do buoc mo phong voi 1..16 luong
+unsigned long sweepTicks = 0;   // --sweep N: quet tham so, N buoc moi lan chay
+int sweepSteerSteps = 15;       // --sweep-steer K: so muc tay lai trong [-HANDLE_LIMIT, HANDLE_LIMIT]
+int sweepSpeedSteps = 5;        // --sweep-speed K: so muc toc do trong [MIN_SPEED, MAX_SPEED]
+const char *sweepOutPath = NULL; // --sweep-out FILE: ket qua CSV (mac dinh stdout)
+const char *timingCsvPath = NULL; // --timing-csv FILE: ghi thoi gian moi khung
+const char *benchScenario = NULL; // --benchmark NAME: chay kich ban do hieu nang
+const char *benchOutPath = NULL;  // --bench-out FILE: them ket qua JSON vao file
+
+/*****************************************
+ * Do hieu nang theo kich ban
+ ****************************************/
+#define BENCH_WARMUP     10     // So khung dau bo qua khi thong ke
+
+int benchFrame = 0;
+double *benchTimes = NULL;      // Thoi gian tung khung (ms)
+double benchLastEnd = -1.0;
+
+/*****************************************
+ * Muc chi tiet (LOD) theo kich thuoc xe tren man hinh.
+ * Muc 0 la luoi goc; muc 1 giam chia luoi; muc 2 bo nan hoa,
+ * rang banh rang va xich.
+ ****************************************/
+#define NUM_LODS            3
+#define LOD_NEAR_PX         160.0f  // Xe cao hon (pixel) dung muc 0
+#define LOD_FAR_PX          48.0f   // Xe thap hon dung muc 2
+#define LOD_HYSTERESIS      0.15f   // Chi doi muc khi vuot nguong them 15%
+// Hinh cau bao ca xe, tam o truc giua (goc toa do cua xe): wheelie xoay
+// quanh truc X qua goc nen diem xa nhat luon la mep sau banh sau
+#define BIKE_RADIUS         (BACK_CONNECTOR + 2.0f * (RADIUS_WHEEL + TUBE_WIDTH))
+#define MAX_LOD_MESHES      8
+
+/*****************************************
+ * Luoi dinh san (mesh) luu tren GPU
+ ****************************************/
+typedef struct
+{
+    GLfloat x, y, z;
+    GLfloat nx, ny, nz;
+    GLfloat r, g, b;
+} MeshVertex;
+
+typedef struct
+{
+    GLuint      vbo, ibo;      // 0 neu driver khong ho tro VBO
+    MeshVertex *vertices;      // Ban sao phia client (dung khi khong co VBO)
+    GLuint     *indices;
+    GLsizei     numVertices, capVertices;
+    GLsizei     numIndices, capIndices;
+    GLsizei     numLines;      // So chi so GL_LINES nam o cuoi mang chi so
+    GLboolean   hasColor;      // Co mau rieng tung dinh
+    GLboolean   keepClient;    // Giu ban sao phia client sau khi nap (de dung lai luoi)
+    GLfloat     color[3];      // Mau hien tai khi tao luoi
+} Mesh;
+
+typedef struct
+{
+    GLfloat inner_radius, outer_radius, width, tooth_depth;
+    GLint   teeth;
+    Mesh    mesh;
+    Mesh    lod[NUM_LODS - 1];      // It rang hon; muc cuoi la dia khong rang
+} GearEntry;
+
+enum { CHUNK_IDLE, CHUNK_QUEUED, CHUNK_READY, CHUNK_RETRY };   // Trang thai dung luoi dia hinh
+
+typedef struct
+{
+    int       cx, cz;          // Toa do khoi (don vi GRID_CHUNK_SIZE)
+    GLboolean valid;
+    Mesh      mesh;
+    // Dia hinh: luong dung luoi ghi vao 'build', luong ve dua len GPU
+    std::atomic<int> state;
+    int       meshed;          // 'mesh' da la luoi cua (cx, cz)
+    Mesh      build;
+} GridChunk;
+
+Mesh cylinderMesh, cubeMesh, sphereMesh, wheelMesh;
+// Moi banh rang cap rieng: bang LOD va do thi canh giu &mesh, mang tang khong lam hong
+GearEntry **gearCache = NULL;
+int numGears = 0, capGears = 0;
+// Khoi luoi dat anh xa vong (cx mod DIM, cz mod DIM): cac khoi trong tam nhin
+// khong bao gio trung o, khoi cu bi tai su dung khi nguoi lai di xa
+GridChunk gridCache[GRID_CACHE_DIM][GRID_CACHE_DIM];
+
+/*****************************************
+ * Dia hinh: file do cao chia o GRID_CHUNK_SIZE x GRID_CHUNK_SIZE don vi,
+ * moi o anh xa bo nho rieng khi can, giu TERRAIN_CACHE_TILES o (bo o
+ * lau khong dung nhat); nhieu xe giu het cac o thi bo nho dem lon them.
+ * Ngoai ban do la mat phang cu
+ ****************************************/
+#define TERRAIN_MAGIC    "XDHM"
+#define TERRAIN_VERSION  1
+#define TERRAIN_HEADER   64     // Byte dau file truoc o dau tien
+
+typedef struct
+{
+    int tx, tz;                 // Chi so o trong file
+    int valid;
+    int refs;                   // Dang dung (buoc mo phong, luong dung luoi)
+    unsigned long lastUse;
+    void *view;                 // Vung anh xa (canh theo trang he thong)
+    size_t viewSize;
+    const short *samples;       // (cells + 1)^2 mau, hang theo z
+} TerrainTile;
+
+const char *terrainPath = NULL;     // --terrain FILE: chay tren dia hinh
+const char *terrainGenPath = NULL;  // --terrain-gen FILE: tao file dia hinh mau
+int terrainGenTiles = 64;           // --terrain-tiles N: N x N o khi tao
+int terrainLoaded = 0;
+int terrainTilesX, terrainTilesZ;
+int terrainOriginX, terrainOriginZ; // Goc o (0, 0) trong toa do the gioi
+GLfloat terrainScale;               // Don vi moi buoc int16
+GLfloat terrainMinH, terrainMaxH;
+size_t terrainTileBytes;
+unsigned long long terrainGranularity; // Canh le vi tri anh xa
+// Moi o cap rieng: tap o cua buoc mo phong giu con tro, mang tang khong lam hong
+TerrainTile **terrainTiles = NULL;
+int terrainCacheCap = 0;
+unsigned long terrainClock = 0;
+unsigned long terrainLoads = 0;     // So lan anh xa o (thong ke)
+int terrainResident = 0;
+// Tap o cua buoc mo phong hien tai, sap theo khoa: luong mo phong chi doc
+long long *terrainSetKeys = NULL, *terrainNextKeys = NULL;
+TerrainTile **terrainSetTiles = NULL, **terrainNextTiles = NULL;
+int terrainSetCount = 0, terrainSetCap = 0;
+// Hang doi khoi cho luong dung luoi
+GridChunk *meshQueue[GRID_CACHE_DIM * GRID_CACHE_DIM];
+int meshQueueHead = 0, meshQueueCount = 0;
+int mesherStarted = 0;
+#ifdef _WIN32
+HANDLE terrainFile = INVALID_HANDLE_VALUE, terrainMapping = NULL;
+CRITICAL_SECTION terrainLock;
+CONDITION_VARIABLE mesherWake;
+#else
+int terrainFd = -1;
+pthread_mutex_t terrainLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mesherWake = PTHREAD_COND_INITIALIZER;
+#endif
+
+// Con tro ham VBO (OpenGL 1.5), nap luc chay
+PFNGLGENBUFFERSPROC    pglGenBuffers = NULL;
+PFNGLBINDBUFFERPROC    pglBindBuffer = NULL;
+PFNGLBUFFERDATAPROC    pglBufferData = NULL;
+PFNGLDELETEBUFFERSPROC pglDeleteBuffers = NULL;
+PFNGLBUFFERSUBDATAPROC pglBufferSubData = NULL;
+
+/*****************************************
+ * Ngan xep ma tran phia CPU cho cac bo phan xe dap.
+ * Ve thuong: ma tran dinh duoc nhan vao modelview truoc moi luoi.
+ * Instancing: ma tran (da gom vi tri xe) duoc gom vao lo theo luoi
+ ****************************************/
+GLfloat matStack[MAT_STACK_DEPTH][16];     // Cot truoc, giong OpenGL
+int matTop = 0;
+int matOverflow = 0;            // So lan mPush bi bo qua vi ngan xep day
+GLfloat drawColor[3] = {1.0f, 1.0f, 1.0f};
+int drawInstanced = 0;
+
+typedef struct
+{
+    GLfloat matrix[16];
+    GLfloat color[4];
+} InstanceData;
+
+typedef struct
+{
+    const Mesh   *mesh;
+    int           stipple;      // Ve bang net dut (xich dang chay)
+    InstanceData *data;
+    int           count, cap;
+} InstanceBatch;
+
+InstanceBatch *batches = NULL;
+int numBatches = 0, capBatches = 0;
+int chainPhase = 0;             // Doi mau net dut cua xich moi khung
+Mesh chainMesh, seatMesh;
+
+// Instancing can OpenGL 3.3 (glVertexAttribDivisor, glDrawElementsInstanced)
+int instancingAvailable = 0;
+GLuint instanceProgram = 0, instanceVbo = 0;
+GLsizeiptr instanceVboSize = 0;
+GLint useVertexColorLoc = -1;
+PFNGLCREATESHADERPROC            pglCreateShader = NULL;
+PFNGLSHADERSOURCEPROC            pglShaderSource = NULL;
+PFNGLCOMPILESHADERPROC           pglCompileShader = NULL;
+PFNGLGETSHADERIVPROC             pglGetShaderiv = NULL;
+PFNGLGETSHADERINFOLOGPROC        pglGetShaderInfoLog = NULL;
+PFNGLCREATEPROGRAMPROC           pglCreateProgram = NULL;
+PFNGLATTACHSHADERPROC            pglAttachShader = NULL;
+PFNGLBINDATTRIBLOCATIONPROC      pglBindAttribLocation = NULL;
+PFNGLLINKPROGRAMPROC             pglLinkProgram = NULL;
+PFNGLGETPROGRAMIVPROC            pglGetProgramiv = NULL;
+PFNGLGETPROGRAMINFOLOGPROC       pglGetProgramInfoLog = NULL;
+PFNGLUSEPROGRAMPROC              pglUseProgram = NULL;
+PFNGLGETUNIFORMLOCATIONPROC      pglGetUniformLocation = NULL;
+PFNGLUNIFORM1IPROC               pglUniform1i = NULL;
+PFNGLUNIFORM4FVPROC              pglUniform4fv = NULL;
+PFNGLUNIFORMMATRIX4FVPROC        pglUniformMatrix4fv = NULL;
+PFNGLVERTEXATTRIB4FVPROC         pglVertexAttrib4fv = NULL;
+PFNGLVERTEXATTRIBPOINTERPROC     pglVertexAttribPointer = NULL;
+PFNGLENABLEVERTEXATTRIBARRAYPROC  pglEnableVertexAttribArray = NULL;
+PFNGLDISABLEVERTEXATTRIBARRAYPROC pglDisableVertexAttribArray = NULL;
+PFNGLVERTEXATTRIBDIVISORPROC     pglVertexAttribDivisor = NULL;
+PFNGLDRAWELEMENTSINSTANCEDPROC   pglDrawElementsInstanced = NULL;
+
+// Vi tri thuoc tinh instancing; tranh 0-7 vi mot so driver trung voi gl_Vertex...
+#define ATTRIB_INSTANCE_MATRIX 10      // 10..13: bon cot ma tran
+#define ATTRIB_INSTANCE_COLOR  14      // Shader khop xuong: dau vao tu the cua xe
+
+int shadersAvailable = 0;              // Da nap ham shader (OpenGL 3.3)
+
+/*****************************************
+ * Nguoi lai va ban dap la mot luoi khop xuong (skinning): moi
+ * dinh mang so nut cua do thi canh, vertex shader tu tinh chuoi
+ * khop tu goc ban dap va goc wheelie cua xe
+ ****************************************/
+#define MAX_SKIN_BONES      24      // Kich thuoc mang trong shader
+#define MAX_SKIN_DEPTH      8       // Do sau toi da cua chuoi khop (vong lap shader)
+#define SKIN_STR2(x)        #x
+#define SKIN_STR(x)         SKIN_STR2(x)  // So nguyen -> chuoi de ghep vao ma shader
+
+typedef struct
+{
+    GLfloat x, y, z;
+    GLfloat nx, ny, nz;
+    GLfloat r, g, b;
+    GLfloat bone;           // Chi so nut (qua gl_MultiTexCoord0.x)
+} SkinVertex;
+
+typedef struct
+{
+    GLuint  vbo, ibo;
+    GLsizei numIndices;
+} SkinMesh;
+
+int useSkinning = 1;                   // --no-skinning: tinh khop tren CPU
+int skinningAvailable = 0;
+GLuint skinProgram = 0;
+SkinMesh skinMeshes[NUM_LODS];
+InstanceBatch skinBatches[NUM_LODS];   // Xe dung moi muc chi tiet (instancing)
+
+/*****************************************
+ * Do thi canh cua xe: cay nut bien doi, moi nut la mot khop
+ * xoay theo mot dau vao cua tu the (hoac co dinh). Nut chi
+ * phu thuoc hang so duoc tinh mot lan va dung chung cho moi xe;
+ * nut dong luu rieng tung xe va chi tinh lai khi dau vao doi.
+ ****************************************/
+#define SG_STATIC           -1
+#define SG_INPUT_WHEELIE    0
+#define SG_INPUT_PEDAL      1
+#define SG_INPUT_STEERING   2
+#define SG_NUM_INPUTS       3
+#define MAX_SCENE_NODES     32
+#define MAX_SCENE_ITEMS     96
+
+typedef struct
+{
+    const Mesh *levels[NUM_LODS];   // levels[0] la luoi goc
+} LodEntry;
+
+LodEntry lodTable[MAX_LOD_MESHES];
+int numLodMeshes = 0;
+Mesh cylinderLod[NUM_LODS - 1], sphereLod[NUM_LODS - 1], wheelLod[NUM_LODS - 1];
+GLfloat viewMatrix[16];                 // Modelview cua camera trong khung
+int viewHeight = WIN_HEIGHT;            // Chieu cao khung nhin (pixel)
+int lodCounts[NUM_LODS];                // So xe moi muc trong khung (thong ke)
+
+/*****************************************
+ * Loai bo vat ngoai khung nhin (frustum culling)
+ ****************************************/
+GLfloat frustum[6][4];                  // Sau mat phang (n, d), phia trong: n.p + d >= 0
+int useCulling = 1;                     // --no-cull: ve tat ca
+
+typedef struct
+{
+    int bikes, bikesCulled;             // Ca xe
+    int parts, partsCulled;             // Tung bo phan cua xe con lai
+    int chunks, chunksCulled;           // O luoi mat dat
+} CullStats;
+
+CullStats cullStats;                    // Thong ke cua khung hien tai
+
+/*****************************************
+ * Chu tren man hinh (HUD): font Helvetica 12 dat san trong mot
+ * texture, moi ky tu la mot tu giac trong mot bo dinh chung
+ ****************************************/
+#define HUD_FIRST_CHAR      32
+#define HUD_NUM_CHARS       95      // ' ' .. '~'
+#define HUD_GLYPH_HEIGHT    16
+#define HUD_GLYPH_BASELINE  4       // So hang duoi duong chan chu
+#define HUD_CELL            16      // O cua moi ky tu trong atlas
+#define HUD_ATLAS_COLS      16
+#define HUD_ATLAS_W         256
+#define HUD_ATLAS_H         128
+#define HUD_LINE_HEIGHT     15
+#define MAX_HUD_QUADS       2048
+#define HUD_TIMING_HZ       4       // Bang thoi gian lam moi 4 lan/giay
+
+typedef struct
+{
+    GLubyte  width;                     // Cung la buoc tien sang ky tu sau
+    GLushort rows[HUD_GLYPH_HEIGHT];    // Tu duoi len, bit cao la cot trai
+} HudGlyph;
+
+typedef struct
+{
+    GLfloat x, y, u, v;
+    GLubyte r, g, b, a;
+} HudVertex;
+
+GLuint hudTexture = 0;
+GLuint hudVbo = 0;                      // 0: ve tu mang phia client
+HudVertex hudVertices[MAX_HUD_QUADS * 4];
+int hudStaticQuads = 0;                 // Cac dong huong dan, chi dung lai khi doi kich thuoc
+int hudTimingQuads = 0;                 // Bang thoi gian, dung lai HUD_TIMING_HZ lan/giay
+int hudSpeedQuads = 0;                  // Dong toc do, dung lai khi gia tri doi
+int hudQuads = 0;
+int hudStaticDirty = 1;
+int viewWidth = WIN_WIDTH;              // Chieu rong khung nhin (pixel)
+
+enum
+{
+    PART_FRAME,
+    PART_PEDALS,
+    PART_PERSON,
+    NUM_PARTS
+};
+
+typedef struct
+{
+    int parent;             // -1: goc cua bo phan
+    int input;              // SG_STATIC hoac SG_INPUT_*
+    int sine;               // Goc = scale * sin(dau vao) + offset thay vi scale * dau vao + offset
+    GLfloat scale, offset;  // Goc khop (do)
+    GLfloat axis[3];
+    int mask;               // Cac dau vao anh huong den nut (ke ca tu nut cha)
+    int slot;               // Vi tri trong bo nho rieng tung xe; -1 neu dung chung
+    GLfloat pre[16];        // Bien doi co dinh tu nut cha den khop
+    GLfloat local[16];      // Dung chung khi nut co dinh
+    GLfloat world[16];      // Dung chung khi mask == 0
+} SceneNode;
+
+typedef struct
+{
+    int node;
+    const Mesh *mesh;
+    const Mesh *lods[NUM_LODS];         // Luoi theo tung muc; NULL: bo qua o muc do
+    int stipple;
+    GLfloat color[3];
+    int slot;
+    GLfloat offset[16];     // Bien doi co dinh tu nut den luoi
+    GLfloat world[16];      // Dung chung khi nut khong dong
+} SceneItem;
+
+typedef struct
+{
+    int valid;
+    int lod;                // Muc chi tiet dang dung
+    int visible;            // Bit (1 << part) cua bo phan nam trong khung nhin
+    GLfloat inputs[SG_NUM_INPUTS];
+    GLfloat *local, *world; // [sgAnimNodes * 16]
+    GLfloat *items;         // [sgAnimItems * 16]
+} BikeTransforms;
+
+SceneNode sceneNodes[MAX_SCENE_NODES];
+SceneItem sceneItems[MAX_SCENE_ITEMS];
+int numSceneNodes = 0, numSceneItems = 0;
+int partFirstItem[NUM_PARTS + 1];
+int partFirstNode[NUM_PARTS + 1];
+int sgCpuParts = NUM_PARTS;             // So bo phan dau tien tinh ma tran tren CPU
+int sgAnimNodes = 0, sgAnimItems = 0;
+int sgRecording = 0;                    // submitMesh() ghi vao do thi thay vi ve
+int matNode[MAT_STACK_DEPTH];           // Nut cua tung muc ngan xep khi ghi
+BikeTransforms *bikeTransforms = NULL;
+int currentBike = 0;
+unsigned long sgMatrixUpdates = 0;      // So ma tran tinh lai trong khung (thong ke)
+
+// Hop bao (AABB) tung bo phan trong he toa do cua xe, da tinh ca tam
+// xoay cua wheelie, ban dap va tay lai
+const GLfloat partBounds[NUM_PARTS][2][3] =
+{
+    // Khung: wheelie xoay quanh truc X nen khung lech ca sang hai ben
+    { { -BIKE_RADIUS, -(RADIUS_WHEEL + TUBE_WIDTH), -1.7f },
+      { 2.4f, 2.3f, 1.75f } },
+    // Ban dap: tay quay 0.5 cong ban dap quay quanh truc giua
+    { { -0.6f, -0.52f, -0.42f }, { 0.6f, 0.52f, 0.42f } },
+    // Nguoi
+    { { -0.5f, -0.33f, -0.16f }, { 0.15f, 1.1f, 0.92f } }
+};
 
 // Khai bao ham
 void ZCylinder(GLfloat radius, GLfloat length);
+void solidCube(GLfloat size);
+void solidSphere(GLfloat radius);
+void loadGLExtensions(void);
+void initPrimitives(void);
+void initWheel(void);
+GLuint meshVertex(Mesh *m, GLfloat x, GLfloat y, GLfloat z,
+                  GLfloat nx, GLfloat ny, GLfloat nz);
+void meshTriangle(Mesh *m, GLuint a, GLuint b, GLuint c);
+void meshLine(Mesh *m, GLuint a, GLuint b);
+void meshColor(Mesh *m, GLfloat r, GLfloat g, GLfloat b);
+void meshUpload(Mesh *m);
+void meshReset(Mesh *m);
+void drawMesh(const Mesh *m);
 void XCylinder(GLfloat radius, GLfloat length);
 void drawFrame(void);
 void gear(GLfloat inner_radius, GLfloat outer_radius,
           GLfloat width, GLint teeth, GLfloat tooth_depth);
+const Mesh *gearMesh(GLfloat inner_radius, GLfloat outer_radius,
+                     GLfloat width, GLint teeth, GLfloat tooth_depth);
 void drawChain(void);
 void drawPedals(void);
 void drawTyre(void);
 void drawSeat(void);
 void drawPerson(void);
+void drawBikes(int phase);
 void drawControlsText(void);
+void initHud(void);
 void help(void);
 void init(void);
 void reset(void);
@@ -83,8 +838,35 @@ void display(void);
 void idle(void);
 void updateScene(void);
 void landmarks(void);
+GridChunk *gridChunk(int cx, int cz);
+void initGrid(void);
+int terrainOpen(const char *path);
+void terrainPrepare(void);
+GLfloat terrainHeight(GLfloat x, GLfloat z);
+void terrainContact(Fleet *f, int begin, int end);
+int runTerrainGen(void);
 void special(int key, int x, int y);
 void keyboard(unsigned char key, int x, int y);
+void keyboardUp(unsigned char key, int x, int y);
+void inputStamp(int key);
+void applyInput(void);
+int inputActive(void);
+void inputPresented(void);
+void inputStats(double *p50, double *p95, double *p99, double *mx);
+void inputReport(void);
+unsigned int stateHash(void);
+void recordOpen(const char *path);
+void recordEvent(int type, int a, int b, int x, int y);
+void recordClose(void);
+int replayOpen(const char *path);
+void replayStart(void);
+int replayStep(void);
+int runReplayFast(void);
+int runReplayCheck(void);
+void traceOpen(const char *path);
+void traceTick(void);
+void traceClose(void);
+int runTraceDump(void);
 void mouse(int button, int state, int x, int y);
 void motion(int x, int y);
 void reshape(int w, int h);
@@ -94,945 +876,7243 @@ GLfloat degrees(GLfloat);
 GLfloat radians(GLfloat);
 GLfloat angleSum(GLfloat, GLfloat);
 void wheelieReset(int value);
+void stepSimulation(void);
+void presentFrame(void);
+int parseArgs(int argc, char *argv[]);
+int saveFramePPM(const char *path, int w, int h);
+int runHeadless(void);
+double nowSeconds(void);
+int isGpuPhase(int phase);
+void timerBegin(int phase);
+void timerEnd(int phase);
+void timingEndFrame(void);
+void timingStats(int gpu, int phase, double *mn, double *avg, double *p99);
+void *frameAlloc(size_t bytes);
+void *frameGrow(void *p, size_t oldBytes, size_t newBytes);
+void frameArenaReset(void);
+void allocFrameEnd(void);
+void instanceBatchesReset(void);
+void openTimingCsv(const char *path);
+int benchmarkValid(const char *name);
+void benchmarkTick(int frame);
+int benchmarkFrameDone(void);
+void benchmarkReport(void);
+GLfloat lerpAngle(GLfloat a, GLfloat b, GLfloat t);
+void fleetInit(int count);
+void fleetAlloc(Fleet *f, int count);
+void fleetCopyRange(Fleet *dst, const Fleet *src, int begin, int end);
+void fleetFree(Fleet *f);
+void updateFleet(Fleet *f, int begin, int end);
+int kinematicsBatch(Fleet *f, int begin, int end);
+int runSimdCheck(void);
+int runGeometryCheck(void);
+int runSimdBench(int riders);
+int cpuCount(void);
+void poolStart(int threads);
+void poolStop(void);
+void poolParallelFor(int count, void (*fn)(int begin, int end));
+void poolParallelForGrain(int count, int grain, void (*fn)(int begin, int end));
+int runSimScaling(int riders);
+int runSweep(void);
+void fleetSavePrevious(void);
+void fleetPose(const Fleet *prev, const Fleet *cur, int i, GLfloat t, BikePose *out);
+void updateBike(Fleet *f, int i);
+void mPush(void);
+void mPop(void);
+void mTranslate(GLfloat x, GLfloat y, GLfloat z);
+void mRotate(GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
+void mScale(GLfloat x, GLfloat y, GLfloat z);
+void mColor(GLfloat r, GLfloat g, GLfloat b);
+void submitMesh(const Mesh *m, int stipple);
+void beginBike(int i);
+void endBike(void);
+void initInstancing(void);
+void flushInstances(void);
+void initSkinning(void);
+void drawRider(void);
+void requestRedraw(void);
+void frameTick(int value);
+void simThreadStart(void);
+void simThreadStop(void);
+void dispatchEvent(const InputEvent *ev);
+void inputQueueDrain(void);
+int simSnapshotFresh(void);
+const SimSnapshot *simSnapshotTake(void);
+void postKeyboard(unsigned char key, int x, int y);
+void postKeyboardUp(unsigned char key, int x, int y);
+void postSpecial(int key, int x, int y);
+void postMouse(int button, int state, int x, int y);
+void postMotion(int x, int y);
+void initBikeMeshes(void);
+void sgJoint(int input, int sine, GLfloat scale, GLfloat offset,
+             GLfloat x, GLfloat y, GLfloat z);
+void initSceneGraph(void);
+void sgUpdateBike(int bike);
+void drawPart(int part);
+void initLods(void);
+const Mesh *lodMesh(const Mesh *m, int level);
+void prepareBike(int bike);
+void frustumExtract(void);
+int sphereVisible(GLfloat x, GLfloat y, GLfloat z, GLfloat r);
+int boxVisible(GLfloat x, GLfloat y, GLfloat z, GLfloat direction,
+               const GLfloat *mn, const GLfloat *mx);
+void buildFrame(void);
+void buildPedals(void);
+void buildPerson(void);
 
 /************************************************
- * Ham ve tru truc Z
+ * Ma tran 4x4 cot truoc: out = a * b
  ************************************************/
-void ZCylinder(GLfloat radius, GLfloat length)
+static void matMultiply(GLfloat *out, const GLfloat *a, const GLfloat *b)
 {
-    GLUquadricObj *cylinder = gluNewQuadric();
-    gluCylinder(cylinder, radius, radius, length, 15, 5);
-    gluDeleteQuadric(cylinder);
+    GLfloat r[16];
+    int i, j;
+    for (j = 0; j < 4; j++)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            r[j * 4 + i] = a[i] * b[j * 4] + a[4 + i] * b[j * 4 + 1] +
+                           a[8 + i] * b[j * 4 + 2] + a[12 + i] * b[j * 4 + 3];
+        }
+    }
+    memcpy(out, r, sizeof(r));
 }
 
-/************************************************
- * Ham ve tru truc X
- ************************************************/
-void XCylinder(GLfloat radius, GLfloat length)
+static void matIdentity(GLfloat *m)
 {
-    glPushMatrix();
-    glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
-    ZCylinder(radius, length);
-    glPopMatrix();
+    memset(m, 0, 16 * sizeof(GLfloat));
+    m[0] = m[5] = m[10] = m[15] = 1.0f;
 }
 
-/*******************************************
- * Cap nhat canh: Di chuyen xe dap
- *******************************************/
-void updateScene()
+/************************************************
+ * Ngan xep ma tran CPU: cung ngu nghia voi glPushMatrix,
+ * glTranslatef, glRotatef, glScalef
+ ************************************************/
+void mPush(void)
 {
-    GLfloat xDelta, zDelta;
-    GLfloat rotation;
-    GLfloat sin_steering, cos_steering;
-    const GLfloat DECELERATION = 0.02f;
+    static int warned = 0;
 
-    // Tu dong chay neu che do autoMove duoc bat
-    if (autoMove && speed < MAX_SPEED)
+    // Nhu glPushMatrix khi tran: bo qua, mPop tuong ung cung bo qua
+    if (matTop + 1 == MAT_STACK_DEPTH)
     {
-        speed += INC_SPEED;
-        if (speed > MAX_SPEED) speed = MAX_SPEED;
+        if (!warned) fprintf(stderr, "Ngan xep ma tran day (%d muc)\n", MAT_STACK_DEPTH);
+        warned = 1;
+        matOverflow++;
+        return;
     }
+    memcpy(matStack[matTop + 1], matStack[matTop], 16 * sizeof(GLfloat));
+    matNode[matTop + 1] = matNode[matTop];
+    matTop++;
+}
 
-    if (Abs(speed) > 0.0f && Abs(speed) < INC_SPEED / 10.0f)
-    {
-        speed = 0.0f;
-    }
-    else if (speed != 0.0f)
+void mPop(void)
+{
+    if (matOverflow > 0) matOverflow--;
+    else if (matTop > 0) matTop--;
+}
+
+void mTranslate(GLfloat x, GLfloat y, GLfloat z)
+{
+    GLfloat *m = matStack[matTop];
+    int i;
+    for (i = 0; i < 4; i++)
     {
-        speed -= (speed > 0.0f ? DECELERATION : -DECELERATION);
-        if (Abs(speed) < DECELERATION) speed = 0.0f;
+        m[12 + i] += m[i] * x + m[4 + i] * y + m[8 + i] * z;
     }
+}
 
-    if (Abs(speed) < INC_SPEED / 10.0f) return;
-
-    xDelta = speed * cos(radians(direction + steering));
-    zDelta = speed * sin(radians(direction + steering));
-    xpos += xDelta;
-    zpos -= zDelta;
+void mRotate(GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+    GLfloat r[16];
+    GLfloat a = radians(angle), c = cos(a), s = sin(a), t = 1.0f - c;
+    GLfloat len = sqrt(x * x + y * y + z * z);
 
-    pedalAngle = degrees(angleSum(radians(pedalAngle), speed / RADIUS_WHEEL));
+    x /= len; y /= len; z /= len;
+    r[0] = x * x * t + c;     r[4] = x * y * t - z * s; r[8] = x * z * t + y * s;  r[12] = 0.0f;
+    r[1] = y * x * t + z * s; r[5] = y * y * t + c;     r[9] = y * z * t - x * s;  r[13] = 0.0f;
+    r[2] = x * z * t - y * s; r[6] = y * z * t + x * s; r[10] = z * z * t + c;     r[14] = 0.0f;
+    r[3] = 0.0f;              r[7] = 0.0f;              r[11] = 0.0f;              r[15] = 1.0f;
+    matMultiply(matStack[matTop], matStack[matTop], r);
+}
 
-    sin_steering = sin(radians(steering));
-    cos_steering = cos(radians(steering));
-    rotation = atan2(speed * sin_steering, CYCLE_LENGTH + speed * cos_steering);
-    direction = degrees(angleSum(radians(direction), rotation));
+void mScale(GLfloat x, GLfloat y, GLfloat z)
+{
+    GLfloat *m = matStack[matTop];
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        m[i] *= x;
+        m[4 + i] *= y;
+        m[8 + i] *= z;
+    }
 }
 
-/******************************************
- * angleSum: Cong hai goc mod 2PI
- ******************************************/
-GLfloat angleSum(GLfloat a, GLfloat b)
+void mColor(GLfloat r, GLfloat g, GLfloat b)
 {
-    a += b;
-    while (a >= 2 * PI) a -= 2 * PI;
-    while (a < 0) a += 2 * PI;
-    return a;
+    drawColor[0] = r;
+    drawColor[1] = g;
+    drawColor[2] = b;
+    if (!drawInstanced) glColor3f(r, g, b);
 }
 
 /************************************************
- * Ve khung kim loai cua xe dap
+ * Ve mot luoi voi ma tran dinh ngan xep:
+ * ve ngay, hoac them vao lo instancing cua luoi do
  ************************************************/
-void drawFrame()
+void submitMesh(const Mesh *m, int stipple)
 {
-    glColor3f(0.4f, 0.0f, 0.0f);
+    static int last = 0;
+    InstanceBatch *b = NULL;
+    InstanceData *d;
+    int i;
 
-    glPushMatrix();
+    if (sgRecording)
     {
-        // Di chuyen den vi tri banh sau (diem xoay cho wheelie)
-        glTranslatef(-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
-        // Ap dung xoay wheelie quanh truc X tai banh sau
-        glRotatef(wheelieAngle, 1.0f, 0.0f, 0.0f);
-        // Tro ve vi tri ban dau
-        glTranslatef((BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
+        SceneItem *it;
+        if (numSceneItems == MAX_SCENE_ITEMS) return;
+        it = &sceneItems[numSceneItems++];
+        it->node = matNode[matTop];
+        it->mesh = m;
+        it->stipple = stipple;
+        memcpy(it->color, drawColor, sizeof(it->color));
+        memcpy(it->offset, matStack[matTop], sizeof(it->offset));
+        return;
+    }
 
-        // Ket noi banh rang va ban dap
+    if (!drawInstanced)
+    {
         glPushMatrix();
+        glMultMatrixf(matStack[matTop]);
+        if (stipple)
         {
-            glColor3f(0.7f, 0.0f, 0.7f);
-            glPushMatrix();
-            {
-                glTranslatef(0.0f, 0.0f, 0.10f);
-                glRotatef(-(pedalAngle + 15.0f), 0.0f, 0.0f, 1.0f);
-                gear(0.08f, 0.3f, 0.03f, 30, 0.03f);
-            }
-            glPopMatrix();
-            glColor3f(0.4f, 0.0f, 0.0f);
-            glTranslatef(0.0f, 0.0f, -0.25f);
-            ZCylinder(0.08f, 0.32f);
+            glEnable(GL_LINE_STIPPLE);
+            glLineStipple(1, chainPhase ? 0x00FF : 0x1c47);
         }
+        drawMesh(m);
+        if (stipple) glDisable(GL_LINE_STIPPLE);
         glPopMatrix();
-
-        // Thanh ben phai
-        glRotatef(RIGHT_ANGLE + 7.0f, 0.0f, 0.0f, 1.0f);
-        glScalef(1.0f, 0.8f, 1.0f);
-        XCylinder(ROD_RADIUS, RIGHT_ROD);
-
-        // Thanh giua
-        glRotatef(MIDDLE_ANGLE - (RIGHT_ANGLE + 7.0f) + 5.0f, 0.0f, 0.0f, 1.0f);
-        glScalef(0.9f, 1.1f, 1.0f);
-        XCylinder(ROD_RADIUS, MIDDLE_ROD);
-
-        // Ghe ngoi
-        glColor3f(0.1f, 1.0f, 0.3f);
-        glTranslatef(MIDDLE_ROD, 0.0f, 0.0f);
-        glRotatef(-MIDDLE_ANGLE - 7.0f, 0.0f, 0.0f, 1.0f);
-        glScalef(0.6f, ROD_RADIUS * 1.7f, 0.4f);
-        drawSeat();
-        glColor3f(0.4f, 0.0f, 0.0f);
+        return;
     }
-    glPopMatrix();
 
-    // Thanh noi ngang
-    glPushMatrix();
+    // Cac bo phan cua nhieu xe thuong den theo cung thu tu: thu lo vua dung truoc
+    if (last < numBatches && batches[last].mesh == m && batches[last].stipple == stipple)
     {
-        // Ap dung xoay wheelie cho phan nay
-        glTranslatef(-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
-        glRotatef(wheelieAngle, 1.0f, 0.0f, 0.0f);
-        glTranslatef((BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
-
-        glRotatef(-180.0f, 0.0f, 1.0f, 0.0f);
-        XCylinder(ROD_RADIUS, BACK_CONNECTOR);
-        glPushMatrix();
+        b = &batches[last];
+    }
+    for (i = 0; b == NULL && i < numBatches; i++)
+    {
+        if (batches[i].mesh == m && batches[i].stipple == stipple)
         {
-            glTranslatef(0.5f, 0.0f, WHEEL_OFFSET);
-            XCylinder(ROD_RADIUS, RADIUS_WHEEL + TUBE_WIDTH);
+            b = &batches[i];
+            last = i;
         }
-        glPopMatrix();
-        glPushMatrix();
+    }
+    if (b == NULL)
+    {
+        if (numBatches == capBatches)
         {
-            glTranslatef(0.5f, 0.0f, -WHEEL_OFFSET);
-            XCylinder(ROD_RADIUS, RADIUS_WHEEL + TUBE_WIDTH);
+            int cap = capBatches ? capBatches * 2 : MAX_BATCHES;
+            InstanceBatch *grown = (InstanceBatch *)realloc(batches, cap * sizeof(InstanceBatch));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Khong du bo nho cho lo instancing thu %d\n", numBatches + 1);
+                return;
+            }
+            memset(grown + capBatches, 0, (cap - capBatches) * sizeof(InstanceBatch));
+            batches = grown;
+            capBatches = cap;
         }
-        glPopMatrix();
+        last = numBatches;
+        b = &batches[numBatches++];
+        b->mesh = m;
+        b->stipple = stipple;
+        b->count = 0;
     }
-    glPopMatrix();
-
-    // Thanh ben trai va banh xe
-    glPushMatrix();
+    if (b->count == b->cap)
     {
-        // Ap dung xoay wheelie
-        glTranslatef(-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
-        glRotatef(wheelieAngle, 1.0f, 0.0f, 0.0f);
-        glTranslatef((BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
+        int cap = b->cap ? b->cap * 2 : 64;
+        b->data = (InstanceData *)frameGrow(b->data, b->cap * sizeof(InstanceData),
+                                            cap * sizeof(InstanceData));
+        b->cap = cap;
+    }
+    d = &b->data[b->count++];
+    memcpy(d->matrix, matStack[matTop], sizeof(d->matrix));
+    d->color[0] = drawColor[0];
+    d->color[1] = drawColor[1];
+    d->color[2] = drawColor[2];
+    d->color[3] = 1.0f;
+}
 
-        glTranslatef(-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
-        glPushMatrix();
-        {
-            glRotatef(-(2 * pedalAngle + 20.0f), 0.0f, 0.0f, 1.0f);
-            drawTyre();
-            glColor3f(1.0f, 0.3f, 0.0f);
-            gear(0.03f, 0.15f, 0.03f, 20, 0.03f);
-            glColor3f(0.4f, 0.0f, 0.0f);
-        }
-        glPopMatrix();
-        glRotatef(LEFT_ANGLE + 10.0f, 0.0f, 0.0f, 1.0f);
-        glPushMatrix();
+/************************************************
+ * Bat dau / ket thuc ve xe thu i: dat tu the va
+ * ma tran goc (vi tri, huong) cua xe
+ ************************************************/
+void beginBike(int i)
+{
+    pose = poses[i];
+    currentBike = i;
+    matTop = matOverflow = 0;
+    matIdentity(matStack[0]);
+    if (drawInstanced)
+    {
+        mTranslate(pose.xpos, pose.groundY, pose.zpos);
+        mRotate(pose.direction, 0.0f, 1.0f, 0.0f);
+        if (pose.pitch != 0.0f)
         {
-            glTranslatef(0.0f, 0.0f, -WHEEL_OFFSET);
-            XCylinder(ROD_RADIUS, WHEEL_LEN);
+            // Doc: xoay quanh truc banh sau de banh truoc cham dat
+            mTranslate(REAR_WHEEL_X, 0.0f, 0.0f);
+            mRotate(pose.pitch, 0.0f, 0.0f, 1.0f);
+            mTranslate(-REAR_WHEEL_X, 0.0f, 0.0f);
         }
-        glPopMatrix();
+    }
+    else
+    {
         glPushMatrix();
+        glTranslatef(pose.xpos, pose.groundY, pose.zpos);
+        glRotatef(pose.direction, 0.0f, 1.0f, 0.0f);
+        if (pose.pitch != 0.0f)
         {
-            glTranslatef(0.0f, 0.0f, WHEEL_OFFSET);
-            XCylinder(ROD_RADIUS, WHEEL_LEN);
+            glTranslatef(REAR_WHEEL_X, 0.0f, 0.0f);
+            glRotatef(pose.pitch, 0.0f, 0.0f, 1.0f);
+            glTranslatef(-REAR_WHEEL_X, 0.0f, 0.0f);
         }
-        glPopMatrix();
-        glTranslatef(WHEEL_LEN, 0.0f, 0.0f);
-        XCylinder(ROD_RADIUS, CRANK_ROD);
-        glTranslatef(CRANK_ROD, 0.0f, 0.0f);
-        glRotatef(-LEFT_ANGLE - 7.0f, 0.0f, 0.0f, 1.0f);
-        XCylinder(ROD_RADIUS, TOP_LEN);
-        glTranslatef(TOP_LEN, 0.0f, 0.0f);
-        glRotatef(-FRONT_INCLINE - 10.0f, 0.0f, 0.0f, 1.0f);
-        glPushMatrix();
-        {
-            glTranslatef(-0.1f, 0.0f, 0.0f);
-            XCylinder(ROD_RADIUS, 0.45f);
+    }
+}
+
+void endBike(void)
+{
+    if (!drawInstanced) glPopMatrix();
+}
+
+/************************************************
+ * Ghi do thi: them khop xoay tai vi tri hien tai cua ngan xep.
+ * Bien doi tich luy tu nut truoc thanh phan co dinh 'pre' cua
+ * khop; sau khop ngan xep bat dau lai tu don vi.
+ ************************************************/
+void sgJoint(int input, int sine, GLfloat scale, GLfloat offset,
+             GLfloat x, GLfloat y, GLfloat z)
+{
+    SceneNode *n;
+
+    if (numSceneNodes == MAX_SCENE_NODES) return;
+    n = &sceneNodes[numSceneNodes];
+    n->parent = matNode[matTop];
+    n->input = input;
+    n->sine = sine;
+    n->scale = scale;
+    n->offset = offset;
+    n->axis[0] = x;
+    n->axis[1] = y;
+    n->axis[2] = z;
+    memcpy(n->pre, matStack[matTop], sizeof(n->pre));
+    matNode[matTop] = numSceneNodes++;
+    matIdentity(matStack[matTop]);
+}
+
+// Goc cua bo phan: nut co dinh khong co cha
+static void sgBeginPart(int part)
+{
+    partFirstItem[part] = numSceneItems;
+    partFirstNode[part] = numSceneNodes;
+    matTop = matOverflow = 0;
+    matIdentity(matStack[0]);
+    matNode[0] = -1;
+    sgJoint(SG_STATIC, 0, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+// Bien doi cuc bo cua khop theo gia tri dau vao
+static void sgLocal(const SceneNode *n, GLfloat value, GLfloat *out)
+{
+    GLfloat angle = n->scale * (n->sine ? sin(radians(value)) : value) + n->offset;
+
+    memcpy(matStack[0], n->pre, 16 * sizeof(GLfloat));
+    matTop = matOverflow = 0;
+    mRotate(angle, n->axis[0], n->axis[1], n->axis[2]);
+    memcpy(out, matStack[0], 16 * sizeof(GLfloat));
+}
+
+static const GLfloat *sgNodeWorld(const BikeTransforms *t, int node)
+{
+    static const GLfloat identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    if (node < 0) return identity;
+    if (sceneNodes[node].slot < 0) return sceneNodes[node].world;
+    return t->world + sceneNodes[node].slot * 16;
+}
+
+/************************************************
+ * Dung do thi mot lan tu ma dung cua tung bo phan (ghi lai
+ * thay vi ve), roi tinh truoc moi nut va luoi co dinh
+ ************************************************/
+void initSceneGraph(void)
+{
+    int i, bike;
+    size_t floats;
+
+    numSceneNodes = numSceneItems = 0;
+    sgRecording = 1;
+    sgBeginPart(PART_FRAME);
+    buildFrame();
+    sgBeginPart(PART_PEDALS);
+    buildPedals();
+    sgBeginPart(PART_PERSON);
+    buildPerson();
+    partFirstItem[NUM_PARTS] = numSceneItems;
+    partFirstNode[NUM_PARTS] = numSceneNodes;
+    sgRecording = 0;
+    matTop = matOverflow = 0;
+
+    sgAnimNodes = sgAnimItems = 0;
+    for (i = 0; i < numSceneNodes; i++)
+    {
+        SceneNode *n = &sceneNodes[i];
+        n->mask = (n->input >= 0 ? 1 << n->input : 0) |
+                  (n->parent >= 0 ? sceneNodes[n->parent].mask : 0);
+        n->slot = n->mask ? sgAnimNodes++ : -1;
+        memcpy(n->local, n->pre, sizeof(n->local));
+        if (!n->mask)
+        {
+            matMultiply(n->world, sgNodeWorld(NULL, n->parent), n->local);
         }
-        glPopMatrix();
-        glPushMatrix();
+    }
+    for (i = 0; i < numSceneItems; i++)
+    {
+        SceneItem *it = &sceneItems[i];
+        int level;
+        for (level = 0; level < NUM_LODS; level++)
+        {
+            it->lods[level] = lodMesh(it->mesh, level);
+        }
+        it->slot = sceneNodes[it->node].mask ? sgAnimItems++ : -1;
+        if (it->slot < 0)
+        {
+            matMultiply(it->world, sceneNodes[it->node].world, it->offset);
+        }
+    }
+
+    bikeTransforms = (BikeTransforms *)calloc(fleet.count, sizeof(BikeTransforms));
+    floats = (2 * sgAnimNodes + sgAnimItems) * 16;
+    for (bike = 0; bike < fleet.count && bikeTransforms; bike++)
+    {
+        BikeTransforms *t = &bikeTransforms[bike];
+        t->local = (GLfloat *)malloc(floats * sizeof(GLfloat));
+        if (!t->local) break;
+        t->world = t->local + sgAnimNodes * 16;
+        t->items = t->world + sgAnimNodes * 16;
+    }
+    if (!bikeTransforms || bike < fleet.count)
+    {
+        fprintf(stderr, "Khong du bo nho cho do thi canh cua %d xe\n", fleet.count);
+        exit(1);
+    }
+}
+
+/************************************************
+ * Cap nhat bo nho ma tran cua mot xe: chi nhung nut va
+ * luoi phu thuoc dau vao vua doi (co ban) moi tinh lai
+ ************************************************/
+void sgUpdateBike(int bike)
+{
+    BikeTransforms *t = &bikeTransforms[bike];
+    GLfloat inputs[SG_NUM_INPUTS];
+    int changed = 0, i, k;
+
+    inputs[SG_INPUT_WHEELIE] = pose.wheelieAngle;
+    inputs[SG_INPUT_PEDAL] = pose.pedalAngle;
+    inputs[SG_INPUT_STEERING] = pose.steering;
+    for (k = 0; k < SG_NUM_INPUTS; k++)
+    {
+        if (!t->valid || t->inputs[k] != inputs[k]) changed |= 1 << k;
+        t->inputs[k] = inputs[k];
+    }
+    t->valid = 1;
+    if (!changed) return;
+
+    // Nut cha luon dung truoc nut con nen mot luot theo thu tu la du;
+    // bo phan da khop xuong tren GPU nam sau cung va duoc bo qua
+    for (i = 0; i < partFirstNode[sgCpuParts]; i++)
+    {
+        const SceneNode *n = &sceneNodes[i];
+        const GLfloat *local = n->local;
+
+        if (!(n->mask & changed)) continue;
+        if (n->input >= 0)
         {
-            glRotatef(-steering * 1.5f, 1.0f, 0.0f, 0.0f);
-            glTranslatef(-0.3f, 0.0f, 0.0f);
-            glPushMatrix();
+            local = t->local + n->slot * 16;
+            if (changed & (1 << n->input))
             {
-                glRotatef(FRONT_INCLINE + 15.0f, 0.0f, 0.0f, 1.0f);
-                glPushMatrix();
-                {
-                    glTranslatef(0.0f, 0.0f, -HANDLE_ROD / 2);
-                    ZCylinder(ROD_RADIUS, HANDLE_ROD);
-                }
-                glPopMatrix();
-                glPushMatrix();
-                {
-                    glColor3f(0.0f, 1.0f, 0.9f);
-                    glTranslatef(0.0f, 0.0f, -HANDLE_ROD / 2);
-                    ZCylinder(0.07f, HANDLE_ROD / 4);
-                    glTranslatef(0.0f, 0.0f, HANDLE_ROD * 3 / 4);
-                    ZCylinder(0.07f, HANDLE_ROD / 4);
-                    glColor3f(0.4f, 0.0f, 0.0f);
-                }
-                glPopMatrix();
+                sgLocal(n, inputs[n->input], t->local + n->slot * 16);
+                sgMatrixUpdates++;
             }
-            glPopMatrix();
-            glPushMatrix();
+        }
+        matMultiply(t->world + n->slot * 16, sgNodeWorld(t, n->parent), local);
+        sgMatrixUpdates++;
+    }
+    for (i = 0; i < partFirstItem[sgCpuParts]; i++)
+    {
+        const SceneItem *it = &sceneItems[i];
+        if (it->slot < 0 || !(sceneNodes[it->node].mask & changed)) continue;
+        matMultiply(t->items + it->slot * 16, sgNodeWorld(t, it->node), it->offset);
+        sgMatrixUpdates++;
+    }
+}
+
+/************************************************
+ * Ve mot bo phan cua xe hien tai tu ma tran da luu:
+ * moi luoi chi con mot phep nhan voi ma tran goc cua xe
+ ************************************************/
+void drawPart(int part)
+{
+    const BikeTransforms *t = &bikeTransforms[currentBike];
+    int i;
+
+    for (i = partFirstItem[part]; i < partFirstItem[part + 1]; i++)
+    {
+        const SceneItem *it = &sceneItems[i];
+        const GLfloat *world = it->slot < 0 ? it->world : t->items + it->slot * 16;
+
+        if (it->lods[t->lod] == NULL) continue;
+        mPush();
+        matMultiply(matStack[matTop], matStack[matTop], world);
+        mColor(it->color[0], it->color[1], it->color[2]);
+        submitMesh(it->lods[t->lod], it->stipple);
+        mPop();
+    }
+    mColor(0.4f, 0.0f, 0.0f);
+}
+
+/************************************************
+ * Chon muc chi tiet cho xe theo chieu cao tren man hinh;
+ * bien tre quanh nguong de xe o gan nguong khong nhay muc
+ ************************************************/
+static int selectLod(int current, GLfloat px)
+{
+    static const GLfloat thresholds[NUM_LODS - 1] = { LOD_NEAR_PX, LOD_FAR_PX };
+    int level = current;
+
+    while (level > 0 && px > thresholds[level - 1] * (1.0f + LOD_HYSTERESIS)) level--;
+    while (level < NUM_LODS - 1 && px < thresholds[level] * (1.0f - LOD_HYSTERESIS)) level++;
+    return level;
+}
+
+/************************************************
+ * Lay sau mat phang cua khung nhin tu ma tran chieu va
+ * ma tran camera (Gribb & Hartmann); goi sau khi dat camera
+ ************************************************/
+void frustumExtract(void)
+{
+    GLfloat proj[16], clip[16];
+    int i, k;
+
+    glGetFloatv(GL_PROJECTION_MATRIX, proj);
+    matMultiply(clip, proj, viewMatrix);
+    for (i = 0; i < 6; i++)
+    {
+        GLfloat sign = (i & 1) ? -1.0f : 1.0f;
+        int row = i / 2;
+        GLfloat len;
+
+        // Trai/phai, duoi/tren, gan/xa: hang 3 +/- hang 0, 1, 2
+        for (k = 0; k < 4; k++)
+        {
+            frustum[i][k] = clip[k * 4 + 3] + sign * clip[k * 4 + row];
+        }
+        len = sqrt(frustum[i][0] * frustum[i][0] + frustum[i][1] * frustum[i][1] +
+                   frustum[i][2] * frustum[i][2]);
+        for (k = 0; k < 4; k++) frustum[i][k] /= len;
+    }
+}
+
+/************************************************
+ * Hinh cau (toa do the gioi) co phan nao trong khung nhin
+ ************************************************/
+int sphereVisible(GLfloat x, GLfloat y, GLfloat z, GLfloat r)
+{
+    int i;
+    for (i = 0; i < 6; i++)
+    {
+        const GLfloat *f = frustum[i];
+        if (f[0] * x + f[1] * y + f[2] * z + f[3] < -r) return 0;
+    }
+    return 1;
+}
+
+/************************************************
+ * Hop [mn, mx] trong he toa do cua xe dat tai (x, y, z), quay
+ * 'direction' do quanh Y: dua mat phang ve he cua xe roi thu
+ * dinh xa nhat theo phia phap tuyen
+ ************************************************/
+int boxVisible(GLfloat x, GLfloat y, GLfloat z, GLfloat direction,
+               const GLfloat *mn, const GLfloat *mx)
+{
+    GLfloat a = radians(direction), c = cos(a), s = sin(a);
+    int i;
+
+    for (i = 0; i < 6; i++)
+    {
+        const GLfloat *f = frustum[i];
+        GLfloat n[3], d;
+
+        n[0] = c * f[0] - s * f[2];
+        n[1] = f[1];
+        n[2] = s * f[0] + c * f[2];
+        d = f[0] * x + f[1] * y + f[2] * z + f[3];
+        d += n[0] * (n[0] > 0.0f ? mx[0] : mn[0]);
+        d += n[1] * (n[1] > 0.0f ? mx[1] : mn[1]);
+        d += n[2] * (n[2] > 0.0f ? mx[2] : mn[2]);
+        if (d < 0.0f) return 0;
+    }
+    return 1;
+}
+
+/************************************************
+ * Chuan bi xe truoc khi ve trong khung: cap nhat ma tran
+ * bo phan va chon muc chi tiet
+ ************************************************/
+void prepareBike(int bike)
+{
+    BikeTransforms *t = &bikeTransforms[bike];
+    const GLfloat *v = viewMatrix;
+    GLfloat ex, ey, ez, dist, px;
+    int part;
+
+    pose = poses[bike];
+    cullStats.bikes++;
+    t->visible = (1 << NUM_PARTS) - 1;
+    if (useCulling)
+    {
+        // Xe nghieng theo doc: noi rong hinh cau, bo thu tung bo phan
+        GLfloat slope = Abs((GLfloat)sin(radians(pose.pitch)));
+
+        if (!sphereVisible(pose.xpos, pose.groundY, pose.zpos, BIKE_RADIUS * (1.0f + slope)))
+        {
+            // Ca xe ngoai khung: khong can cap nhat ma tran hay chon muc
+            t->visible = 0;
+            cullStats.bikesCulled++;
+            return;
+        }
+        for (part = 0; part < NUM_PARTS && pose.pitch == 0.0f; part++)
+        {
+            cullStats.parts++;
+            if (!boxVisible(pose.xpos, pose.groundY, pose.zpos, pose.direction,
+                            partBounds[part][0], partBounds[part][1]))
             {
-                XCylinder(ROD_RADIUS, CRANK_ROD);
-                glTranslatef(CRANK_ROD, 0.0f, 0.0f);
-                glRotatef(CRANK_ANGLE + 15.0f, 0.0f, 0.0f, 1.0f);
-                glPushMatrix();
-                {
-                    glTranslatef(0.0f, 0.0f, WHEEL_OFFSET);
-                    XCylinder(ROD_RADIUS, CRANK_RODS);
-                }
-                glPopMatrix();
-                glPushMatrix();
-                {
-                    glTranslatef(0.0f, 0.0f, -WHEEL_OFFSET);
-                    XCylinder(ROD_RADIUS, CRANK_RODS);
-                }
-                glPopMatrix();
-                glTranslatef(CRANK_RODS, 0.0f, 0.0f);
-                glRotatef(-2 * pedalAngle - 15.0f, 0.0f, 0.0f, 1.0f);
-                drawTyre();
+                t->visible &= ~(1 << part);
+                cullStats.partsCulled++;
             }
-            glPopMatrix();
         }
-        glPopMatrix();
     }
-    glPopMatrix();
+    sgUpdateBike(bike);
+
+    if (lodForce >= 0)
+    {
+        t->lod = lodForce < NUM_LODS ? lodForce : NUM_LODS - 1;
+    }
+    else
+    {
+        // Tam hinh cau bao xe trong he toa do mat
+        ex = v[0] * pose.xpos + v[4] * pose.groundY + v[8] * pose.zpos + v[12];
+        ey = v[1] * pose.xpos + v[5] * pose.groundY + v[9] * pose.zpos + v[13];
+        ez = v[2] * pose.xpos + v[6] * pose.groundY + v[10] * pose.zpos + v[14];
+        dist = sqrt(ex * ex + ey * ey + ez * ez);
+        if (dist < 0.1f) dist = 0.1f;
+        // Goc nhin doc 60 do: nua chieu cao khung nhin ung voi tan(30)
+        px = BIKE_RADIUS * viewHeight / (dist * (GLfloat)tan(PI / 6.0));
+        t->lod = selectLod(t->lod, px);
+    }
+    lodCounts[t->lod]++;
 }
 
-/********************************************
- * Ve banh rang
- ********************************************/
-void gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
-          GLint teeth, GLfloat tooth_depth)
+/************************************************
+ * Ham ve tru truc Z
+ ************************************************/
+void ZCylinder(GLfloat radius, GLfloat length)
 {
-    GLint i;
-    GLfloat r0 = inner_radius;
-    GLfloat r1 = outer_radius - tooth_depth / 2.0f;
-    GLfloat r2 = outer_radius + tooth_depth / 2.0f;
-    GLfloat angle, da = 2.0 * PI / teeth / 4.0;
+    mPush();
+    mScale(radius, radius, length);
+    submitMesh(&cylinderMesh, 0);
+    mPop();
+}
 
-    glShadeModel(GL_FLAT);
-    glNormal3f(0.0f, 0.0f, 1.0f);
+/************************************************
+ * Ham ve tru truc X
+ ************************************************/
+void XCylinder(GLfloat radius, GLfloat length)
+{
+    mPush();
+    mRotate(90.0f, 0.0f, 1.0f, 0.0f);
+    ZCylinder(radius, length);
+    mPop();
+}
 
-    glBegin(GL_QUAD_STRIP);
-    for (i = 0; i <= teeth; i++)
+/************************************************
+ * Ve hinh lap phuong, cau, xuyen tu bo dem san
+ ************************************************/
+void solidCube(GLfloat size)
+{
+    mPush();
+    mScale(size, size, size);
+    submitMesh(&cubeMesh, 0);
+    mPop();
+}
+
+void solidSphere(GLfloat radius)
+{
+    mPush();
+    mScale(radius, radius, radius);
+    submitMesh(&sphereMesh, 0);
+    mPop();
+}
+
+/************************************************
+ * Nap cac ham OpenGL mo rong (VBO)
+ ************************************************/
+static void *getGLProc(const char *name)
+{
+#ifdef XEDAP_HEADLESS
+    if (headless) return (void *)eglGetProcAddress(name);
+#endif
+#ifdef _WIN32
+    return (void *)wglGetProcAddress(name);
+#else
+    return (void *)glXGetProcAddressARB((const GLubyte *)name);
+#endif
+}
+
+void loadGLExtensions(void)
+{
+    const char *version = (const char *)glGetString(GL_VERSION);
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    int major, minor;
+
+    // VBO co san tu OpenGL 1.5; driver cu chi dung mang phia client
+    if (version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2) return;
+    if (major == 1 && minor < 5) return;
+
+    pglGenBuffers = (PFNGLGENBUFFERSPROC)getGLProc("glGenBuffers");
+    pglBindBuffer = (PFNGLBINDBUFFERPROC)getGLProc("glBindBuffer");
+    pglBufferData = (PFNGLBUFFERDATAPROC)getGLProc("glBufferData");
+    pglDeleteBuffers = (PFNGLDELETEBUFFERSPROC)getGLProc("glDeleteBuffers");
+    pglBufferSubData = (PFNGLBUFFERSUBDATAPROC)getGLProc("glBufferSubData");
+    if (!pglGenBuffers || !pglBindBuffer || !pglBufferData || !pglDeleteBuffers)
     {
-        angle = i * 2.0 * PI / teeth;
-        glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5f);
-        glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5f);
-        glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5f);
-        glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f);
+        pglGenBuffers = NULL;
     }
-    glEnd();
 
-    glNormal3f(0.0f, 0.0f, -1.0f);
-    glBegin(GL_QUAD_STRIP);
-    for (i = 0; i <= teeth; i++)
+    // Do thoi gian GPU: OpenGL 3.3 hoac GL_ARB_timer_query
+    if (major > 3 || (major == 3 && minor >= 3) ||
+        (extensions && strstr(extensions, "GL_ARB_timer_query")))
     {
-        angle = i * 2.0 * PI / teeth;
-        glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5f);
-        glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5f);
-        glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f);
-        glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5f);
+        pglGenQueries = (PFNGLGENQUERIESPROC)getGLProc("glGenQueries");
+        pglBeginQuery = (PFNGLBEGINQUERYPROC)getGLProc("glBeginQuery");
+        pglEndQuery = (PFNGLENDQUERYPROC)getGLProc("glEndQuery");
+        pglGetQueryObjectui64v =
+            (PFNGLGETQUERYOBJECTUI64VPROC)getGLProc("glGetQueryObjectui64v");
+        gpuTimers = pglGenQueries && pglBeginQuery && pglEndQuery &&
+                    pglGetQueryObjectui64v;
     }
-    glEnd();
+}
 
-    glBegin(GL_QUADS);
-    for (i = 0; i < teeth; i++)
+/************************************************
+ * Chieu sang giong GL_LIGHT0 co dinh (khuech tan + phan chieu,
+ * vat lieu theo mau); dung chung cho cac vertex shader.
+ * 'model' la ma tran tu luoi den khong gian cua modelview
+ ************************************************/
+static const char *lightingSource =
+    "#version 120\n"
+    "vec4 shade(mat4 model, vec4 diffuse)\n"
+    "{\n"
+    "    mat3 m = mat3(model[0].xyz, model[1].xyz, model[2].xyz);\n"
+    "    mat3 cof = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));\n"
+    "    vec3 n = normalize(gl_NormalMatrix * (cof * gl_Normal));\n"
+    "    vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+    "    float ndl = max(dot(n, l), 0.0);\n"
+    "    vec4 c = (gl_LightModel.ambient + gl_LightSource[0].ambient) * gl_FrontMaterial.ambient\n"
+    "           + ndl * diffuse * gl_LightSource[0].diffuse;\n"
+    "    if (ndl > 0.0)\n"
+    "    {\n"
+    "        vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));\n"
+    "        c += pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess)\n"
+    "             * gl_FrontMaterial.specular * gl_LightSource[0].specular;\n"
+    "    }\n"
+    "    return vec4(c.rgb, diffuse.a);\n"
+    "}\n";
+
+/************************************************
+ * Shader instancing: ma tran va mau cua tung ban sao la
+ * thuoc tinh dinh (divisor 1)
+ ************************************************/
+static const char *instanceVertexSource =
+    "attribute vec4 instCol0, instCol1, instCol2, instCol3;\n"
+    "attribute vec4 instColor;\n"
+    "uniform int useVertexColor;\n"
+    "void main()\n"
+    "{\n"
+    "    mat4 model = mat4(instCol0, instCol1, instCol2, instCol3);\n"
+    "    gl_FrontColor = shade(model, useVertexColor != 0 ? gl_Color : instColor);\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * (model * gl_Vertex);\n"
+    "}\n";
+
+/************************************************
+ * Shader khop xuong cua nguoi lai: di tu nut cua dinh len goc,
+ * moi nut la bonePre * xoay(goc) nhu sgLocal(). Dau vao tu the
+ * (wheelie, ban dap, tay lai) la mot thuoc tinh: hang so khi ve
+ * mot xe, theo ban sao khi instancing
+ ************************************************/
+static const char *skinVertexSource =
+    "attribute vec4 instCol0, instCol1, instCol2, instCol3;\n"
+    "attribute vec4 riderInputs;\n"
+    "uniform mat4 bonePre[" SKIN_STR(MAX_SKIN_BONES) "];\n"
+    "uniform vec4 boneAxis[" SKIN_STR(MAX_SKIN_BONES) "];\n"     // xyz: truc xoay, w: he so
+    "uniform vec4 boneJoint[" SKIN_STR(MAX_SKIN_BONES) "];\n"    // x: goc cong, y: dau vao (-1: co dinh), z: sin, w: nut cha
+    "mat4 rotation(float angle, vec3 axis)\n"
+    "{\n"
+    "    vec3 a = normalize(axis);\n"
+    "    float c = cos(radians(angle)), s = sin(radians(angle)), t = 1.0 - c;\n"
+    "    return mat4(a.x * a.x * t + c, a.y * a.x * t + a.z * s, a.x * a.z * t - a.y * s, 0.0,\n"
+    "                a.x * a.y * t - a.z * s, a.y * a.y * t + c, a.y * a.z * t + a.x * s, 0.0,\n"
+    "                a.x * a.z * t + a.y * s, a.y * a.z * t - a.x * s, a.z * a.z * t + c, 0.0,\n"
+    "                0.0, 0.0, 0.0, 1.0);\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "    mat4 skin = mat4(1.0);\n"
+    "    int bone = int(gl_MultiTexCoord0.x);\n"
+    "    for (int d = 0; d < " SKIN_STR(MAX_SKIN_DEPTH) "; d++)\n"
+    "    {\n"
+    "        if (bone < 0) break;\n"
+    "        vec4 j = boneJoint[bone];\n"
+    "        mat4 local = bonePre[bone];\n"
+    "        if (j.y >= 0.0)\n"
+    "        {\n"
+    "            float value = j.y < 0.5 ? riderInputs.x : (j.y < 1.5 ? riderInputs.y : riderInputs.z);\n"
+    "            if (j.z > 0.5) value = sin(radians(value));\n"
+    "            local = local * rotation(boneAxis[bone].w * value + j.x, boneAxis[bone].xyz);\n"
+    "        }\n"
+    "        skin = local * skin;\n"
+    "        bone = int(j.w);\n"
+    "    }\n"
+    "    mat4 model = mat4(instCol0, instCol1, instCol2, instCol3) * skin;\n"
+    "    gl_FrontColor = shade(model, gl_Color);\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * (model * gl_Vertex);\n"
+    "}\n";
+
+static const char *instanceFragmentSource =
+    "#version 120\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = gl_Color;\n"
+    "}\n";
+
+static GLuint compileShader(GLenum type, const char *source)
+{
+    GLuint shader = pglCreateShader(type);
+    GLint ok = 0;
+    char log[1024];
+    const char *sources[2] = { lightingSource, source };
+
+    // Vertex shader noi sau phan chieu sang (co dong #version)
+    if (type == GL_VERTEX_SHADER)
+    {
+        pglShaderSource(shader, 2, sources, NULL);
+    }
+    else
     {
-        angle = i * 2.0 * PI / teeth;
-        glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f);
-        glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f);
-        glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f);
-        glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5f);
+        pglShaderSource(shader, 1, &source, NULL);
     }
-    glEnd();
+    pglCompileShader(shader);
+    pglGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok)
+    {
+        pglGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Loi bien dich shader:\n%s\n", log);
+        return 0;
+    }
+    return shader;
+}
+
+/************************************************
+ * Nap ham OpenGL 3.3 va tao shader instancing
+ ************************************************/
+void initInstancing(void)
+{
+    const char *version = (const char *)glGetString(GL_VERSION);
+    int major = 0, minor = 0;
+    GLuint vs, fs;
+    GLint ok = 0;
+
+    if (pglGenBuffers == NULL || version == NULL) return;
+    if (sscanf(version, "%d.%d", &major, &minor) != 2) return;
+    if (major < 3 || (major == 3 && minor < 3)) return;
+
+    pglCreateShader = (PFNGLCREATESHADERPROC)getGLProc("glCreateShader");
+    pglShaderSource = (PFNGLSHADERSOURCEPROC)getGLProc("glShaderSource");
+    pglCompileShader = (PFNGLCOMPILESHADERPROC)getGLProc("glCompileShader");
+    pglGetShaderiv = (PFNGLGETSHADERIVPROC)getGLProc("glGetShaderiv");
+    pglGetShaderInfoLog = (PFNGLGETSHADERINFOLOGPROC)getGLProc("glGetShaderInfoLog");
+    pglCreateProgram = (PFNGLCREATEPROGRAMPROC)getGLProc("glCreateProgram");
+    pglAttachShader = (PFNGLATTACHSHADERPROC)getGLProc("glAttachShader");
+    pglBindAttribLocation = (PFNGLBINDATTRIBLOCATIONPROC)getGLProc("glBindAttribLocation");
+    pglLinkProgram = (PFNGLLINKPROGRAMPROC)getGLProc("glLinkProgram");
+    pglGetProgramiv = (PFNGLGETPROGRAMIVPROC)getGLProc("glGetProgramiv");
+    pglGetProgramInfoLog = (PFNGLGETPROGRAMINFOLOGPROC)getGLProc("glGetProgramInfoLog");
+    pglUseProgram = (PFNGLUSEPROGRAMPROC)getGLProc("glUseProgram");
+    pglGetUniformLocation = (PFNGLGETUNIFORMLOCATIONPROC)getGLProc("glGetUniformLocation");
+    pglUniform1i = (PFNGLUNIFORM1IPROC)getGLProc("glUniform1i");
+    pglUniform4fv = (PFNGLUNIFORM4FVPROC)getGLProc("glUniform4fv");
+    pglUniformMatrix4fv = (PFNGLUNIFORMMATRIX4FVPROC)getGLProc("glUniformMatrix4fv");
+    pglVertexAttrib4fv = (PFNGLVERTEXATTRIB4FVPROC)getGLProc("glVertexAttrib4fv");
+    pglVertexAttribPointer = (PFNGLVERTEXATTRIBPOINTERPROC)getGLProc("glVertexAttribPointer");
+    pglEnableVertexAttribArray =
+        (PFNGLENABLEVERTEXATTRIBARRAYPROC)getGLProc("glEnableVertexAttribArray");
+    pglDisableVertexAttribArray =
+        (PFNGLDISABLEVERTEXATTRIBARRAYPROC)getGLProc("glDisableVertexAttribArray");
+    pglVertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISORPROC)getGLProc("glVertexAttribDivisor");
+    pglDrawElementsInstanced =
+        (PFNGLDRAWELEMENTSINSTANCEDPROC)getGLProc("glDrawElementsInstanced");
+    if (!pglCreateShader || !pglShaderSource || !pglCompileShader || !pglGetShaderiv ||
+        !pglGetShaderInfoLog || !pglCreateProgram || !pglAttachShader ||
+        !pglBindAttribLocation || !pglLinkProgram || !pglGetProgramiv ||
+        !pglGetProgramInfoLog || !pglUseProgram || !pglGetUniformLocation ||
+        !pglUniform1i || !pglUniform4fv || !pglUniformMatrix4fv || !pglVertexAttrib4fv ||
+        !pglVertexAttribPointer || !pglEnableVertexAttribArray ||
+        !pglDisableVertexAttribArray || !pglVertexAttribDivisor ||
+        !pglDrawElementsInstanced || !pglBufferSubData)
+    {
+        return;
+    }
+    shadersAvailable = 1;
+    pglGenBuffers(1, &instanceVbo);
+    if (!useInstancing) return;
+
+    vs = compileShader(GL_VERTEX_SHADER, instanceVertexSource);
+    fs = compileShader(GL_FRAGMENT_SHADER, instanceFragmentSource);
+    if (!vs || !fs) return;
+
+    instanceProgram = pglCreateProgram();
+    pglAttachShader(instanceProgram, vs);
+    pglAttachShader(instanceProgram, fs);
+    pglBindAttribLocation(instanceProgram, ATTRIB_INSTANCE_MATRIX + 0, "instCol0");
+    pglBindAttribLocation(instanceProgram, ATTRIB_INSTANCE_MATRIX + 1, "instCol1");
+    pglBindAttribLocation(instanceProgram, ATTRIB_INSTANCE_MATRIX + 2, "instCol2");
+    pglBindAttribLocation(instanceProgram, ATTRIB_INSTANCE_MATRIX + 3, "instCol3");
+    pglBindAttribLocation(instanceProgram, ATTRIB_INSTANCE_COLOR, "instColor");
+    pglLinkProgram(instanceProgram);
+    pglGetProgramiv(instanceProgram, GL_LINK_STATUS, &ok);
+    if (!ok)
+    {
+        char log[1024];
+        pglGetProgramInfoLog(instanceProgram, sizeof(log), NULL, log);
+        fprintf(stderr, "Loi lien ket shader:\n%s\n", log);
+        return;
+    }
+    useVertexColorLoc = pglGetUniformLocation(instanceProgram, "useVertexColor");
+    instancingAvailable = 1;
+}
+
+static void drawSkinMesh(const SkinMesh *m, GLsizei instances);
+
+/************************************************
+ * Du lieu ban sao nam trong frameArena: bo truoc khi vung nho
+ * duoc dat lai (ca lo khong ve khung nay)
+ ************************************************/
+void instanceBatchesReset(void)
+{
+    int i;
+
+    for (i = 0; i < numBatches; i++)
+    {
+        batches[i].data = NULL;
+        batches[i].cap = batches[i].count = 0;
+    }
+    for (i = 0; i < NUM_LODS; i++)
+    {
+        skinBatches[i].data = NULL;
+        skinBatches[i].cap = skinBatches[i].count = 0;
+    }
+}
+
+/************************************************
+ * Ve tat ca lo instancing: mot lan tai du lieu ban sao
+ * vao mot bo dem, moi luoi mot lenh ve (hai neu co doan thang)
+ ************************************************/
+void flushInstances(void)
+{
+    GLsizeiptr total = 0, offset = 0;
+    int i, k;
+
+    for (i = 0; i < numBatches; i++) total += batches[i].count * sizeof(InstanceData);
+    for (i = 0; i < NUM_LODS; i++) total += skinBatches[i].count * sizeof(InstanceData);
+    if (total == 0) return;
+
+    pglBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+    if (total > instanceVboSize)
+    {
+        instanceVboSize = total * 2;
+    }
+    // Bo dem moi moi khung de driver khong phai cho khung truoc ve xong
+    pglBufferData(GL_ARRAY_BUFFER, instanceVboSize, NULL, GL_STREAM_DRAW);
+    for (i = 0; i < numBatches; i++)
+    {
+        GLsizeiptr size = batches[i].count * sizeof(InstanceData);
+        if (size > 0) pglBufferSubData(GL_ARRAY_BUFFER, offset, size, batches[i].data);
+        offset += size;
+    }
+    for (i = 0; i < NUM_LODS; i++)
+    {
+        GLsizeiptr size = skinBatches[i].count * sizeof(InstanceData);
+        if (size > 0) pglBufferSubData(GL_ARRAY_BUFFER, offset, size, skinBatches[i].data);
+        offset += size;
+    }
+
+    pglUseProgram(instanceProgram);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    for (k = 0; k < 5; k++)
+    {
+        pglEnableVertexAttribArray(ATTRIB_INSTANCE_MATRIX + k);
+        pglVertexAttribDivisor(ATTRIB_INSTANCE_MATRIX + k, 1);
+    }
+
+    offset = 0;
+    for (i = 0; i < numBatches; i++)
+    {
+        InstanceBatch *b = &batches[i];
+        const Mesh *m = b->mesh;
+        GLsizei numTriangles = m->numIndices - m->numLines;
+
+        if (b->count == 0) continue;
+
+        pglBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+        glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), (const GLvoid *)0);
+        glNormalPointer(GL_FLOAT, sizeof(MeshVertex), (const GLvoid *)(3 * sizeof(GLfloat)));
+        if (m->hasColor)
+        {
+            glEnableClientState(GL_COLOR_ARRAY);
+            glColorPointer(3, GL_FLOAT, sizeof(MeshVertex), (const GLvoid *)(6 * sizeof(GLfloat)));
+        }
+        pglUniform1i(useVertexColorLoc, m->hasColor ? 1 : 0);
+
+        pglBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+        for (k = 0; k < 5; k++)
+        {
+            pglVertexAttribPointer(ATTRIB_INSTANCE_MATRIX + k, 4, GL_FLOAT, GL_FALSE,
+                                   sizeof(InstanceData),
+                                   (const GLvoid *)(offset + k * 4 * sizeof(GLfloat)));
+        }
+
+        if (b->stipple)
+        {
+            glEnable(GL_LINE_STIPPLE);
+            glLineStipple(1, chainPhase ? 0x00FF : 0x1c47);
+        }
+        if (numTriangles > 0)
+        {
+            pglDrawElementsInstanced(GL_TRIANGLES, numTriangles, GL_UNSIGNED_INT,
+                                     (const GLvoid *)0, b->count);
+        }
+        if (m->numLines > 0)
+        {
+            pglDrawElementsInstanced(GL_LINES, m->numLines, GL_UNSIGNED_INT,
+                                     (const GLvoid *)(numTriangles * sizeof(GLuint)),
+                                     b->count);
+        }
+        if (b->stipple) glDisable(GL_LINE_STIPPLE);
+        if (m->hasColor) glDisableClientState(GL_COLOR_ARRAY);
+
+        offset += b->count * sizeof(InstanceData);
+        b->count = 0;
+    }
+
+    // Nguoi lai khop xuong: mot lenh cho moi muc chi tiet
+    pglUseProgram(skinProgram);
+    for (i = 0; i < NUM_LODS; i++)
+    {
+        InstanceBatch *b = &skinBatches[i];
+
+        if (b->count == 0) continue;
+        pglBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+        for (k = 0; k < 5; k++)
+        {
+            pglVertexAttribPointer(ATTRIB_INSTANCE_MATRIX + k, 4, GL_FLOAT, GL_FALSE,
+                                   sizeof(InstanceData),
+                                   (const GLvoid *)(offset + k * 4 * sizeof(GLfloat)));
+        }
+        drawSkinMesh(&skinMeshes[i], b->count);
+        offset += b->count * sizeof(InstanceData);
+        b->count = 0;
+    }
+
+    for (k = 0; k < 5; k++)
+    {
+        pglVertexAttribDivisor(ATTRIB_INSTANCE_MATRIX + k, 0);
+        pglDisableVertexAttribArray(ATTRIB_INSTANCE_MATRIX + k);
+    }
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    pglUseProgram(0);
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/************************************************
+ * Ve luoi khop xuong; instances = 0: ve mot lan voi thuoc tinh
+ * hang so da dat, nguoc lai ve instancing
+ ************************************************/
+static void drawSkinMesh(const SkinMesh *m, GLsizei instances)
+{
+    pglBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(SkinVertex), (const GLvoid *)0);
+    glNormalPointer(GL_FLOAT, sizeof(SkinVertex), (const GLvoid *)(3 * sizeof(GLfloat)));
+    glColorPointer(3, GL_FLOAT, sizeof(SkinVertex), (const GLvoid *)(6 * sizeof(GLfloat)));
+    glTexCoordPointer(1, GL_FLOAT, sizeof(SkinVertex), (const GLvoid *)(9 * sizeof(GLfloat)));
+    if (instances > 0)
+    {
+        pglDrawElementsInstanced(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT,
+                                 (const GLvoid *)0, instances);
+    }
+    else
+    {
+        glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, (const GLvoid *)0);
+    }
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/************************************************
+ * Gom cac bo phan ban dap va nguoi o muc chi tiet 'level' thanh
+ * mot luoi: dinh dua ve he toa do cua nut, mau cua bo phan gan
+ * vao dinh. Tra ve 0 neu thieu du lieu dinh
+ ************************************************/
+static int buildSkinMesh(SkinMesh *out, int level)
+{
+    SkinVertex *vertices = NULL;
+    GLuint *indices = NULL;
+    int numVertices = 0, numIndices = 0, capVertices = 0, capIndices = 0;
+    int i, k;
+
+    for (i = partFirstItem[PART_PEDALS]; i < partFirstItem[NUM_PARTS]; i++)
+    {
+        const SceneItem *it = &sceneItems[i];
+        const Mesh *m = it->lods[level];
+        const GLfloat *o = it->offset;
+        GLfloat cof[9];
+        GLsizei numTriangles;
+
+        if (m == NULL) continue;
+        if (m->vertices == NULL || m->indices == NULL)
+        {
+            free(vertices);
+            free(indices);
+            return 0;
+        }
+        numTriangles = m->numIndices - m->numLines;
+        while (numVertices + m->numVertices > capVertices)
+        {
+            capVertices = capVertices ? capVertices * 2 : 1024;
+            vertices = (SkinVertex *)realloc(vertices, capVertices * sizeof(SkinVertex));
+        }
+        while (numIndices + numTriangles > capIndices)
+        {
+            capIndices = capIndices ? capIndices * 2 : 4096;
+            indices = (GLuint *)realloc(indices, capIndices * sizeof(GLuint));
+        }
+
+        // Phap tuyen bien doi bang ma tran phu hop (cofactor) cua phan 3x3
+        cof[0] = o[5] * o[10] - o[6] * o[9];
+        cof[1] = o[6] * o[8] - o[4] * o[10];
+        cof[2] = o[4] * o[9] - o[5] * o[8];
+        cof[3] = o[9] * o[2] - o[10] * o[1];
+        cof[4] = o[10] * o[0] - o[8] * o[2];
+        cof[5] = o[8] * o[1] - o[9] * o[0];
+        cof[6] = o[1] * o[6] - o[2] * o[5];
+        cof[7] = o[2] * o[4] - o[0] * o[6];
+        cof[8] = o[0] * o[5] - o[1] * o[4];
+
+        for (k = 0; k < m->numVertices; k++)
+        {
+            const MeshVertex *v = &m->vertices[k];
+            SkinVertex *d = &vertices[numVertices + k];
+            GLfloat len;
+
+            d->x = o[0] * v->x + o[4] * v->y + o[8] * v->z + o[12];
+            d->y = o[1] * v->x + o[5] * v->y + o[9] * v->z + o[13];
+            d->z = o[2] * v->x + o[6] * v->y + o[10] * v->z + o[14];
+            d->nx = cof[0] * v->nx + cof[3] * v->ny + cof[6] * v->nz;
+            d->ny = cof[1] * v->nx + cof[4] * v->ny + cof[7] * v->nz;
+            d->nz = cof[2] * v->nx + cof[5] * v->ny + cof[8] * v->nz;
+            len = sqrt(d->nx * d->nx + d->ny * d->ny + d->nz * d->nz);
+            if (len > 0.0f)
+            {
+                d->nx /= len; d->ny /= len; d->nz /= len;
+            }
+            d->r = m->hasColor ? v->r : it->color[0];
+            d->g = m->hasColor ? v->g : it->color[1];
+            d->b = m->hasColor ? v->b : it->color[2];
+            d->bone = (GLfloat)(it->node - partFirstNode[PART_PEDALS]);
+        }
+        for (k = 0; k < numTriangles; k++)
+        {
+            indices[numIndices + k] = m->indices[k] + numVertices;
+        }
+        numVertices += m->numVertices;
+        numIndices += numTriangles;
+    }
+
+    pglGenBuffers(1, &out->vbo);
+    pglBindBuffer(GL_ARRAY_BUFFER, out->vbo);
+    pglBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(SkinVertex), vertices, GL_STATIC_DRAW);
+    pglGenBuffers(1, &out->ibo);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, out->ibo);
+    pglBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    out->numIndices = numIndices;
+    free(vertices);
+    free(indices);
+    return 1;
+}
+
+/************************************************
+ * Tao shader va luoi khop xuong cho nguoi lai; goi sau
+ * initSceneGraph() va initInstancing(). Qua MAX_SKIN_BONES nut
+ * hay chuoi khop sau hon MAX_SKIN_DEPTH thi tinh tren CPU
+ ************************************************/
+void initSkinning(void)
+{
+    GLfloat pre[MAX_SKIN_BONES][16], axis[MAX_SKIN_BONES][4], joint[MAX_SKIN_BONES][4];
+    int first = partFirstNode[PART_PEDALS];
+    int numBones = partFirstNode[NUM_PARTS] - first;
+    GLuint vs, fs;
+    GLint ok = 0;
+    int i;
+
+    if (!useSkinning || !shadersAvailable) return;
+    if (numBones > MAX_SKIN_BONES)
+    {
+        fprintf(stderr, "Nguoi lai co %d nut (toi da %d): khop xuong tinh tren CPU\n",
+                numBones, MAX_SKIN_BONES);
+        return;
+    }
+    for (i = 0; i < numBones; i++)
+    {
+        int depth = 0, bone = first + i;
+
+        // Shader di tu nut len goc toi da MAX_SKIN_DEPTH buoc
+        while (bone >= first)
+        {
+            depth++;
+            bone = sceneNodes[bone].parent;
+        }
+        if (depth > MAX_SKIN_DEPTH)
+        {
+            fprintf(stderr, "Chuoi khop sau %d (toi da %d): khop xuong tinh tren CPU\n",
+                    depth, MAX_SKIN_DEPTH);
+            return;
+        }
+    }
+
+    vs = compileShader(GL_VERTEX_SHADER, skinVertexSource);
+    fs = compileShader(GL_FRAGMENT_SHADER, instanceFragmentSource);
+    if (!vs || !fs) return;
+
+    skinProgram = pglCreateProgram();
+    pglAttachShader(skinProgram, vs);
+    pglAttachShader(skinProgram, fs);
+    pglBindAttribLocation(skinProgram, ATTRIB_INSTANCE_MATRIX + 0, "instCol0");
+    pglBindAttribLocation(skinProgram, ATTRIB_INSTANCE_MATRIX + 1, "instCol1");
+    pglBindAttribLocation(skinProgram, ATTRIB_INSTANCE_MATRIX + 2, "instCol2");
+    pglBindAttribLocation(skinProgram, ATTRIB_INSTANCE_MATRIX + 3, "instCol3");
+    pglBindAttribLocation(skinProgram, ATTRIB_INSTANCE_COLOR, "riderInputs");
+    pglLinkProgram(skinProgram);
+    pglGetProgramiv(skinProgram, GL_LINK_STATUS, &ok);
+    if (!ok)
+    {
+        char log[1024];
+        pglGetProgramInfoLog(skinProgram, sizeof(log), NULL, log);
+        fprintf(stderr, "Loi lien ket shader:\n%s\n", log);
+        return;
+    }
+
+    // Cac nut cua ban dap va nguoi, danh so lai tu 0; nut goc co cha -1
+    for (i = 0; i < numBones; i++)
+    {
+        const SceneNode *n = &sceneNodes[first + i];
+        memcpy(pre[i], n->pre, sizeof(pre[i]));
+        axis[i][0] = n->axis[0];
+        axis[i][1] = n->axis[1];
+        axis[i][2] = n->axis[2];
+        axis[i][3] = n->scale;
+        joint[i][0] = n->offset;
+        joint[i][1] = (GLfloat)n->input;
+        joint[i][2] = (GLfloat)n->sine;
+        joint[i][3] = (GLfloat)(n->parent < 0 ? -1 : n->parent - first);
+    }
+    pglUseProgram(skinProgram);
+    pglUniformMatrix4fv(pglGetUniformLocation(skinProgram, "bonePre"), numBones,
+                        GL_FALSE, &pre[0][0]);
+    pglUniform4fv(pglGetUniformLocation(skinProgram, "boneAxis"), numBones, &axis[0][0]);
+    pglUniform4fv(pglGetUniformLocation(skinProgram, "boneJoint"), numBones, &joint[0][0]);
+    pglUseProgram(0);
+
+    for (i = 0; i < NUM_LODS; i++)
+    {
+        if (!buildSkinMesh(&skinMeshes[i], i)) return;
+    }
+    skinningAvailable = 1;
+    sgCpuParts = PART_PEDALS;
+}
+
+/************************************************
+ * Ve ban dap va nguoi cua xe hien tai bang shader khop xuong:
+ * chi can ma tran goc va ba dau vao tu the
+ ************************************************/
+void drawRider(void)
+{
+    const BikeTransforms *t = &bikeTransforms[currentBike];
+    static const GLfloat identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    GLfloat inputs[4];
+    int k;
+
+    inputs[SG_INPUT_WHEELIE] = pose.wheelieAngle;
+    inputs[SG_INPUT_PEDAL] = pose.pedalAngle;
+    inputs[SG_INPUT_STEERING] = pose.steering;
+    inputs[3] = 0.0f;
+
+    if (drawInstanced)
+    {
+        InstanceBatch *b = &skinBatches[t->lod];
+        InstanceData *d;
+
+        // frameGrow() khong tra ve NULL: het bo nho thi frameAlloc() bao loi va thoat
+        if (b->count == b->cap)
+        {
+            int cap = b->cap ? b->cap * 2 : 64;
+            b->data = (InstanceData *)frameGrow(b->data, b->cap * sizeof(InstanceData),
+                                                cap * sizeof(InstanceData));
+            b->cap = cap;
+        }
+        d = &b->data[b->count++];
+        memcpy(d->matrix, matStack[matTop], sizeof(d->matrix));
+        memcpy(d->color, inputs, sizeof(d->color));
+        return;
+    }
+
+    // Mot xe: goc xe da nam trong modelview, ma tran ban sao la don vi
+    pglUseProgram(skinProgram);
+    for (k = 0; k < 4; k++) pglVertexAttrib4fv(ATTRIB_INSTANCE_MATRIX + k, identity + k * 4);
+    pglVertexAttrib4fv(ATTRIB_INSTANCE_COLOR, inputs);
+    drawSkinMesh(&skinMeshes[t->lod], 0);
+    pglUseProgram(0);
+}
+
+/************************************************
+ * Tao luoi: them dinh, them tam giac
+ ************************************************/
+GLuint meshVertex(Mesh *m, GLfloat x, GLfloat y, GLfloat z,
+                  GLfloat nx, GLfloat ny, GLfloat nz)
+{
+    MeshVertex *v;
+    if (m->numVertices == m->capVertices)
+    {
+        m->capVertices = m->capVertices ? m->capVertices * 2 : 64;
+        m->vertices = (MeshVertex *)realloc(m->vertices,
+                                            m->capVertices * sizeof(MeshVertex));
+    }
+    v = &m->vertices[m->numVertices];
+    v->x = x;   v->y = y;   v->z = z;
+    v->nx = nx; v->ny = ny; v->nz = nz;
+    v->r = m->color[0]; v->g = m->color[1]; v->b = m->color[2];
+    return m->numVertices++;
+}
+
+static void meshIndex(Mesh *m, GLuint i)
+{
+    if (m->numIndices == m->capIndices)
+    {
+        m->capIndices = m->capIndices ? m->capIndices * 2 : 192;
+        m->indices = (GLuint *)realloc(m->indices, m->capIndices * sizeof(GLuint));
+    }
+    m->indices[m->numIndices++] = i;
+}
+
+void meshTriangle(Mesh *m, GLuint a, GLuint b, GLuint c)
+{
+    meshIndex(m, a);
+    meshIndex(m, b);
+    meshIndex(m, c);
+}
+
+/************************************************
+ * Doan thang: phai them sau tat ca tam giac
+ ************************************************/
+void meshLine(Mesh *m, GLuint a, GLuint b)
+{
+    meshIndex(m, a);
+    meshIndex(m, b);
+    m->numLines += 2;
+}
+
+/************************************************
+ * Dat mau cho cac dinh tiep theo (nhu glColor)
+ ************************************************/
+void meshColor(Mesh *m, GLfloat r, GLfloat g, GLfloat b)
+{
+    m->color[0] = r;
+    m->color[1] = g;
+    m->color[2] = b;
+    m->hasColor = GL_TRUE;
+}
+
+/************************************************
+ * Dua luoi len GPU; giu ban client neu khong co VBO
+ ************************************************/
+void meshUpload(Mesh *m)
+{
+    if (pglGenBuffers == NULL) return;
+
+    if (m->vbo == 0) pglGenBuffers(1, &m->vbo);
+    pglBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+    pglBufferData(GL_ARRAY_BUFFER, m->numVertices * sizeof(MeshVertex),
+                  m->vertices, GL_STATIC_DRAW);
+    if (m->ibo == 0) pglGenBuffers(1, &m->ibo);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+    pglBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint),
+                  m->indices, GL_STATIC_DRAW);
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    if (m->keepClient) return;
+    free(m->vertices);
+    free(m->indices);
+    m->vertices = NULL;
+    m->indices = NULL;
+    m->capVertices = m->capIndices = 0;
+}
+
+/************************************************
+ * Xoa noi dung luoi de tao lai, giu bo dem GPU
+ ************************************************/
+void meshReset(Mesh *m)
+{
+    m->numVertices = 0;
+    m->numIndices = 0;
+    m->numLines = 0;
+}
+
+/************************************************
+ * Ve luoi: mot lenh glDrawElements cho tam giac,
+ * them mot lenh cho doan thang neu co
+ ************************************************/
+void drawMesh(const Mesh *m)
+{
+    const char *base = (const char *)m->vertices;
+    const GLuint *indices = m->indices;
+    GLsizei numTriangles = m->numIndices - m->numLines;
+
+    if (m->vbo)
+    {
+        pglBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+        base = NULL;
+        indices = NULL;
+    }
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), base);
+    glNormalPointer(GL_FLOAT, sizeof(MeshVertex), base + 3 * sizeof(GLfloat));
+    if (m->hasColor)
+    {
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(3, GL_FLOAT, sizeof(MeshVertex), base + 6 * sizeof(GLfloat));
+    }
+    if (numTriangles > 0)
+    {
+        glDrawElements(GL_TRIANGLES, numTriangles, GL_UNSIGNED_INT, indices);
+    }
+    if (m->numLines > 0)
+    {
+        glDrawElements(GL_LINES, m->numLines, GL_UNSIGNED_INT, indices + numTriangles);
+    }
+    if (m->hasColor) glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    if (m->vbo)
+    {
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+/************************************************
+ * Bang hinh hoc tinh san luc bien dich (constexpr C++11):
+ * cos/sin chia deu vong tron cho nan hoa, rang banh rang, xuyen,
+ * tru va cau (ca muc LOD), mat duoi ghe. Cac mo hinh co san
+ * khong con goi sin/cos luc khoi dong; --geometry-check so voi
+ * cach tinh luc chay
+ ************************************************/
+
+// Chuoi Taylor voi x trong [-pi, pi]; cong tu so hang nho nhat,
+// 20 so hang la du do chinh xac double
+constexpr double ctSinFrom(double x2, double term, int k)
+{
+    return k > 20 ? term : term + ctSinFrom(x2, -term * x2 / ((2 * k) * (2 * k + 1)), k + 1);
+}
+
+constexpr double ctCosFrom(double x2, double term, int k)
+{
+    return k > 20 ? term : term + ctCosFrom(x2, -term * x2 / ((2 * k - 1) * (2 * k)), k + 1);
+}
+
+// Goc trong [0, 2*pi] dua ve [-pi, pi]
+constexpr double ctWrap(double x)
+{
+    return x > PI ? x - 2.0 * PI : x;
+}
+
+constexpr double ctSin(double x)
+{
+    return ctSinFrom(ctWrap(x) * ctWrap(x), ctWrap(x), 1);
+}
+
+constexpr double ctCos(double x)
+{
+    return ctCosFrom(ctWrap(x) * ctWrap(x), 1.0, 1);
+}
+
+// Day chi so 0..N-1 (C++11 chua co std::index_sequence)
+template <int... I> struct IndexList {};
+template <int N, int... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <int... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+// cos/sin cua 2*pi*j/N voi j = 0..N (phan tu N khep vong, bang phan tu 0)
+template <int N, class L> struct RingBuild;
+template <int N, int... J> struct RingBuild<N, IndexList<J...> >
+{
+    static constexpr GLfloat cosv[N + 1] = { GLfloat(ctCos(2.0 * PI * J / N))... };
+    static constexpr GLfloat sinv[N + 1] = { GLfloat(ctSin(2.0 * PI * J / N))... };
+};
+template <int N, int... J> constexpr GLfloat RingBuild<N, IndexList<J...> >::cosv[N + 1];
+template <int N, int... J> constexpr GLfloat RingBuild<N, IndexList<J...> >::sinv[N + 1];
+
+template <int N> struct Ring : RingBuild<N, typename MakeIndexList<N + 1>::type> {};
+
+// Banh rang: bon goc moi rang (chan, dinh, dinh, chan)
+typedef Ring<NUM_SPOKES> SpokeRing;
+typedef Ring<4 * CHAINRING_TEETH> ChainringRing;
+
+static_assert(SpokeRing::cosv[0] == 1.0f && SpokeRing::cosv[NUM_SPOKES] == 1.0f,
+              "Bang nan hoa phai khep vong");
+static_assert(ChainringRing::sinv[CHAINRING_TEETH] == 1.0f &&
+              ChainringRing::cosv[2 * CHAINRING_TEETH] == -1.0f,
+              "Bang banh rang dia sai goc pi/2 hoac pi");
+
+// Mat tren ghe; mat duoi la anh guong qua y = 0, dao thu tu dinh
+// de phap tuyen quay xuong
+constexpr GLfloat seatTop[8][3] =
+{
+    {-0.20f, 1.2f, -0.60f}, {1.2f, 1.0f, -0.40f}, {1.0f, 1.1f, 0.30f},
+    {-0.20f, 1.3f, 0.70f}, {-0.70f, 1.0f, 1.2f}, {-1.2f, 1.1f, 1.2f},
+    {-1.2f, 1.0f, -1.2f}, {-0.70f, 1.0f, -1.2f}
+};
+
+template <class L> struct SeatMirror;
+template <int... I> struct SeatMirror<IndexList<I...> >
+{
+    static constexpr GLfloat v[sizeof...(I)][3] =
+    {
+        { seatTop[sizeof...(I) - 1 - I][0], -seatTop[sizeof...(I) - 1 - I][1],
+          seatTop[sizeof...(I) - 1 - I][2] }...
+    };
+};
+template <int... I> constexpr GLfloat SeatMirror<IndexList<I...> >::v[sizeof...(I)][3];
+
+typedef SeatMirror<MakeIndexList<8>::type> SeatBottom;
+
+static_assert(SeatBottom::v[0][1] == -seatTop[7][1] && SeatBottom::v[7][0] == seatTop[0][0],
+              "Mat duoi ghe phai la anh guong cua mat tren");
+
+/************************************************
+ * Bang cos/sin co san theo so chia: du moi so chia cua cac mo hinh
+ * co san (xuyen, tru, cau, 4 goc moi rang banh rang ca muc LOD).
+ * So chia khac thi ham dung luoi tinh sin/cos luc chay
+ ************************************************/
+typedef struct
+{
+    int n;
+    const GLfloat *cosv, *sinv;
+} RingEntry;
+
+#define RING_ENTRY(n)   { n, Ring<n>::cosv, Ring<n>::sinv }
+
+static const RingEntry ringTables[] =
+{
+    RING_ENTRY(3), RING_ENTRY(4), RING_ENTRY(5), RING_ENTRY(6), RING_ENTRY(8),
+    RING_ENTRY(10), RING_ENTRY(15), RING_ENTRY(16), RING_ENTRY(20), RING_ENTRY(30),
+    RING_ENTRY(4 * GEAR_FLAT_TEETH), RING_ENTRY(4 * SPROCKET_TEETH / 2), RING_ENTRY(4 * CHAINRING_TEETH / 2),
+    RING_ENTRY(4 * SPROCKET_TEETH), RING_ENTRY(4 * CHAINRING_TEETH)
+};
+
+static const RingEntry *ringFind(int n)
+{
+    size_t i;
+    for (i = 0; i < sizeof(ringTables) / sizeof(ringTables[0]); i++)
+    {
+        if (ringTables[i].n == n) return &ringTables[i];
+    }
+    return NULL;
+}
+
+/************************************************
+ * Chia luoi tru theo Z tu z0 den z0 + length
+ * Cung cach chia lat cat nhu gluCylinder; ring = NULL: tinh sin/cos
+ ************************************************/
+static void buildCylinderRing(Mesh *m, GLfloat radius, GLfloat z0, GLfloat length,
+                              GLint slices, GLint stacks, const RingEntry *ring)
+{
+    GLint i, j;
+    GLuint base = m->numVertices;
+    for (j = 0; j <= stacks; j++)
+    {
+        GLfloat z = z0 + length * j / stacks;
+        for (i = 0; i <= slices; i++)
+        {
+            GLfloat a = 2.0 * PI * i / slices;
+            GLfloat s = ring ? ring->sinv[i] : sin(a), c = ring ? ring->cosv[i] : cos(a);
+            meshVertex(m, radius * s, radius * c, z, s, c, 0.0f);
+        }
+    }
+    for (j = 0; j < stacks; j++)
+    {
+        for (i = 0; i < slices; i++)
+        {
+            GLuint a = base + j * (slices + 1) + i;
+            GLuint b = a + slices + 1;
+            meshTriangle(m, a, a + 1, b);
+            meshTriangle(m, b, a + 1, b + 1);
+        }
+    }
+}
+
+static void buildCylinder(Mesh *m, GLfloat radius, GLfloat z0, GLfloat length,
+                          GLint slices, GLint stacks)
+{
+    buildCylinderRing(m, radius, z0, length, slices, stacks, ringFind(slices));
+}
+
+/************************************************
+ * Chia luoi hinh lap phuong canh 1
+ ************************************************/
+static void buildCube(Mesh *m)
+{
+    static const GLfloat n[6][3] =
+    {
+        {-1, 0, 0}, {0, 1, 0}, {1, 0, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}
+    };
+    static const GLint faces[6][4] =
+    {
+        {0, 1, 2, 3}, {3, 2, 6, 7}, {7, 6, 5, 4},
+        {4, 5, 1, 0}, {5, 6, 2, 1}, {7, 4, 0, 3}
+    };
+    GLfloat v[8][3];
+    GLint i, j;
+
+    v[0][0] = v[1][0] = v[2][0] = v[3][0] = -0.5f;
+    v[4][0] = v[5][0] = v[6][0] = v[7][0] = 0.5f;
+    v[0][1] = v[1][1] = v[4][1] = v[5][1] = -0.5f;
+    v[2][1] = v[3][1] = v[6][1] = v[7][1] = 0.5f;
+    v[0][2] = v[3][2] = v[4][2] = v[7][2] = -0.5f;
+    v[1][2] = v[2][2] = v[5][2] = v[6][2] = 0.5f;
+
+    for (i = 0; i < 6; i++)
+    {
+        GLuint base = m->numVertices;
+        for (j = 0; j < 4; j++)
+        {
+            const GLfloat *p = v[faces[i][j]];
+            meshVertex(m, p[0], p[1], p[2], n[i][0], n[i][1], n[i][2]);
+        }
+        meshTriangle(m, base, base + 1, base + 2);
+        meshTriangle(m, base, base + 2, base + 3);
+    }
+}
+
+/************************************************
+ * Chia luoi hinh cau ban kinh 1. Vi tuyen j la goc pi*j/stacks,
+ * tuc phan tu j cua bang 2 * stacks; bang NULL: tinh sin/cos
+ ************************************************/
+static void buildSphereRing(Mesh *m, GLint slices, GLint stacks,
+                            const RingEntry *sliceRing, const RingEntry *stackRing)
+{
+    GLint i, j;
+    for (j = 0; j <= stacks; j++)
+    {
+        GLfloat phi = PI * j / stacks;
+        GLfloat z = stackRing ? stackRing->cosv[j] : cos(phi);
+        GLfloat r = stackRing ? stackRing->sinv[j] : sin(phi);
+        for (i = 0; i <= slices; i++)
+        {
+            GLfloat theta = 2.0 * PI * i / slices;
+            GLfloat x = r * (sliceRing ? sliceRing->cosv[i] : cos(theta));
+            GLfloat y = r * (sliceRing ? sliceRing->sinv[i] : sin(theta));
+            meshVertex(m, x, y, z, x, y, z);
+        }
+    }
+    for (j = 0; j < stacks; j++)
+    {
+        for (i = 0; i < slices; i++)
+        {
+            GLuint a = j * (slices + 1) + i;
+            GLuint b = a + slices + 1;
+            meshTriangle(m, a, b, a + 1);
+            meshTriangle(m, a + 1, b, b + 1);
+        }
+    }
+}
+
+static void buildSphere(Mesh *m, GLint slices, GLint stacks)
+{
+    buildSphereRing(m, slices, stacks, ringFind(slices), ringFind(2 * stacks));
+}
+
+/************************************************
+ * Chia luoi hinh xuyen (giong glutSolidTorus); bang NULL: tinh sin/cos
+ ************************************************/
+static void buildTorusRing(Mesh *m, GLfloat inner, GLfloat outer, GLint sides, GLint rings,
+                           const RingEntry *sideRing, const RingEntry *ringRing)
+{
+    GLint i, j;
+    GLuint base = m->numVertices;
+    for (j = 0; j <= rings; j++)
+    {
+        GLfloat theta = 2.0 * PI * j / rings;
+        GLfloat ct = ringRing ? ringRing->cosv[j] : cos(theta);
+        GLfloat st = ringRing ? ringRing->sinv[j] : sin(theta);
+        for (i = 0; i <= sides; i++)
+        {
+            GLfloat phi = 2.0 * PI * i / sides;
+            GLfloat cp = sideRing ? sideRing->cosv[i] : cos(phi);
+            GLfloat sp = sideRing ? sideRing->sinv[i] : sin(phi);
+            GLfloat dist = outer + inner * cp;
+            meshVertex(m, ct * dist, st * dist, inner * sp,
+                       ct * cp, st * cp, sp);
+        }
+    }
+    for (j = 0; j < rings; j++)
+    {
+        for (i = 0; i < sides; i++)
+        {
+            GLuint a = base + j * (sides + 1) + i;
+            GLuint b = a + sides + 1;
+            meshTriangle(m, a, b, a + 1);
+            meshTriangle(m, a + 1, b, b + 1);
+        }
+    }
+}
+
+static void buildTorus(Mesh *m, GLfloat inner, GLfloat outer,
+                       GLint sides, GLint rings)
+{
+    buildTorusRing(m, inner, outer, sides, rings, ringFind(sides), ringFind(rings));
+}
+
+/************************************************
+ * Gop ca banh xe (lop, vanh, truc, nan hoa) vao mot luoi
+ * tinh; nan hoa la mot lo GL_LINES o cuoi luoi
+ ************************************************/
+void initWheel(void)
+{
+    Mesh *m = &wheelMesh;
+    int i;
+
+    meshColor(m, 0.3f, 0.0f, 0.3f);
+    buildTorus(m, 0.06f, 0.92f, 4, 30);
+    meshColor(m, 1.0f, 1.0f, 0.5f);
+    buildCylinder(m, 0.02f, -0.06f, 0.12f, 15, 5);
+    buildTorus(m, 0.02f, 0.02f, 3, 20);
+    meshColor(m, 0.0f, 0.0f, 0.0f);
+    buildTorus(m, TUBE_WIDTH, RADIUS_WHEEL, 10, 30);
+
+    meshColor(m, 0.8f, 0.6f, 0.5f);
+    for (i = 0; i < NUM_SPOKES; ++i)
+    {
+        GLfloat s = SpokeRing::sinv[i], c = SpokeRing::cosv[i];
+        GLuint v0 = meshVertex(m, -0.02f * s, 0.02f * c, 0.0f, 0.0f, 0.0f, 1.0f);
+        GLuint v1 = meshVertex(m, -0.86f * s, 0.86f * c, 0.0f, 0.0f, 0.0f, 1.0f);
+        meshLine(m, v0, v1);
+    }
+    meshUpload(m);
+}
+
+static void buildGear(Mesh *m, GLfloat inner_radius, GLfloat outer_radius,
+                      GLfloat width, GLint teeth, GLfloat tooth_depth);
+
+/************************************************
+ * Luoi muc thap cua banh xe: it chia hon; muc cuoi chi con
+ * vanh va lop, khong truc va nan hoa
+ ************************************************/
+static void buildWheelLod(Mesh *m, int level)
+{
+    int i;
+
+    meshColor(m, 0.3f, 0.0f, 0.3f);
+    buildTorus(m, 0.06f, 0.92f, level == 1 ? 4 : 3, level == 1 ? 16 : 10);
+    if (level == 1)
+    {
+        meshColor(m, 1.0f, 1.0f, 0.5f);
+        buildCylinder(m, 0.02f, -0.06f, 0.12f, 6, 1);
+    }
+    meshColor(m, 0.0f, 0.0f, 0.0f);
+    buildTorus(m, TUBE_WIDTH, RADIUS_WHEEL, level == 1 ? 6 : 4, level == 1 ? 16 : 10);
+
+    if (level == 1)
+    {
+        meshColor(m, 0.8f, 0.6f, 0.5f);
+        for (i = 0; i < NUM_SPOKES; ++i)
+        {
+            GLfloat s = SpokeRing::sinv[i], c = SpokeRing::cosv[i];
+            GLuint v0 = meshVertex(m, -0.02f * s, 0.02f * c, 0.0f, 0.0f, 0.0f, 1.0f);
+            GLuint v1 = meshVertex(m, -0.86f * s, 0.86f * c, 0.0f, 0.0f, 0.0f, 1.0f);
+            meshLine(m, v0, v1);
+        }
+    }
+    meshUpload(m);
+}
+
+static void addLod(const Mesh *base, const Mesh *l1, const Mesh *l2)
+{
+    LodEntry *e;
+    if (numLodMeshes == MAX_LOD_MESHES) return;
+    e = &lodTable[numLodMeshes++];
+    e->levels[0] = base;
+    e->levels[1] = l1;
+    e->levels[2] = l2;
+}
+
+/************************************************
+ * Tao cac muc chi tiet cho tru, cau, banh xe va cac banh rang
+ * da co trong bo nho dem; goi sau khi cac luoi goc da tao
+ ************************************************/
+void initLods(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_LODS - 1; i++)
+    {
+        cylinderLod[i].keepClient = sphereLod[i].keepClient = GL_TRUE;
+    }
+    buildCylinder(&cylinderLod[0], 1.0f, 0.0f, 1.0f, 8, 1);
+    meshUpload(&cylinderLod[0]);
+    buildCylinder(&cylinderLod[1], 1.0f, 0.0f, 1.0f, 5, 1);
+    meshUpload(&cylinderLod[1]);
+    addLod(&cylinderMesh, &cylinderLod[0], &cylinderLod[1]);
+
+    buildSphere(&sphereLod[0], 6, 5);
+    meshUpload(&sphereLod[0]);
+    buildSphere(&sphereLod[1], 4, 3);
+    meshUpload(&sphereLod[1]);
+    addLod(&sphereMesh, &sphereLod[0], &sphereLod[1]);
+
+    buildWheelLod(&wheelLod[0], 1);
+    buildWheelLod(&wheelLod[1], 2);
+    addLod(&wheelMesh, &wheelLod[0], &wheelLod[1]);
+
+    // Banh rang: nua so rang, roi dia 8 canh khong rang
+    for (i = 0; i < numGears; i++)
+    {
+        GearEntry *g = gearCache[i];
+        buildGear(&g->lod[0], g->inner_radius, g->outer_radius, g->width,
+                  g->teeth / 2, g->tooth_depth);
+        meshUpload(&g->lod[0]);
+        buildGear(&g->lod[1], g->inner_radius, g->outer_radius, g->width, GEAR_FLAT_TEETH, 0.0f);
+        meshUpload(&g->lod[1]);
+        addLod(&g->mesh, &g->lod[0], &g->lod[1]);
+    }
+}
+
+/************************************************
+ * Luoi o muc 'level' cua m; luoi khong co muc rieng dung chinh no
+ ************************************************/
+const Mesh *lodMesh(const Mesh *m, int level)
+{
+    int i;
+    for (i = 0; i < numLodMeshes; i++)
+    {
+        if (lodTable[i].levels[0] == m) return lodTable[i].levels[level];
+    }
+    return m;
+}
+
+/************************************************
+ * Them mat da giac loi (chia quat); phap tuyen cua mat
+ * quay ra xa goc toa do (tam cua vat the)
+ ************************************************/
+static void meshPolygon(Mesh *m, const GLfloat (*p)[3], int n)
+{
+    GLfloat u[3], v[3], c[3] = {0.0f, 0.0f, 0.0f}, nx, ny, nz, len;
+    GLuint base = m->numVertices;
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        u[i] = p[1][i] - p[0][i];
+        v[i] = p[2][i] - p[0][i];
+    }
+    for (i = 0; i < n; i++)
+    {
+        c[0] += p[i][0]; c[1] += p[i][1]; c[2] += p[i][2];
+    }
+    nx = u[1] * v[2] - u[2] * v[1];
+    ny = u[2] * v[0] - u[0] * v[2];
+    nz = u[0] * v[1] - u[1] * v[0];
+    len = sqrt(nx * nx + ny * ny + nz * nz);
+    if (nx * c[0] + ny * c[1] + nz * c[2] < 0.0f) len = -len;
+    if (len != 0.0f)
+    {
+        nx /= len; ny /= len; nz /= len;
+    }
+    for (i = 0; i < n; i++)
+    {
+        meshVertex(m, p[i][0], p[i][1], p[i][2], nx, ny, nz);
+    }
+    for (i = 1; i + 1 < n; i++)
+    {
+        meshTriangle(m, base, base + i, base + i + 1);
+    }
+}
+
+/************************************************
+ * Xich (doan thang) va ghe ngoi thanh luoi tinh
+ ************************************************/
+void initBikeMeshes(void)
+{
+    static const GLfloat seatSides[7][4][3] =
+    {
+        {{1.2f, 1.0f, -0.40f}, {1.2f, 1.0f, 0.30f}, {1.2f, -1.0f, 0.30f}, {1.2f, -1.0f, -0.40f}},
+        {{1.2f, 1.0f, 0.30f}, {-0.20f, 1.3f, 0.70f}, {-0.20f, -1.3f, 0.70f}, {1.2f, -1.0f, 0.30f}},
+        {{1.2f, 1.0f, -0.40f}, {-0.20f, 1.2f, -0.60f}, {-0.20f, -1.2f, -0.60f}, {1.2f, -1.0f, -0.40f}},
+        {{-0.20f, 1.3f, 0.70f}, {-0.70f, 1.0f, 1.2f}, {-0.70f, -1.0f, 1.2f}, {-0.20f, -1.3f, 0.70f}},
+        {{-0.20f, 1.2f, -0.60f}, {-0.70f, 1.0f, -1.2f}, {-0.70f, -1.0f, -1.2f}, {-0.20f, -1.2f, -0.60f}},
+        {{-0.70f, 1.0f, 1.2f}, {-1.2f, 1.0f, 1.2f}, {-1.2f, -1.0f, 1.2f}, {-0.70f, -1.0f, 1.2f}},
+        {{-0.70f, 1.0f, -1.2f}, {-1.2f, 1.0f, -1.2f}, {-1.2f, -1.0f, -1.2f}, {-1.2f, -1.0f, 1.2f}}
+    };
+    GLfloat depth;
+    int i;
+
+    // Mat tren mau vang, mat duoi va canh mau xanh (nhu truoc day)
+    meshColor(&seatMesh, 1.0f, 1.0f, 0.0f);
+    meshPolygon(&seatMesh, seatTop, 8);
+    meshColor(&seatMesh, 0.0f, 1.0f, 1.0f);
+    meshPolygon(&seatMesh, SeatBottom::v, 8);
+    for (i = 0; i < 7; i++)
+    {
+        meshPolygon(&seatMesh, seatSides[i], 4);
+    }
+    meshUpload(&seatMesh);
+
+    for (depth = 0.06f; depth <= 0.12f; depth += 0.01f)
+    {
+        GLuint a = meshVertex(&chainMesh, -1.6f, 0.15f, ROD_RADIUS, 0.0f, 0.0f, 1.0f);
+        GLuint b = meshVertex(&chainMesh, 0.0f, 0.3f, depth, 0.0f, 0.0f, 1.0f);
+        meshLine(&chainMesh, a, b);
+        a = meshVertex(&chainMesh, -1.6f, -0.15f, ROD_RADIUS, 0.0f, 0.0f, 1.0f);
+        b = meshVertex(&chainMesh, 0.0f, -0.3f, depth, 0.0f, 0.0f, 1.0f);
+        meshLine(&chainMesh, a, b);
+    }
+    meshUpload(&chainMesh);
+}
+
+/************************************************
+ * Tao san cac hinh co ban mot lan luc khoi dong
+ ************************************************/
+void initPrimitives(void)
+{
+    loadGLExtensions();
+
+    // Tru, hop va cau con dung lai khi tao luoi khop xuong cua nguoi lai
+    cylinderMesh.keepClient = cubeMesh.keepClient = sphereMesh.keepClient = GL_TRUE;
+    buildCylinder(&cylinderMesh, 1.0f, 0.0f, 1.0f, 15, 5);
+    meshUpload(&cylinderMesh);
+    buildCube(&cubeMesh);
+    meshUpload(&cubeMesh);
+    buildSphere(&sphereMesh, 10, 10);
+    meshUpload(&sphereMesh);
+    initWheel();
+    initBikeMeshes();
+
+    // Banh rang dia va lip sau: lay goc tu bang tinh san
+    gearMesh(0.08f, 0.3f, 0.03f, CHAINRING_TEETH, 0.03f);
+    gearMesh(0.03f, 0.15f, 0.03f, SPROCKET_TEETH, 0.03f);
+    initLods();
+    // Sau cung: do thi canh giu con tro den cac luoi o tren
+    initSceneGraph();
+}
+
+/*******************************************
+ * Mot phan viec cua buoc mo phong: chep xe [begin, end)
+ * sang bo dem sau roi cap nhat tai cho
+ *******************************************/
+static void stepRange(int begin, int end)
+{
+    fleetCopyRange(&fleetBack, &fleet, begin, end);
+    updateFleet(&fleetBack, begin, end);
+    if (terrainLoaded) terrainContact(&fleetBack, begin, end);
+}
+
+/*******************************************
+ * Cap nhat canh: Di chuyen xe dap. Doan xe chia cho nhom
+ * luong; xong moi doi bo dem nen phan ve chi thay trang
+ * thai tron ven, khong can khoa
+ *******************************************/
+void updateScene()
+{
+    Fleet front;
+
+    if (terrainLoaded) terrainPrepare();
+    poolParallelFor(fleet.count, stepRange);
+    front = fleetBack;
+    fleetBack = fleet;
+    fleet = front;
+}
+
+/*******************************************
+ * Mo hinh mot xe: giam toc, di chuyen, quay theo tay lai
+ *******************************************/
+void updateBike(Fleet *f, int i)
+{
+    GLfloat xDelta, zDelta;
+    GLfloat rotation;
+    GLfloat sin_steering, cos_steering;
+    GLfloat speed = f->speed[i];
+    GLfloat steering = f->steering[i];
+    GLfloat direction = f->direction[i];
+
+    // Tu dong chay neu che do autoMove duoc bat
+    if (f->autoMove[i] && speed < MAX_SPEED)
+    {
+        speed += INC_SPEED;
+        if (speed > MAX_SPEED) speed = MAX_SPEED;
+    }
+
+    if (Abs(speed) > 0.0f && Abs(speed) < INC_SPEED / 10.0f)
+    {
+        speed = 0.0f;
+    }
+    else if (speed != 0.0f)
+    {
+        speed -= (speed > 0.0f ? DECELERATION : -DECELERATION);
+        if (Abs(speed) < DECELERATION) speed = 0.0f;
+    }
+    f->speed[i] = speed;
+
+    if (Abs(speed) < INC_SPEED / 10.0f) return;
+
+    xDelta = speed * cos(radians(direction + steering));
+    zDelta = speed * sin(radians(direction + steering));
+    f->xpos[i] += xDelta;
+    f->zpos[i] -= zDelta;
+
+    f->pedalAngle[i] = degrees(angleSum(radians(f->pedalAngle[i]), speed / RADIUS_WHEEL));
+
+    sin_steering = sin(radians(steering));
+    cos_steering = cos(radians(steering));
+    rotation = atan2(speed * sin_steering, CYCLE_LENGTH + speed * cos_steering);
+    f->direction[i] = degrees(angleSum(radians(direction), rotation));
+}
+
+/*******************************************
+ * Lop vector mong cho nhan dong hoc: AVX2 (8 lan) neu bien
+ * dich voi -mavx2, SSE2 (4 lan) tren x86-64, con lai vo huong
+ *******************************************/
+#if defined(__AVX2__)
+#define SIMD_NAME       "AVX2"
+#define SIMD_LANES      8
+typedef __m256 vfloat;
+#define vset(a)         _mm256_set1_ps(a)
+#define vload(p)        _mm256_loadu_ps(p)
+#define vstore(p, a)    _mm256_storeu_ps(p, a)
+#define vadd(a, b)      _mm256_add_ps(a, b)
+#define vsub(a, b)      _mm256_sub_ps(a, b)
+#define vmul(a, b)      _mm256_mul_ps(a, b)
+#define vdiv(a, b)      _mm256_div_ps(a, b)
+#define vmin(a, b)      _mm256_min_ps(a, b)
+#define vand(a, b)      _mm256_and_ps(a, b)
+#define vandnot(a, b)   _mm256_andnot_ps(a, b)
+#define vor(a, b)       _mm256_or_ps(a, b)
+#define vxor(a, b)      _mm256_xor_ps(a, b)
+#define vlt(a, b)       _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vgt(a, b)       _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define vneq(a, b)      _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#define vround(a)       _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define vfloor(a)       _mm256_floor_ps(a)
+#define vloadflag(p)    vneq(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(p))), vset(0.0f))
+#elif defined(__SSE2__) || defined(_M_X64)
+#define SIMD_NAME       "SSE2"
+#define SIMD_LANES      4
+typedef __m128 vfloat;
+#define vset(a)         _mm_set1_ps(a)
+#define vload(p)        _mm_loadu_ps(p)
+#define vstore(p, a)    _mm_storeu_ps(p, a)
+#define vadd(a, b)      _mm_add_ps(a, b)
+#define vsub(a, b)      _mm_sub_ps(a, b)
+#define vmul(a, b)      _mm_mul_ps(a, b)
+#define vdiv(a, b)      _mm_div_ps(a, b)
+#define vmin(a, b)      _mm_min_ps(a, b)
+#define vand(a, b)      _mm_and_ps(a, b)
+#define vandnot(a, b)   _mm_andnot_ps(a, b)
+#define vor(a, b)       _mm_or_ps(a, b)
+#define vxor(a, b)      _mm_xor_ps(a, b)
+#define vlt(a, b)       _mm_cmplt_ps(a, b)
+#define vgt(a, b)       _mm_cmpgt_ps(a, b)
+#define vneq(a, b)      _mm_cmpneq_ps(a, b)
+#define vround(a)       _mm_cvtepi32_ps(_mm_cvtps_epi32(a))
+#define vloadflag(p)    vneq(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(p))), vset(0.0f))
+
+// SSE2 khong co lenh lam tron xuong: cat phan thap phan roi sua cho so am
+static inline vfloat vfloor(vfloat a)
+{
+    vfloat t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return vsub(t, vand(vgt(t, a), vset(1.0f)));
+}
+#else
+#define SIMD_NAME       "vo huong"
+#define SIMD_LANES      1
+#endif
+
+#if SIMD_LANES > 1
+#define vsel(m, a, b)   vor(vand(m, a), vandnot(m, b))
+#define vabs(a)         vandnot(vset(-0.0f), a)
+
+/*******************************************
+ * sin(x) cho moi lan: dua ve [-pi, pi], phan xa ve
+ * [-pi/2, pi/2], da thuc Taylor bac 11 (sai so < 1e-7)
+ *******************************************/
+static inline vfloat vsin(vfloat x)
+{
+    vfloat k = vround(vmul(x, vset((GLfloat)(0.5 / PI))));
+    vfloat halfPi = vset((GLfloat)(PI / 2)), pi = vset((GLfloat)PI);
+    vfloat x2, p;
+
+    // 2*pi tach lam hai phan de giu do chinh xac khi tru
+    x = vsub(x, vmul(k, vset(6.28318548f)));
+    x = vadd(x, vmul(k, vset(1.7484555e-7f)));
+    x = vsel(vgt(x, halfPi), vsub(pi, x), x);
+    x = vsel(vlt(x, vsub(vset(0.0f), halfPi)), vsub(vsub(vset(0.0f), pi), x), x);
+
+    x2 = vmul(x, x);
+    p = vset(-2.5052108e-8f);
+    p = vadd(vmul(p, x2), vset(2.7557319e-6f));
+    p = vadd(vmul(p, x2), vset(-1.9841270e-4f));
+    p = vadd(vmul(p, x2), vset(8.3333333e-3f));
+    p = vadd(vmul(p, x2), vset(-1.6666667e-1f));
+    p = vadd(vmul(p, x2), vset(1.0f));
+    return vmul(p, x);
+}
+
+static inline vfloat vcos(vfloat x)
+{
+    return vsin(vadd(x, vset((GLfloat)(PI / 2))));
+}
+
+/*******************************************
+ * atan(t): thu hep ve |t| <= tan(pi/8) roi dung da thuc (theo Cephes)
+ *******************************************/
+static inline vfloat vatan(vfloat t)
+{
+    vfloat sign = vand(t, vset(-0.0f));
+    vfloat a = vabs(t);
+    vfloat big = vgt(a, vset(2.414213562f));
+    vfloat mid = vandnot(big, vgt(a, vset(0.414213562f)));
+    vfloat base, z, p;
+
+    base = vor(vand(big, vset((GLfloat)(PI / 2))), vand(mid, vset((GLfloat)(PI / 4))));
+    a = vsel(big, vdiv(vset(-1.0f), a),
+             vsel(mid, vdiv(vsub(a, vset(1.0f)), vadd(a, vset(1.0f))), a));
+    z = vmul(a, a);
+    p = vset(8.05374449538e-2f);
+    p = vsub(vmul(p, z), vset(1.38776856032e-1f));
+    p = vadd(vmul(p, z), vset(1.99777106478e-1f));
+    p = vsub(vmul(p, z), vset(3.33329491539e-1f));
+    p = vadd(vmul(vmul(p, z), a), a);
+    return vxor(vadd(base, p), sign);
+}
+
+/*******************************************
+ * Dua goc (radian) ve [0, 2*pi) nhu angleSum()
+ *******************************************/
+static inline vfloat vwrap(vfloat a)
+{
+    vfloat twoPi = vset((GLfloat)(2 * PI));
+    return vsub(a, vmul(twoPi, vfloor(vmul(a, vset((GLfloat)(0.5 / PI))))));
+}
+#endif
+
+/*******************************************
+ * Nhan dong hoc SIMD: cung mo hinh voi updateBike() cho
+ * SIMD_LANES xe mot luc. Cac nhanh if tro thanh mat na.
+ * atan2(y, x) thay bang atan(y / x) vi x = CYCLE_LENGTH +
+ * speed * cos(steering) luon duong (|speed| <= MAX_SPEED).
+ * Tra ve chi so dau tien chua xu ly (phan du cho vo huong).
+ *******************************************/
+int kinematicsBatch(Fleet *f, int begin, int end)
+{
+#if SIMD_LANES > 1
+    const vfloat zero = vset(0.0f);
+    const vfloat stopSpeed = vset(INC_SPEED / 10.0f);
+    const vfloat toRad = vset((GLfloat)(PI / 180.0)), toDeg = vset((GLfloat)(180.0 / PI));
+    int i;
+
+    for (i = begin; i + SIMD_LANES <= end; i += SIMD_LANES)
+    {
+        vfloat speed = vload(f->speed + i);
+        vfloat steering = vmul(vload(f->steering + i), toRad);
+        vfloat direction = vmul(vload(f->direction + i), toRad);
+        vfloat autoMove = vloadflag(f->autoMove + i);
+        vfloat absSpeed, decel, stopped, heading, pedal, rotation, y, x;
+
+        // Tu dong chay: tang toc nhung khong vuot MAX_SPEED
+        speed = vsel(vand(autoMove, vlt(speed, vset(MAX_SPEED))),
+                     vmin(vadd(speed, vset(INC_SPEED)), vset(MAX_SPEED)), speed);
+
+        // Giam toc; qua cham thi dung han
+        absSpeed = vabs(speed);
+        decel = vor(vset(DECELERATION), vand(speed, vset(-0.0f)));
+        speed = vsel(vneq(speed, zero), vsub(speed, decel), speed);
+        speed = vandnot(vlt(vabs(speed), vset(DECELERATION)), speed);
+        speed = vandnot(vand(vgt(absSpeed, zero), vlt(absSpeed, stopSpeed)), speed);
+        vstore(f->speed + i, speed);
+
+        // Xe dung yen giu nguyen vi tri, huong va ban dap
+        stopped = vlt(vabs(speed), stopSpeed);
+        heading = vadd(direction, steering);
+        vstore(f->xpos + i, vadd(vload(f->xpos + i), vandnot(stopped, vmul(speed, vcos(heading)))));
+        vstore(f->zpos + i, vsub(vload(f->zpos + i), vandnot(stopped, vmul(speed, vsin(heading)))));
+
+        pedal = vload(f->pedalAngle + i);
+        vstore(f->pedalAngle + i,
+               vsel(stopped, pedal,
+                    vmul(vwrap(vadd(vmul(pedal, toRad), vdiv(speed, vset(RADIUS_WHEEL)))), toDeg)));
+
+        y = vmul(speed, vsin(steering));
+        x = vadd(vset(CYCLE_LENGTH), vmul(speed, vcos(steering)));
+        rotation = vatan(vdiv(y, x));
+        vstore(f->direction + i,
+               vsel(stopped, vload(f->direction + i), vmul(vwrap(vadd(direction, rotation)), toDeg)));
+    }
+    return i;
+#else
+    (void)f;
+    (void)end;
+    return begin;
+#endif
+}
+
+/*******************************************
+ * Buoc mo phong cho cac xe [begin, end): khoi SIMD_LANES
+ * xe qua nhan vector, phan du qua updateBike()
+ *******************************************/
+void updateFleet(Fleet *f, int begin, int end)
+{
+    int i = kinematicsBatch(f, begin, end);
+    for (; i < end; i++)
+    {
+        updateBike(f, i);
+    }
+}
+
+/*******************************************
+ * Doan xe ngau nhien (co dinh theo hat giong) cho kiem tra
+ * va do toc do: du toc do, tay lai, huong, xe dung yen
+ *******************************************/
+static void fleetRandomize(Fleet *f, unsigned int seed)
+{
+    int i;
+
+    for (i = 0; i < f->count; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        f->speed[i] = ((int)((seed >> 8) % 2001) - 1000) * (MAX_SPEED / 1000.0f);
+        seed = seed * 1664525u + 1013904223u;
+        f->steering[i] = ((int)((seed >> 8) % 1401) - 700) * (HANDLE_LIMIT / 700.0f);
+        seed = seed * 1664525u + 1013904223u;
+        f->direction[i] = (seed >> 8) % 36000 * 0.01f;
+        seed = seed * 1664525u + 1013904223u;
+        f->pedalAngle[i] = (seed >> 8) % 36000 * 0.01f;
+        f->autoMove[i] = (i % 8) != 7;
+        f->xpos[i] = f->zpos[i] = 0.0f;
+    }
+}
+
+/*******************************************
+ * Chep trang thai cac xe [begin, end) tu src sang dst
+ *******************************************/
+void fleetCopyRange(Fleet *dst, const Fleet *src, int begin, int end)
+{
+    size_t bytes = (end - begin) * sizeof(GLfloat);
+    memcpy(dst->xpos + begin, src->xpos + begin, bytes);
+    memcpy(dst->zpos + begin, src->zpos + begin, bytes);
+    memcpy(dst->direction + begin, src->direction + begin, bytes);
+    memcpy(dst->speed + begin, src->speed + begin, bytes);
+    memcpy(dst->steering + begin, src->steering + begin, bytes);
+    memcpy(dst->pedalAngle + begin, src->pedalAngle + begin, bytes);
+    memcpy(dst->wheelieAngle + begin, src->wheelieAngle + begin, bytes);
+    memcpy(dst->autoMove + begin, src->autoMove + begin, (end - begin) * sizeof(int));
+    memcpy(dst->groundY + begin, src->groundY + begin, bytes);
+    memcpy(dst->pitch + begin, src->pitch + begin, bytes);
+}
+
+// Hieu hai goc (do) theo duong ngan nhat
+static GLfloat angleError(GLfloat a, GLfloat b)
+{
+    GLfloat d = fmod(Abs(a - b), 360.0f);
+    return d > 180.0f ? 360.0f - d : d;
+}
+
+/*******************************************
+ * --simd-check: chay cung doan xe 10 giay mo phong bang
+ * updateBike() va nhan SIMD, bao sai so lon nhat
+ *******************************************/
+#define SIMD_CHECK_RIDERS   1027        // Khong chia het cho so lan: co ca phan du
+#define SIMD_CHECK_STEPS    (10 * SIM_RATE)
+#define SIMD_TOL_POSITION   5e-3f       // Don vi the gioi, sau ~80 don vi duong di
+#define SIMD_TOL_ANGLE      1e-2f       // Do
+#define SIMD_TOL_SPEED      1e-6f
+
+int runSimdCheck(void)
+{
+    Fleet ref, vec;
+    GLfloat errPos = 0.0f, errAngle = 0.0f, errSpeed = 0.0f;
+    int i, step, ok;
+
+    fleetAlloc(&ref, SIMD_CHECK_RIDERS);
+    fleetAlloc(&vec, SIMD_CHECK_RIDERS);
+    fleetRandomize(&ref, 12345u);
+    fleetCopyRange(&vec, &ref, 0, ref.count);
+
+    for (step = 0; step < SIMD_CHECK_STEPS; step++)
+    {
+        for (i = 0; i < ref.count; i++) updateBike(&ref, i);
+        updateFleet(&vec, 0, vec.count);
+    }
+
+    for (i = 0; i < ref.count; i++)
+    {
+        GLfloat e;
+        e = Abs(ref.xpos[i] - vec.xpos[i]);
+        if (e > errPos) errPos = e;
+        e = Abs(ref.zpos[i] - vec.zpos[i]);
+        if (e > errPos) errPos = e;
+        e = angleError(ref.direction[i], vec.direction[i]);
+        if (e > errAngle) errAngle = e;
+        e = angleError(ref.pedalAngle[i], vec.pedalAngle[i]);
+        if (e > errAngle) errAngle = e;
+        e = Abs(ref.speed[i] - vec.speed[i]);
+        if (e > errSpeed) errSpeed = e;
+    }
+
+    ok = errPos <= SIMD_TOL_POSITION && errAngle <= SIMD_TOL_ANGLE &&
+         errSpeed <= SIMD_TOL_SPEED;
+    printf("Kiem tra nhan %s (%d lan): %d xe, %d buoc\n",
+           SIMD_NAME, SIMD_LANES, SIMD_CHECK_RIDERS, SIMD_CHECK_STEPS);
+    printf("  vi tri   sai so %.3g (cho phep %.3g)\n", errPos, SIMD_TOL_POSITION);
+    printf("  goc      sai so %.3g do (cho phep %.3g)\n", errAngle, SIMD_TOL_ANGLE);
+    printf("  toc do   sai so %.3g (cho phep %.3g)\n", errSpeed, SIMD_TOL_SPEED);
+    printf("%s\n", ok ? "DAT" : "KHONG DAT");
+
+    fleetFree(&ref);
+    fleetFree(&vec);
+    return ok ? 0 : 1;
+}
+
+/*******************************************
+ * --simd-bench N: so xe-buoc moi giay cua updateBike()
+ * va cua nhan SIMD tren doan N xe
+ *******************************************/
+int runSimdBench(int riders)
+{
+    Fleet f;
+    double t0, scalarTime, simdTime;
+    long long work;
+    int i, step, steps;
+
+    if (riders < 1) riders = 1;
+    steps = 20000000 / riders;
+    if (steps < 10) steps = 10;
+    work = (long long)riders * steps;
+    fleetAlloc(&f, riders);
+
+    fleetRandomize(&f, 777u);
+    t0 = nowSeconds();
+    for (step = 0; step < steps; step++)
+    {
+        for (i = 0; i < f.count; i++) updateBike(&f, i);
+    }
+    scalarTime = nowSeconds() - t0;
+
+    fleetRandomize(&f, 777u);
+    t0 = nowSeconds();
+    for (step = 0; step < steps; step++)
+    {
+        updateFleet(&f, 0, f.count);
+    }
+    simdTime = nowSeconds() - t0;
+
+    printf("Dong hoc %d xe x %d buoc\n", riders, steps);
+    printf("  vo huong      %8.2f trieu xe/s\n", work / scalarTime / 1e6);
+    printf("  %-4s (%d lan) %8.2f trieu xe/s  (x%.2f)\n", SIMD_NAME, SIMD_LANES,
+           work / simdTime / 1e6, scalarTime / simdTime);
+
+    fleetFree(&f);
+    return 0;
+}
+
+/*******************************************
+ * Nhom luong cuop viec (work-stealing) cho buoc mo phong.
+ * Moi lan chia viec, doan xe duoc cat thanh cac phan bang
+ * nhau; moi luong nhan mot day phan lien tiep, lay tu dau
+ * day cua minh, het thi cuop tu cuoi day cua luong khac.
+ * Luong goi (luong ve) cung lam viec nhu luong 0.
+ *******************************************/
+#define MAX_THREADS      64
+#define TASKS_PER_THREAD 4      // Vai phan moi luong de con viec cho luong ranh cuop
+#define MIN_TASK_RIDERS  1024   // Phan nho hon khong bu duoc chi phi chia luong
+#define TASK_ALIGN       16     // Ranh gioi phan la boi cua 16 xe (64 byte moi mang)
+
+typedef struct
+{
+    // Day phan [dau, cuoi) goi trong mot so: 16 bit cao la dau, 16 bit thap la cuoi.
+    // Chu lay o dau, ke cuop lay o cuoi, ca hai bang compare-exchange.
+    std::atomic<unsigned int> range;
+    char pad[64 - sizeof(std::atomic<unsigned int>)];
+} WorkQueue;
+
+WorkQueue poolQueues[MAX_THREADS];
+int poolThreads = 1;                    // Ke ca luong goi
+void (*poolFunc)(int begin, int end) = NULL;
+int poolCount = 0;                      // So xe cua lan chia viec hien tai
+int poolTaskSize = 0;                   // So xe moi phan
+std::atomic<int> poolBusy(0);           // So luong phu chua xong lan chia viec
+std::atomic<int> poolSteals(0);         // So phan bi cuop (thong ke)
+int poolGeneration = 0;                 // Tang moi lan chia viec (co khoa)
+int poolQuit = 0;
+
+#ifdef _WIN32
+CRITICAL_SECTION poolLock;
+CONDITION_VARIABLE poolWake;
+HANDLE poolHandles[MAX_THREADS];
+#else
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+pthread_t poolHandles[MAX_THREADS];
+#endif
+
+int cpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+// Lay mot phan tu day q: chu lay o dau, ke cuop lay o cuoi; -1 neu het
+static int queueTake(WorkQueue *q, int steal)
+{
+    unsigned int r = q->range.load();
+    for (;;)
+    {
+        unsigned int head = r >> 16, tail = r & 0xFFFF;
+        unsigned int next;
+
+        if (head >= tail) return -1;
+        next = steal ? ((head << 16) | (tail - 1)) : (((head + 1) << 16) | tail);
+        if (q->range.compare_exchange_weak(r, next))
+        {
+            return steal ? (int)tail - 1 : (int)head;
+        }
+    }
+}
+
+static void runTask(int task)
+{
+    int begin = task * poolTaskSize;
+    int end = begin + poolTaskSize;
+    if (end > poolCount) end = poolCount;
+    poolFunc(begin, end);
+}
+
+// Lam het day cua minh roi di mot vong cuop cac day khac.
+// Cac day chi co giam nen mot vong la du de moi phan co nguoi nhan.
+static void poolWork(int self)
+{
+    int task, v;
+
+    while ((task = queueTake(&poolQueues[self], 0)) >= 0)
+    {
+        runTask(task);
+    }
+    for (v = 1; v < poolThreads; v++)
+    {
+        WorkQueue *q = &poolQueues[(self + v) % poolThreads];
+        while ((task = queueTake(q, 1)) >= 0)
+        {
+            poolSteals++;
+            runTask(task);
+        }
+    }
+}
+
+static void poolWorkerLoop(int self)
+{
+    int seen = 0, quit;
+
+    for (;;)
+    {
+#ifdef _WIN32
+        EnterCriticalSection(&poolLock);
+        while (poolGeneration == seen && !poolQuit)
+        {
+            SleepConditionVariableCS(&poolWake, &poolLock, INFINITE);
+        }
+        seen = poolGeneration;
+        quit = poolQuit;
+        LeaveCriticalSection(&poolLock);
+#else
+        pthread_mutex_lock(&poolLock);
+        while (poolGeneration == seen && !poolQuit)
+        {
+            pthread_cond_wait(&poolWake, &poolLock);
+        }
+        seen = poolGeneration;
+        quit = poolQuit;
+        pthread_mutex_unlock(&poolLock);
+#endif
+        if (quit) return;
+        poolWork(self);
+        poolBusy--;
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI poolThreadMain(LPVOID arg)
+{
+    poolWorkerLoop((int)(intptr_t)arg);
+    return 0;
+}
+#else
+static void *poolThreadMain(void *arg)
+{
+    poolWorkerLoop((int)(intptr_t)arg);
+    return NULL;
+}
+#endif
+
+// Danh thuc hoac bao dung cac luong phu
+static void poolSignal(int quit)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&poolLock);
+    if (quit) poolQuit = 1; else poolGeneration++;
+    WakeAllConditionVariable(&poolWake);
+    LeaveCriticalSection(&poolLock);
+#else
+    pthread_mutex_lock(&poolLock);
+    if (quit) poolQuit = 1; else poolGeneration++;
+    pthread_cond_broadcast(&poolWake);
+    pthread_mutex_unlock(&poolLock);
+#endif
+}
+
+/*******************************************
+ * Tao nhom 'threads' luong (ke ca luong goi)
+ *******************************************/
+void poolStart(int threads)
+{
+    int i;
+
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+#ifdef _WIN32
+    static int lockReady = 0;
+    if (!lockReady)
+    {
+        InitializeCriticalSection(&poolLock);
+        InitializeConditionVariable(&poolWake);
+        lockReady = 1;
+    }
+#endif
+    poolGeneration = 0;
+    poolQuit = 0;
+    poolThreads = threads;
+    for (i = 1; i < threads; i++)
+    {
+#ifdef _WIN32
+        poolHandles[i] = CreateThread(NULL, 0, poolThreadMain, (LPVOID)(intptr_t)i, 0, NULL);
+        if (poolHandles[i] == NULL) break;
+#else
+        if (pthread_create(&poolHandles[i], NULL, poolThreadMain, (void *)(intptr_t)i) != 0) break;
+#endif
+    }
+    if (i < threads)
+    {
+        fprintf(stderr, "Chi tao duoc %d luong mo phong\n", i);
+        poolThreads = i;
+    }
+}
+
+void poolStop(void)
+{
+    int i;
+
+    if (poolThreads <= 1) return;
+    poolSignal(1);
+    for (i = 1; i < poolThreads; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(poolHandles[i], INFINITE);
+        CloseHandle(poolHandles[i]);
+#else
+        pthread_join(poolHandles[i], NULL);
+#endif
+    }
+    poolThreads = 1;
+}
+
+/*******************************************
+ * Goi fn tren cac phan cua [0, count) bang ca nhom luong,
+ * tro ve khi moi phan da xong. Viec nho chay ngay tren luong goi.
+ *******************************************/
+void poolParallelFor(int count, void (*fn)(int begin, int end))
+{
+    poolParallelForGrain(count, MIN_TASK_RIDERS, fn);
+}
+
+/*******************************************
+ * Nhu poolParallelFor nhung moi phan toi thieu 'grain' phan tu
+ * (viec nang nhu quet tham so can phan nho hon MIN_TASK_RIDERS)
+ *******************************************/
+void poolParallelForGrain(int count, int grain, void (*fn)(int begin, int end))
+{
+    int tasks, size, t;
+
+    if (poolThreads <= 1 || count < 2 * grain)
+    {
+        fn(0, count);
+        return;
+    }
+
+    tasks = poolThreads * TASKS_PER_THREAD;
+    size = (count + tasks - 1) / tasks;
+    if (size < grain) size = grain;
+    size = (size + TASK_ALIGN - 1) / TASK_ALIGN * TASK_ALIGN;
+    tasks = (count + size - 1) / size;
+
+    poolFunc = fn;
+    poolCount = count;
+    poolTaskSize = size;
+    for (t = 0; t < poolThreads; t++)
+    {
+        unsigned int begin = tasks * t / poolThreads;
+        unsigned int end = tasks * (t + 1) / poolThreads;
+        poolQueues[t].range.store((begin << 16) | end);
+    }
+    poolBusy = poolThreads - 1;
+    poolSignal(0);
+
+    poolWork(0);
+    while (poolBusy > 0)
+    {
+#ifdef _WIN32
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+}
+
+/*******************************************
+ * --sim-scaling N: thoi gian mot buoc mo phong N xe
+ * voi 1, 2, 4, 8, 16 luong. Moi xe chi phu thuoc chinh no
+ * nen ket qua phai trung tung bit voi lan chay 1 luong.
+ *******************************************/
+int runSimScaling(int riders)
+{
+    static const int threadSteps[] = { 1, 2, 4, 8, 16 };
+    Fleet ref;
+    double t0, base = 0.0;
+    int k, step, steps, allMatch = 1;
+
+    steps = 20000000 / riders;
+    if (steps < 20) steps = 20;
+    if (steps > 2000) steps = 2000;
+
+    printf("Buoc mo phong %d xe, %d buoc moi lan do, %d loi CPU, nhan %s\n",
+           riders, steps, cpuCount(), SIMD_NAME);
+    printf("  luong   ms/buoc   tang toc   phan bi cuop/buoc   khop 1 luong\n");
+    fleetAlloc(&ref, riders);
+    for (k = 0; k < (int)(sizeof(threadSteps) / sizeof(threadSteps[0])); k++)
+    {
+        double ms;
+        int match = 1;
+
+        fleetRandomize(&fleet, 777u);
+        fleetSavePrevious();
+        poolStart(threadSteps[k]);
+        for (step = 0; step < 5; step++) updateScene();
+        poolSteals = 0;
+
+        t0 = nowSeconds();
+        for (step = 0; step < steps; step++) updateScene();
+        ms = (nowSeconds() - t0) * 1000.0 / steps;
+        poolStop();
+
+        if (k == 0)
+        {
+            base = ms;
+            fleetCopyRange(&ref, &fleet, 0, riders);
+        }
+        else
+        {
+            size_t bytes = riders * sizeof(GLfloat);
+            match = memcmp(ref.xpos, fleet.xpos, bytes) == 0 &&
+                    memcmp(ref.zpos, fleet.zpos, bytes) == 0 &&
+                    memcmp(ref.direction, fleet.direction, bytes) == 0 &&
+                    memcmp(ref.pedalAngle, fleet.pedalAngle, bytes) == 0 &&
+                    memcmp(ref.speed, fleet.speed, bytes) == 0;
+            if (!match) allMatch = 0;
+        }
+
+        printf("  %5d   %7.3f   %8.2f   %17.2f   %s\n", threadSteps[k], ms, base / ms,
+               (double)poolSteals / steps, match ? "co" : "KHONG");
+    }
+    fleetFree(&ref);
+    return allMatch ? 0 : 1;
+}
+
+/*******************************************
+ * --sweep N: quet tham so mo hinh dong hoc khong can do hoa.
+ * Moi lan chay la mot xe voi bien dang tay lai (bien do x chu ky,
+ * chu ky 0 = giu co dinh) va toc do ra lenh moi buoc (nhu giu W).
+ * Cac lan chay chia cho nhom luong; moi phan chay tung khoi
+ * SWEEP_BLOCK xe qua du N buoc de trang thai nam trong cache.
+ *******************************************/
+#define SWEEP_BLOCK      256
+
+static const GLfloat sweepPeriods[] = { 0.0f, 2.0f, 8.0f };   // Giay
+#define SWEEP_PERIODS    ((int)(sizeof(sweepPeriods) / sizeof(sweepPeriods[0])))
+
+Fleet sweepFleet;
+GLfloat *sweepAmp = NULL;       // Bien do tay lai (do)
+GLfloat *sweepPeriod = NULL;    // Chu ky tay lai (giay)
+GLfloat *sweepSpeed = NULL;     // Toc do ra lenh moi buoc
+double *sweepDistance = NULL;   // Quang duong da di
+double *sweepTurn = NULL;       // Tong goc da quay (do, co dau)
+
+static void sweepRange(int begin, int end)
+{
+    GLfloat prevDirection[SWEEP_BLOCK];
+    int b0, b1, i;
+    unsigned long t;
+
+    for (b0 = begin; b0 < end; b0 = b1)
+    {
+        b1 = b0 + SWEEP_BLOCK < end ? b0 + SWEEP_BLOCK : end;
+        for (t = 0; t < sweepTicks; t++)
+        {
+            double phase = 2.0 * PI * t / SIM_RATE;
+
+            for (i = b0; i < b1; i++)
+            {
+                sweepFleet.speed[i] = sweepSpeed[i];
+                sweepFleet.steering[i] = sweepPeriod[i] > 0.0f ?
+                    (GLfloat)(sweepAmp[i] * sin(phase / sweepPeriod[i])) : sweepAmp[i];
+                prevDirection[i - b0] = sweepFleet.direction[i];
+            }
+            updateFleet(&sweepFleet, b0, b1);
+            for (i = b0; i < b1; i++)
+            {
+                GLfloat speed = sweepFleet.speed[i];
+                GLfloat turn = sweepFleet.direction[i] - prevDirection[i - b0];
+
+                if (Abs(speed) < INC_SPEED / 10.0f) continue;
+                if (turn > 180.0f) turn -= 360.0f;
+                else if (turn < -180.0f) turn += 360.0f;
+                sweepDistance[i] += Abs(speed);
+                sweepTurn[i] += turn;
+            }
+        }
+    }
+}
+
+int runSweep(void)
+{
+    int runs = sweepSteerSteps * SWEEP_PERIODS * sweepSpeedSteps;
+    int threads = threadCount > 0 ? threadCount : cpuCount();
+    FILE *out = stdout;
+    double start, elapsed, maxError = 0.0;
+    int i, a, p, v;
+
+    if (sweepSteerSteps < 1 || sweepSpeedSteps < 1)
+    {
+        fprintf(stderr, "--sweep-steer va --sweep-speed phai >= 1\n");
+        return 1;
+    }
+    fleetAlloc(&sweepFleet, runs);
+    sweepAmp = (GLfloat *)malloc(runs * sizeof(GLfloat));
+    sweepPeriod = (GLfloat *)malloc(runs * sizeof(GLfloat));
+    sweepSpeed = (GLfloat *)malloc(runs * sizeof(GLfloat));
+    sweepDistance = (double *)calloc(runs, sizeof(double));
+    sweepTurn = (double *)calloc(runs, sizeof(double));
+    if (!sweepAmp || !sweepPeriod || !sweepSpeed || !sweepDistance || !sweepTurn)
+    {
+        fprintf(stderr, "Khong du bo nho cho %d lan chay\n", runs);
+        return 1;
+    }
+
+    // Luoi tham so: tay lai x chu ky x toc do, moi xe bat dau o goc toa do
+    i = 0;
+    for (a = 0; a < sweepSteerSteps; a++)
+    {
+        for (p = 0; p < SWEEP_PERIODS; p++)
+        {
+            for (v = 0; v < sweepSpeedSteps; v++, i++)
+            {
+                sweepAmp[i] = sweepSteerSteps > 1 ?
+                    -HANDLE_LIMIT + 2.0f * HANDLE_LIMIT * a / (sweepSteerSteps - 1) : 0.0f;
+                sweepPeriod[i] = sweepPeriods[p];
+                sweepSpeed[i] = sweepSpeedSteps > 1 ?
+                    MIN_SPEED + (MAX_SPEED - MIN_SPEED) * v / (sweepSpeedSteps - 1) : MAX_SPEED;
+                sweepFleet.xpos[i] = sweepFleet.zpos[i] = 0.0f;
+                sweepFleet.direction[i] = sweepFleet.pedalAngle[i] = 0.0f;
+                sweepFleet.wheelieAngle[i] = 0.0f;
+                sweepFleet.autoMove[i] = 0;
+            }
+        }
+    }
+
+    if (sweepOutPath)
+    {
+        out = fopen(sweepOutPath, "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "Khong mo duoc %s\n", sweepOutPath);
+            return 1;
+        }
+    }
+
+    poolStart(threads);
+    start = nowSeconds();
+    poolParallelForGrain(runs, TASK_ALIGN, sweepRange);
+    elapsed = nowSeconds() - start;
+    poolStop();
+
+    fprintf(out, "run,steer_amp,steer_period_s,speed_cmd,distance,net_displacement,"
+            "heading_drift_deg,turn_radius,final_speed\n");
+    for (i = 0; i < runs; i++)
+    {
+        double turnRad = radians((GLfloat)sweepTurn[i]);
+        double radius = turnRad != 0.0 ? sweepDistance[i] / fabs(turnRad) : HUGE_VAL;
+
+        fprintf(out, "%d,%.3f,%.1f,%.5f,%.6g,%.6g,%.6g,%.6g,%.5f\n", i,
+                sweepAmp[i], sweepPeriod[i], sweepSpeed[i], sweepDistance[i],
+                sqrt(sweepFleet.xpos[i] * sweepFleet.xpos[i] +
+                     sweepFleet.zpos[i] * sweepFleet.zpos[i]),
+                sweepTurn[i], radius, sweepFleet.speed[i]);
+
+        // Tay lai co dinh: ban kinh phai khop cong thuc cua mo hinh
+        // R = v / atan2(v sin(d), CYCLE_LENGTH + v cos(d))
+        if (sweepPeriod[i] == 0.0f && sweepAmp[i] != 0.0f && sweepDistance[i] > 0.0)
+        {
+            double speed = sweepFleet.speed[i];
+            double d = sweepAmp[i] * PI / 180.0;
+            double expected = fabs(speed / atan2(speed * sin(d), CYCLE_LENGTH + speed * cos(d)));
+            double error = fabs(radius - expected) / expected;
+            if (error > maxError) maxError = error;
+        }
+    }
+    if (out != stdout) fclose(out);
+
+    fprintf(stderr, "%d lan chay x %lu buoc = %.3g xe-buoc trong %.3f s "
+            "(%.3g xe-buoc/giay, %d luong, nhan %s)\n",
+            runs, sweepTicks, (double)runs * sweepTicks, elapsed,
+            elapsed > 0.0 ? runs * (double)sweepTicks / elapsed : 0.0, threads, SIMD_NAME);
+    fprintf(stderr, "Ban kinh quay (tay lai co dinh) lech toi da %.2e so voi cong thuc\n",
+            maxError);
+
+    fleetFree(&sweepFleet);
+    free(sweepAmp);
+    free(sweepPeriod);
+    free(sweepSpeed);
+    free(sweepDistance);
+    free(sweepTurn);
+    return 0;
+}
+
+/******************************************
+ * angleSum: Cong hai goc mod 2PI
+ ******************************************/
+GLfloat angleSum(GLfloat a, GLfloat b)
+{
+    a += b;
+    while (a >= 2 * PI) a -= 2 * PI;
+    while (a < 0) a += 2 * PI;
+    return a;
+}
+
+/************************************************
+ * Dung khung kim loai cua xe dap (ghi vao do thi canh)
+ ************************************************/
+void buildFrame(void)
+{
+    mColor(0.4f, 0.0f, 0.0f);
+
+    // Mot khop wheelie chung cho ca khung: xoay quanh truc X tai banh sau
+    mTranslate(-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
+    sgJoint(SG_INPUT_WHEELIE, 0, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+    mTranslate((BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
+
+    mPush();
+    {
+        // Ket noi banh rang va ban dap
+        mPush();
+        {
+            mColor(0.7f, 0.0f, 0.7f);
+            mPush();
+            {
+                mTranslate(0.0f, 0.0f, 0.10f);
+                sgJoint(SG_INPUT_PEDAL, 0, -1.0f, -15.0f, 0.0f, 0.0f, 1.0f);
+                gear(0.08f, 0.3f, 0.03f, CHAINRING_TEETH, 0.03f);
+            }
+            mPop();
+            mColor(0.4f, 0.0f, 0.0f);
+            mTranslate(0.0f, 0.0f, -0.25f);
+            ZCylinder(0.08f, 0.32f);
+        }
+        mPop();
+
+        // Thanh ben phai
+        mRotate(RIGHT_ANGLE + 7.0f, 0.0f, 0.0f, 1.0f);
+        mScale(1.0f, 0.8f, 1.0f);
+        XCylinder(ROD_RADIUS, RIGHT_ROD);
+
+        // Thanh giua
+        mRotate(MIDDLE_ANGLE - (RIGHT_ANGLE + 7.0f) + 5.0f, 0.0f, 0.0f, 1.0f);
+        mScale(0.9f, 1.1f, 1.0f);
+        XCylinder(ROD_RADIUS, MIDDLE_ROD);
+
+        // Ghe ngoi
+        mColor(0.1f, 1.0f, 0.3f);
+        mTranslate(MIDDLE_ROD, 0.0f, 0.0f);
+        mRotate(-MIDDLE_ANGLE - 7.0f, 0.0f, 0.0f, 1.0f);
+        mScale(0.6f, ROD_RADIUS * 1.7f, 0.4f);
+        drawSeat();
+        mColor(0.4f, 0.0f, 0.0f);
+    }
+    mPop();
+
+    // Thanh noi ngang
+    mPush();
+    {
+        mRotate(-180.0f, 0.0f, 1.0f, 0.0f);
+        XCylinder(ROD_RADIUS, BACK_CONNECTOR);
+        mPush();
+        {
+            mTranslate(0.5f, 0.0f, WHEEL_OFFSET);
+            XCylinder(ROD_RADIUS, RADIUS_WHEEL + TUBE_WIDTH);
+        }
+        mPop();
+        mPush();
+        {
+            mTranslate(0.5f, 0.0f, -WHEEL_OFFSET);
+            XCylinder(ROD_RADIUS, RADIUS_WHEEL + TUBE_WIDTH);
+        }
+        mPop();
+    }
+    mPop();
+
+    // Thanh ben trai va banh xe
+    mPush();
+    {
+        mTranslate(-(BACK_CONNECTOR + RADIUS_WHEEL + TUBE_WIDTH), 0.0f, 0.0f);
+        mPush();
+        {
+            sgJoint(SG_INPUT_PEDAL, 0, -2.0f, -20.0f, 0.0f, 0.0f, 1.0f);
+            drawTyre();
+            mColor(1.0f, 0.3f, 0.0f);
+            gear(0.03f, 0.15f, 0.03f, SPROCKET_TEETH, 0.03f);
+            mColor(0.4f, 0.0f, 0.0f);
+        }
+        mPop();
+        mRotate(LEFT_ANGLE + 10.0f, 0.0f, 0.0f, 1.0f);
+        mPush();
+        {
+            mTranslate(0.0f, 0.0f, -WHEEL_OFFSET);
+            XCylinder(ROD_RADIUS, WHEEL_LEN);
+        }
+        mPop();
+        mPush();
+        {
+            mTranslate(0.0f, 0.0f, WHEEL_OFFSET);
+            XCylinder(ROD_RADIUS, WHEEL_LEN);
+        }
+        mPop();
+        mTranslate(WHEEL_LEN, 0.0f, 0.0f);
+        XCylinder(ROD_RADIUS, CRANK_ROD);
+        mTranslate(CRANK_ROD, 0.0f, 0.0f);
+        mRotate(-LEFT_ANGLE - 7.0f, 0.0f, 0.0f, 1.0f);
+        XCylinder(ROD_RADIUS, TOP_LEN);
+        mTranslate(TOP_LEN, 0.0f, 0.0f);
+        mRotate(-FRONT_INCLINE - 10.0f, 0.0f, 0.0f, 1.0f);
+        mPush();
+        {
+            mTranslate(-0.1f, 0.0f, 0.0f);
+            XCylinder(ROD_RADIUS, 0.45f);
+        }
+        mPop();
+        mPush();
+        {
+            sgJoint(SG_INPUT_STEERING, 0, -1.5f, 0.0f, 1.0f, 0.0f, 0.0f);
+            mTranslate(-0.3f, 0.0f, 0.0f);
+            mPush();
+            {
+                mRotate(FRONT_INCLINE + 15.0f, 0.0f, 0.0f, 1.0f);
+                mPush();
+                {
+                    mTranslate(0.0f, 0.0f, -HANDLE_ROD / 2);
+                    ZCylinder(ROD_RADIUS, HANDLE_ROD);
+                }
+                mPop();
+                mPush();
+                {
+                    mColor(0.0f, 1.0f, 0.9f);
+                    mTranslate(0.0f, 0.0f, -HANDLE_ROD / 2);
+                    ZCylinder(0.07f, HANDLE_ROD / 4);
+                    mTranslate(0.0f, 0.0f, HANDLE_ROD * 3 / 4);
+                    ZCylinder(0.07f, HANDLE_ROD / 4);
+                    mColor(0.4f, 0.0f, 0.0f);
+                }
+                mPop();
+            }
+            mPop();
+            mPush();
+            {
+                XCylinder(ROD_RADIUS, CRANK_ROD);
+                mTranslate(CRANK_ROD, 0.0f, 0.0f);
+                mRotate(CRANK_ANGLE + 15.0f, 0.0f, 0.0f, 1.0f);
+                mPush();
+                {
+                    mTranslate(0.0f, 0.0f, WHEEL_OFFSET);
+                    XCylinder(ROD_RADIUS, CRANK_RODS);
+                }
+                mPop();
+                mPush();
+                {
+                    mTranslate(0.0f, 0.0f, -WHEEL_OFFSET);
+                    XCylinder(ROD_RADIUS, CRANK_RODS);
+                }
+                mPop();
+                mTranslate(CRANK_RODS, 0.0f, 0.0f);
+                sgJoint(SG_INPUT_PEDAL, 0, -2.0f, -15.0f, 0.0f, 0.0f, 1.0f);
+                drawTyre();
+            }
+            mPop();
+        }
+        mPop();
+    }
+    mPop();
+}
+
+/********************************************
+ * Them mot mat tu giac phang vao luoi
+ ********************************************/
+static void meshQuad(Mesh *m, const GLfloat *a, const GLfloat *b,
+                     const GLfloat *c, const GLfloat *d,
+                     GLfloat nx, GLfloat ny, GLfloat nz)
+{
+    GLuint i0 = meshVertex(m, a[0], a[1], a[2], nx, ny, nz);
+    GLuint i1 = meshVertex(m, b[0], b[1], b[2], nx, ny, nz);
+    GLuint i2 = meshVertex(m, c[0], c[1], c[2], nx, ny, nz);
+    GLuint i3 = meshVertex(m, d[0], d[1], d[2], nx, ny, nz);
+    meshTriangle(m, i0, i1, i2);
+    meshTriangle(m, i0, i2, i3);
+}
+
+static void gearPointAngle(GLfloat *p, GLfloat r, GLfloat angle, GLfloat z)
+{
+    p[0] = r * cos(angle);
+    p[1] = r * sin(angle);
+    p[2] = z;
+}
+
+/********************************************
+ * Chia luoi banh rang tinh goc luc chay (cach cu): dung cho so
+ * rang khong co bang san va lam mau cho --geometry-check
+ ********************************************/
+static void buildGearAngles(Mesh *m, GLfloat inner_radius, GLfloat outer_radius,
+                            GLfloat width, GLint teeth, GLfloat tooth_depth)
+{
+    GLint i;
+    GLfloat r0 = inner_radius;
+    GLfloat r1 = outer_radius - tooth_depth / 2.0f;
+    GLfloat r2 = outer_radius + tooth_depth / 2.0f;
+    GLfloat hw = width * 0.5f;
+    GLfloat da = 2.0 * PI / teeth / 4.0;
+    GLfloat a[3], b[3], c[3], d[3];
+
+    // Mat truoc va mat sau (cung thu tu dinh nhu dai QUAD_STRIP cu)
+    for (i = 0; i < teeth; i++)
+    {
+        GLfloat angle = i * 2.0 * PI / teeth;
+        GLfloat next = (i + 1) * 2.0 * PI / teeth;
+
+        gearPointAngle(a, r0, angle, hw);
+        gearPointAngle(b, r1, angle, hw);
+        gearPointAngle(c, r1, angle + 3 * da, hw);
+        meshQuad(m, a, b, c, a, 0.0f, 0.0f, 1.0f);
+        gearPointAngle(d, r0, next, hw);
+        gearPointAngle(b, r1, next, hw);
+        meshQuad(m, a, c, b, d, 0.0f, 0.0f, 1.0f);
+
+        gearPointAngle(a, r1, angle, -hw);
+        gearPointAngle(b, r0, angle, -hw);
+        gearPointAngle(c, r1, angle + 3 * da, -hw);
+        meshQuad(m, a, b, b, c, 0.0f, 0.0f, -1.0f);
+        gearPointAngle(d, r0, next, -hw);
+        gearPointAngle(a, r1, next, -hw);
+        meshQuad(m, c, b, d, a, 0.0f, 0.0f, -1.0f);
+
+        // Mat sau cua rang
+        gearPointAngle(a, r1, angle + 3 * da, -hw);
+        gearPointAngle(b, r2, angle + 2 * da, -hw);
+        gearPointAngle(c, r2, angle + da, -hw);
+        gearPointAngle(d, r1, angle, -hw);
+        meshQuad(m, a, b, c, d, 0.0f, 0.0f, -1.0f);
+    }
+
+    // Mat ngoai cua rang
+    for (i = 0; i < teeth; i++)
+    {
+        GLfloat angle = i * 2.0 * PI / teeth;
+        GLfloat next = (i + 1 < teeth) ? (i + 1) * 2.0 * PI / teeth : 0.0f;
+        GLfloat radii[5] = {r1, r2, r2, r1, r1};
+        GLfloat angles[5] = {angle, angle + da, angle + 2 * da, angle + 3 * da, next};
+        GLint k;
+
+        for (k = 0; k < 4; k++)
+        {
+            GLfloat nx = cos(angle), ny = sin(angle);
+            gearPointAngle(a, radii[k], angles[k], hw);
+            gearPointAngle(b, radii[k], angles[k], -hw);
+            gearPointAngle(c, radii[k + 1], angles[k + 1], -hw);
+            gearPointAngle(d, radii[k + 1], angles[k + 1], hw);
+            if (k == 0 || k == 2)
+            {
+                GLfloat u = d[0] - a[0];
+                GLfloat v = d[1] - a[1];
+                GLfloat len = sqrt(u * u + v * v);
+                nx = v / len;
+                ny = -u / len;
+            }
+            meshQuad(m, a, b, c, d, nx, ny, 0.0f);
+        }
+    }
+
+    // Mat trong (to bong muot)
+    for (i = 0; i <= teeth; i++)
+    {
+        GLfloat angle = i * 2.0 * PI / teeth;
+        GLfloat ca = cos(angle), sa = sin(angle);
+        meshVertex(m, r0 * ca, r0 * sa, -hw, -ca, -sa, 0.0f);
+        meshVertex(m, r0 * ca, r0 * sa, hw, -ca, -sa, 0.0f);
+    }
+    {
+        GLuint base = m->numVertices - 2 * (teeth + 1);
+        for (i = 0; i < teeth; i++)
+        {
+            GLuint v0 = base + 2 * i;
+            meshTriangle(m, v0, v0 + 1, v0 + 3);
+            meshTriangle(m, v0, v0 + 3, v0 + 2);
+        }
+    }
+}
+
+static void gearPoint(GLfloat *p, GLfloat r, const GLfloat *cs, const GLfloat *sn,
+                      GLint j, GLfloat z)
+{
+    p[0] = r * cs[j];
+    p[1] = r * sn[j];
+    p[2] = z;
+}
+
+/********************************************
+ * Chia luoi banh rang mot lan
+ * Moi mat co dinh rieng nen khong can GL_FLAT
+ * cs/sn: cos/sin cua 4 * teeth + 1 goc chia deu vong tron,
+ * rang i chiem cac goc 4i..4i+4
+ ********************************************/
+static void buildGearRing(Mesh *m, GLfloat inner_radius, GLfloat outer_radius,
+                          GLfloat width, GLint teeth, GLfloat tooth_depth,
+                          const GLfloat *cs, const GLfloat *sn)
+{
+    GLint i;
+    GLfloat r0 = inner_radius;
+    GLfloat r1 = outer_radius - tooth_depth / 2.0f;
+    GLfloat r2 = outer_radius + tooth_depth / 2.0f;
+    GLfloat hw = width * 0.5f;
+    GLfloat a[3], b[3], c[3], d[3];
+
+    // Mat truoc va mat sau (cung thu tu dinh nhu dai QUAD_STRIP cu)
+    for (i = 0; i < teeth; i++)
+    {
+        GLint angle = 4 * i;
+        GLint next = 4 * (i + 1);
+
+        gearPoint(a, r0, cs, sn, angle, hw);
+        gearPoint(b, r1, cs, sn, angle, hw);
+        gearPoint(c, r1, cs, sn, angle + 3, hw);
+        meshQuad(m, a, b, c, a, 0.0f, 0.0f, 1.0f);
+        gearPoint(d, r0, cs, sn, next, hw);
+        gearPoint(b, r1, cs, sn, next, hw);
+        meshQuad(m, a, c, b, d, 0.0f, 0.0f, 1.0f);
+
+        gearPoint(a, r1, cs, sn, angle, -hw);
+        gearPoint(b, r0, cs, sn, angle, -hw);
+        gearPoint(c, r1, cs, sn, angle + 3, -hw);
+        meshQuad(m, a, b, b, c, 0.0f, 0.0f, -1.0f);
+        gearPoint(d, r0, cs, sn, next, -hw);
+        gearPoint(a, r1, cs, sn, next, -hw);
+        meshQuad(m, c, b, d, a, 0.0f, 0.0f, -1.0f);
+
+        // Mat sau cua rang
+        gearPoint(a, r1, cs, sn, angle + 3, -hw);
+        gearPoint(b, r2, cs, sn, angle + 2, -hw);
+        gearPoint(c, r2, cs, sn, angle + 1, -hw);
+        gearPoint(d, r1, cs, sn, angle, -hw);
+        meshQuad(m, a, b, c, d, 0.0f, 0.0f, -1.0f);
+    }
+
+    // Mat ngoai cua rang
+    for (i = 0; i < teeth; i++)
+    {
+        GLint angle = 4 * i;
+        GLint next = (i + 1 < teeth) ? 4 * (i + 1) : 0;
+        GLfloat radii[5] = {r1, r2, r2, r1, r1};
+        GLint angles[5] = {angle, angle + 1, angle + 2, angle + 3, next};
+        GLint k;
+
+        for (k = 0; k < 4; k++)
+        {
+            GLfloat nx = cs[angle], ny = sn[angle];
+            gearPoint(a, radii[k], cs, sn, angles[k], hw);
+            gearPoint(b, radii[k], cs, sn, angles[k], -hw);
+            gearPoint(c, radii[k + 1], cs, sn, angles[k + 1], -hw);
+            gearPoint(d, radii[k + 1], cs, sn, angles[k + 1], hw);
+            if (k == 0 || k == 2)
+            {
+                GLfloat u = d[0] - a[0];
+                GLfloat v = d[1] - a[1];
+                GLfloat len = sqrt(u * u + v * v);
+                nx = v / len;
+                ny = -u / len;
+            }
+            meshQuad(m, a, b, c, d, nx, ny, 0.0f);
+        }
+    }
+
+    // Mat trong (to bong muot)
+    for (i = 0; i <= teeth; i++)
+    {
+        GLfloat ca = cs[4 * i], sa = sn[4 * i];
+        meshVertex(m, r0 * ca, r0 * sa, -hw, -ca, -sa, 0.0f);
+        meshVertex(m, r0 * ca, r0 * sa, hw, -ca, -sa, 0.0f);
+    }
+    {
+        GLuint base = m->numVertices - 2 * (teeth + 1);
+        for (i = 0; i < teeth; i++)
+        {
+            GLuint v0 = base + 2 * i;
+            meshTriangle(m, v0, v0 + 1, v0 + 3);
+            meshTriangle(m, v0, v0 + 3, v0 + 2);
+        }
+    }
+}
+
+/********************************************
+ * Banh rang co san (ca muc LOD) lay goc tu bang constexpr,
+ * so rang khac moi tinh sin/cos luc chay
+ ********************************************/
+static void buildGear(Mesh *m, GLfloat inner_radius, GLfloat outer_radius,
+                      GLfloat width, GLint teeth, GLfloat tooth_depth)
+{
+    const RingEntry *ring = ringFind(4 * teeth);
+
+    if (ring)
+    {
+        buildGearRing(m, inner_radius, outer_radius, width, teeth, tooth_depth,
+                      ring->cosv, ring->sinv);
+    }
+    else
+    {
+        buildGearAngles(m, inner_radius, outer_radius, width, teeth, tooth_depth);
+    }
+}
+
+/********************************************
+ * Lay luoi banh rang tu bo nho dem theo 5 tham so,
+ * chi tao moi khi gap bo tham so chua co
+ ********************************************/
+const Mesh *gearMesh(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
+                     GLint teeth, GLfloat tooth_depth)
+{
+    GLint i;
+    GearEntry *g;
+
+    for (i = 0; i < numGears; i++)
+    {
+        g = gearCache[i];
+        if (g->inner_radius == inner_radius && g->outer_radius == outer_radius &&
+            g->width == width && g->teeth == teeth && g->tooth_depth == tooth_depth)
+        {
+            return &g->mesh;
+        }
+    }
+
+    if (numGears == capGears)
+    {
+        capGears = capGears ? capGears * 2 : 4;
+        gearCache = (GearEntry **)realloc(gearCache, capGears * sizeof(GearEntry *));
+    }
+    g = (GearEntry *)calloc(1, sizeof(GearEntry));
+    gearCache[numGears++] = g;
+    g->inner_radius = inner_radius;
+    g->outer_radius = outer_radius;
+    g->width = width;
+    g->teeth = teeth;
+    g->tooth_depth = tooth_depth;
+    buildGear(&g->mesh, inner_radius, outer_radius, width, teeth, tooth_depth);
+    meshUpload(&g->mesh);
+    return &g->mesh;
+}
+
+/********************************************
+ * Ve banh rang
+ ********************************************/
+void gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
+          GLint teeth, GLfloat tooth_depth)
+{
+    submitMesh(gearMesh(inner_radius, outer_radius, width, teeth, tooth_depth), 0);
+}
+
+/********************************************
+ * --geometry-check: bang constexpr so voi sin/cos luc chay; moi
+ * luoi co san dung bang so voi luoi dung cong thuc cu (banh rang:
+ * buildGearAngles(), xuyen/tru/cau: bang NULL), nan hoa so voi
+ * radians(i * SPOKE_ANGLE), mat duoi ghe so voi vong lat guong cu
+ ********************************************/
+#define GEOM_TOL        1e-6f
+#define GEOM_TOL_NORMAL 1e-5f       // Phap tuyen canh rang tinh tu hai diem cach nhau 0.03
+
+// Cac luoi dung luc khoi dong (initPrimitives, initWheel, initLods)
+static const GLint geomTori[][2] = { {4, 30}, {3, 20}, {10, 30}, {4, 16}, {3, 10}, {6, 16}, {4, 10} };
+static const GLint geomCylinders[] = { 15, 6, 8, 5 };
+static const GLint geomSpheres[][2] = { {10, 10}, {6, 5}, {4, 3} };
+static const GLint geomGears[] =
+{
+    CHAINRING_TEETH, SPROCKET_TEETH, CHAINRING_TEETH / 2, SPROCKET_TEETH / 2, GEAR_FLAT_TEETH
+};
+
+#define GEOM_COUNT(a)   (int)(sizeof(a) / sizeof(a[0]))
+
+// Sai so lon nhat ve vi tri (khac so dinh/chi so thi tra ve 1), sai so
+// phap tuyen cong vao *normalErr; giai phong ca hai luoi
+static GLfloat meshError(Mesh *a, Mesh *b, GLfloat *normalErr)
+{
+    GLfloat err = 0.0f;
+    int i;
+
+    if (a->numVertices != b->numVertices || a->numIndices != b->numIndices ||
+        memcmp(a->indices, b->indices, a->numIndices * sizeof(GLuint)) != 0)
+    {
+        err = 1.0f;
+    }
+    for (i = 0; err < 1.0f && i < a->numVertices; i++)
+    {
+        const GLfloat *p = &a->vertices[i].x, *q = &b->vertices[i].x;
+        int k;
+        for (k = 0; k < 6; k++)
+        {
+            GLfloat e = Abs(p[k] - q[k]);
+            if (k < 3 && e > err) err = e;
+            if (k >= 3 && e > *normalErr) *normalErr = e;
+        }
+    }
+    free(a->vertices);
+    free(a->indices);
+    free(b->vertices);
+    free(b->indices);
+    memset(a, 0, sizeof(Mesh));
+    memset(b, 0, sizeof(Mesh));
+    return err;
+}
+
+int runGeometryCheck(void)
+{
+    GLfloat errRing = 0.0f, errTorus = 0.0f, errCylinder = 0.0f, errSphere = 0.0f;
+    GLfloat errGear = 0.0f, errNormal = 0.0f, errSpokes = 0.0f, errSeat = 0.0f, e;
+    Mesh table, runtime;
+    int i, j, k, missing = 0, ok;
+
+    memset(&table, 0, sizeof(Mesh));
+    memset(&runtime, 0, sizeof(Mesh));
+
+    for (i = 0; i < GEOM_COUNT(ringTables); i++)
+    {
+        const RingEntry *r = &ringTables[i];
+        for (j = 0; j <= r->n; j++)
+        {
+            double a = 2.0 * PI * j / r->n;
+            e = Abs(r->cosv[j] - (GLfloat)cos(a));
+            if (e > errRing) errRing = e;
+            e = Abs(r->sinv[j] - (GLfloat)sin(a));
+            if (e > errRing) errRing = e;
+        }
+    }
+
+    for (i = 0; i < GEOM_COUNT(geomTori); i++)
+    {
+        GLint sides = geomTori[i][0], rings = geomTori[i][1];
+        missing += !ringFind(sides) + !ringFind(rings);
+        buildTorus(&table, 0.06f, 0.92f, sides, rings);
+        buildTorusRing(&runtime, 0.06f, 0.92f, sides, rings, NULL, NULL);
+        e = meshError(&table, &runtime, &errNormal);
+        if (e > errTorus) errTorus = e;
+    }
+    for (i = 0; i < GEOM_COUNT(geomCylinders); i++)
+    {
+        missing += !ringFind(geomCylinders[i]);
+        buildCylinder(&table, 1.0f, 0.0f, 1.0f, geomCylinders[i], 5);
+        buildCylinderRing(&runtime, 1.0f, 0.0f, 1.0f, geomCylinders[i], 5, NULL);
+        e = meshError(&table, &runtime, &errNormal);
+        if (e > errCylinder) errCylinder = e;
+    }
+    for (i = 0; i < GEOM_COUNT(geomSpheres); i++)
+    {
+        GLint slices = geomSpheres[i][0], stacks = geomSpheres[i][1];
+        missing += !ringFind(slices) + !ringFind(2 * stacks);
+        buildSphere(&table, slices, stacks);
+        buildSphereRing(&runtime, slices, stacks, NULL, NULL);
+        e = meshError(&table, &runtime, &errNormal);
+        if (e > errSphere) errSphere = e;
+    }
+    for (i = 0; i < GEOM_COUNT(geomGears); i++)
+    {
+        missing += !ringFind(4 * geomGears[i]);
+        buildGear(&table, 0.08f, 0.3f, 0.03f, geomGears[i], 0.03f);
+        buildGearAngles(&runtime, 0.08f, 0.3f, 0.03f, geomGears[i], 0.03f);
+        e = meshError(&table, &runtime, &errNormal);
+        if (e > errGear) errGear = e;
+    }
+
+    for (i = 0; i < NUM_SPOKES; i++)
+    {
+        GLfloat a = radians(i * SPOKE_ANGLE);
+        e = Abs(SpokeRing::cosv[i] - (GLfloat)cos(a));
+        if (e > errSpokes) errSpokes = e;
+        e = Abs(SpokeRing::sinv[i] - (GLfloat)sin(a));
+        if (e > errSpokes) errSpokes = e;
+    }
+    for (i = 0; i < 8; i++)
+    {
+        for (k = 0; k < 3; k++)
+        {
+            GLfloat ref = k == 1 ? -seatTop[i][k] : seatTop[i][k];
+            e = Abs(SeatBottom::v[7 - i][k] - ref);
+            if (e > errSeat) errSeat = e;
+        }
+    }
+
+    ok = errRing <= GEOM_TOL && errTorus <= GEOM_TOL && errCylinder <= GEOM_TOL &&
+         errSphere <= GEOM_TOL && errGear <= GEOM_TOL && errSpokes <= GEOM_TOL &&
+         errNormal <= GEOM_TOL_NORMAL && errSeat == 0.0f && missing == 0;
+    printf("Kiem tra bang hinh hoc tinh san (cho phep %.3g, phap tuyen %.3g)\n",
+           GEOM_TOL, GEOM_TOL_NORMAL);
+    printf("  bang cos/sin (%d bang)   sai so %.3g\n", GEOM_COUNT(ringTables), errRing);
+    printf("  xuyen (%d luoi)           sai so %.3g\n", GEOM_COUNT(geomTori), errTorus);
+    printf("  tru (%d luoi)             sai so %.3g\n", GEOM_COUNT(geomCylinders), errCylinder);
+    printf("  cau (%d luoi)             sai so %.3g\n", GEOM_COUNT(geomSpheres), errSphere);
+    printf("  banh rang (%d luoi)       sai so %.3g\n", GEOM_COUNT(geomGears), errGear);
+    printf("  phap tuyen cac luoi      sai so %.3g\n", errNormal);
+    printf("  nan hoa (%d)             sai so %.3g\n", NUM_SPOKES, errSpokes);
+    printf("  mat duoi ghe             sai so %.3g\n", errSeat);
+    printf("  so chia khong co bang    %d\n", missing);
+    printf("%s\n", ok ? "DAT" : "KHONG DAT");
+    return ok ? 0 : 1;
+}
+
+/******************************************
+ * Ve khung, ban dap, nguoi cua xe hien tai tu do thi canh
+ ******************************************/
+void drawFrame()
+{
+    drawPart(PART_FRAME);
+}
+
+void drawPedals()
+{
+    drawPart(PART_PEDALS);
+}
+
+void drawPerson(void)
+{
+    drawPart(PART_PERSON);
+}
+
+/******************************************
+ * Ve xich xe dap
+ ******************************************/
+void drawChain()
+{
+    if (bikeTransforms[currentBike].lod == NUM_LODS - 1) return;
+    mColor(0.0f, 1.0f, 0.5f);
+    submitMesh(&chainMesh, Abs(pose.speed) > 0.0f);
+}
+
+/******************************************
+ * Ve ghe ngoi
+ ******************************************/
+void drawSeat()
+{
+    submitMesh(&seatMesh, 0);
+}
+
+/******************************************
+ * Dung ban dap (ghi vao do thi canh)
+ ******************************************/
+void buildPedals(void)
+{
+    mColor(0.25f, 0.15f, 0.1f);
+    mPush();
+    {
+        mTranslate(0.0f, 0.0f, 0.105f);
+        sgJoint(SG_INPUT_PEDAL, 0, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+        mTranslate(0.25f, 0.0f, 0.0f);
+        mPush();
+        {
+            mScale(0.5f, 0.1f, 0.1f);
+            solidCube(1.0f);
+        }
+        mPop();
+        mPush();
+        {
+            mTranslate(0.25f, 0.0f, 0.15f);
+            sgJoint(SG_INPUT_PEDAL, 0, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+            mScale(0.2f, 0.02f, 0.3f);
+            solidCube(1.0f);
+        }
+        mPop();
+    }
+    mPop();
+
+    mPush();
+    {
+        mTranslate(0.0f, 0.0f, -0.105f);
+        sgJoint(SG_INPUT_PEDAL, 0, -1.0f, 180.0f, 0.0f, 0.0f, 1.0f);
+        mTranslate(0.25f, 0.0f, 0.0f);
+        mPush();
+        {
+            mScale(0.5f, 0.1f, 0.1f);
+            solidCube(1.0f);
+        }
+        mPop();
+        mPush();
+        {
+            mTranslate(0.25f, 0.0f, -0.15f);
+            sgJoint(SG_INPUT_PEDAL, 0, 1.0f, -180.0f, 0.0f, 0.0f, 1.0f);
+            mScale(0.2f, 0.02f, 0.3f);
+            solidCube(1.0f);
+        }
+        mPop();
+    }
+    mPop();
+
+    mColor(0.4f, 0.0f, 0.0f);
+}
+
+/******************************************
+ * Ve lop xe
+ ******************************************/
+void drawTyre(void)
+{
+    submitMesh(&wheelMesh, 0);
+    mColor(0.4f, 0.0f, 0.0f);
+}
+
+/******************************************
+ * Dung nguoi tren xe dap (ghi vao do thi canh)
+ ******************************************/
+void buildPerson(void)
+{
+    mColor(0.8f, 0.6f, 0.4f);
+
+    mPush();
+    {
+        mTranslate(-0.2f, 0.3f, 0.0f);
+        sgJoint(SG_INPUT_WHEELIE, 0, 0.5f, -10.0f, 0.0f, 0.0f, 1.0f);
+
+        mPush();
+        {
+            mRotate(90.0f, 1.0f, 0.0f, 0.0f);
+            ZCylinder(0.15f, 0.6f);
+        }
+        mPop();
+
+        mPush();
+        {
+            mTranslate(0.0f, 0.7f, 0.0f);
+            solidSphere(0.1f);
+        }
+        mPop();
+
+        mPush();
+        {
+            mTranslate(0.2f, 0.5f, 0.0f);
+            sgJoint(SG_INPUT_WHEELIE, 0, 0.3f, -45.0f, 0.0f, 0.0f, 1.0f);
+            mPush();
+            {
+                ZCylinder(0.05f, 0.3f);
+            }
+            mPop();
+            mPush();
+            {
+                mTranslate(0.0f, 0.0f, 0.3f);
+                mRotate(-30.0f, 0.0f, 0.0f, 1.0f);
+                ZCylinder(0.05f, 0.3f);
+            }
+            mPop();
+        }
+        mPop();
+
+        mPush();
+        {
+            mTranslate(-0.2f, 0.5f, 0.0f);
+            sgJoint(SG_INPUT_WHEELIE, 0, 0.3f, -45.0f, 0.0f, 0.0f, 1.0f);
+            mPush();
+            {
+                ZCylinder(0.05f, 0.3f);
+            }
+            mPop();
+            mPush();
+            {
+                mTranslate(0.0f, 0.0f, 0.3f);
+                mRotate(-30.0f, 0.0f, 0.0f, 1.0f);
+                ZCylinder(0.05f, 0.3f);
+            }
+            mPop();
+        }
+        mPop();
+
+        mPush();
+        {
+            mTranslate(0.1f, 0.0f, 0.105f);
+            sgJoint(SG_INPUT_PEDAL, 0, -1.0f, -90.0f, 0.0f, 0.0f, 1.0f);
+            mPush();
+            {
+                ZCylinder(0.07f, 0.4f);
+            }
+            mPop();
+            mPush();
+            {
+                mTranslate(0.0f, 0.0f, 0.4f);
+                sgJoint(SG_INPUT_PEDAL, 1, 60.0f, 30.0f, 0.0f, 0.0f, 1.0f);
+                ZCylinder(0.07f, 0.4f);
+            }
+            mPop();
+        }
+        mPop();
+
+        mPush();
+        {
+            mTranslate(-0.1f, 0.0f, -0.105f);
+            sgJoint(SG_INPUT_PEDAL, 0, -1.0f, 90.0f, 0.0f, 0.0f, 1.0f);
+            mPush();
+            {
+                ZCylinder(0.07f, 0.4f);
+            }
+            mPop();
+            mPush();
+            {
+                mTranslate(0.0f, 0.0f, 0.4f);
+                sgJoint(SG_INPUT_PEDAL, 1, -60.0f, 30.0f, 0.0f, 0.0f, 1.0f);
+                ZCylinder(0.07f, 0.4f);
+            }
+            mPop();
+        }
+        mPop();
+    }
+    mPop();
+
+    mColor(0.4f, 0.0f, 0.0f);
+}
+
+/******************************************
+ * Font Helvetica 12 (tu freeglut, goc X11 Adobe): do rong va
+ * 16 hang bit cua tung ky tu ' ' .. '~'
+ ******************************************/
+static const HudGlyph hudFont[HUD_NUM_CHARS] =
+{
+    {  4, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // ' '
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // '!'
+    {  5, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x5000, 0x5000, 0x5000, 0x0, 0x0, 0x0 } }, // '"'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x5000, 0x5000, 0x5000, 0xfc00, 0x2800, 0xfc00, 0x2800, 0x2800, 0x0, 0x0, 0x0, 0x0 } }, // '#'
+    {  7, { 0x0, 0x0, 0x0, 0x1000, 0x3800, 0x5400, 0x5400, 0x1400, 0x3800, 0x5000, 0x5400, 0x3800, 0x1000, 0x0, 0x0, 0x0 } }, // '$'
+    { 11, { 0x0, 0x0, 0x0, 0x0, 0x1180, 0xa40, 0xa40, 0x980, 0x400, 0x3400, 0x4a00, 0x4a00, 0x3100, 0x0, 0x0, 0x0 } }, // '%'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x3900, 0x4600, 0x4200, 0x4500, 0x2800, 0x1800, 0x2400, 0x2400, 0x1800, 0x0, 0x0, 0x0 } }, // '&'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x4000, 0x2000, 0x6000, 0x0, 0x0, 0x0 } }, // '''
+    {  4, { 0x0, 0x1000, 0x2000, 0x2000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x2000, 0x2000, 0x1000, 0x0, 0x0, 0x0 } }, // '('
+    {  4, { 0x0, 0x8000, 0x4000, 0x4000, 0x2000, 0x2000, 0x2000, 0x2000, 0x2000, 0x2000, 0x4000, 0x4000, 0x8000, 0x0, 0x0, 0x0 } }, // ')'
+    {  5, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x5000, 0x2000, 0x5000, 0x0, 0x0, 0x0 } }, // '*'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x1000, 0x1000, 0x7c00, 0x1000, 0x1000, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '+'
+    {  4, { 0x0, 0x0, 0x4000, 0x2000, 0x2000, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // ','
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x7c00, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '-'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '.'
+    {  4, { 0x0, 0x0, 0x0, 0x0, 0x8000, 0x8000, 0x4000, 0x4000, 0x4000, 0x2000, 0x2000, 0x1000, 0x1000, 0x0, 0x0, 0x0 } }, // '/'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '0'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x7000, 0x1000, 0x0, 0x0, 0x0 } }, // '1'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x7c00, 0x4000, 0x4000, 0x2000, 0x1000, 0x800, 0x400, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '2'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x400, 0x400, 0x1800, 0x400, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '3'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x800, 0x800, 0xfc00, 0x8800, 0x4800, 0x2800, 0x2800, 0x1800, 0x800, 0x0, 0x0, 0x0 } }, // '4'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x400, 0x400, 0x7800, 0x4000, 0x4000, 0x7c00, 0x0, 0x0, 0x0 } }, // '5'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x4400, 0x6400, 0x5800, 0x4000, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '6'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x2000, 0x2000, 0x1000, 0x1000, 0x1000, 0x800, 0x800, 0x400, 0x7c00, 0x0, 0x0, 0x0 } }, // '7'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x4400, 0x4400, 0x3800, 0x4400, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '8'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x400, 0x400, 0x3c00, 0x4400, 0x4400, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '9'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x0, 0x0, 0x0, 0x0, 0x4000, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // ':'
+    {  3, { 0x0, 0x0, 0x8000, 0x4000, 0x4000, 0x0, 0x0, 0x0, 0x0, 0x4000, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // ';'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x0, 0xc00, 0x3000, 0xc000, 0x3000, 0xc00, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '<'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x7c00, 0x0, 0x7c00, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '='
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x6000, 0x1800, 0x600, 0x1800, 0x6000, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '>'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x1000, 0x0, 0x1000, 0x1000, 0x800, 0x800, 0x4400, 0x4400, 0x3800, 0x0, 0x0, 0x0 } }, // '?'
+    { 12, { 0x0, 0x0, 0x0, 0x1f00, 0x2000, 0x4d80, 0x5340, 0x5120, 0x5120, 0x4920, 0x26a0, 0x3040, 0xf80, 0x0, 0x0, 0x0 } }, // '@'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x4100, 0x4100, 0x4100, 0x3e00, 0x2200, 0x2200, 0x1400, 0x1400, 0x800, 0x0, 0x0, 0x0 } }, // 'A'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x7c00, 0x4200, 0x4200, 0x4200, 0x7c00, 0x4200, 0x4200, 0x4200, 0x7c00, 0x0, 0x0, 0x0 } }, // 'B'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x1e00, 0x2100, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x2100, 0x1e00, 0x0, 0x0, 0x0 } }, // 'C'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x7c00, 0x4200, 0x4100, 0x4100, 0x4100, 0x4100, 0x4100, 0x4200, 0x7c00, 0x0, 0x0, 0x0 } }, // 'D'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x7e00, 0x4000, 0x4000, 0x4000, 0x7e00, 0x4000, 0x4000, 0x4000, 0x7e00, 0x0, 0x0, 0x0 } }, // 'E'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x7c00, 0x4000, 0x4000, 0x4000, 0x7e00, 0x0, 0x0, 0x0 } }, // 'F'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x1d00, 0x2300, 0x4100, 0x4100, 0x4700, 0x4000, 0x4000, 0x2100, 0x1e00, 0x0, 0x0, 0x0 } }, // 'G'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x4100, 0x4100, 0x4100, 0x4100, 0x7f00, 0x4100, 0x4100, 0x4100, 0x4100, 0x0, 0x0, 0x0 } }, // 'H'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 'I'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x400, 0x400, 0x400, 0x400, 0x400, 0x400, 0x0, 0x0, 0x0 } }, // 'J'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x4100, 0x4200, 0x4400, 0x4800, 0x7000, 0x5000, 0x4800, 0x4400, 0x4200, 0x0, 0x0, 0x0 } }, // 'K'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x7c00, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 'L'
+    { 11, { 0x0, 0x0, 0x0, 0x0, 0x4440, 0x4440, 0x4a40, 0x4a40, 0x5140, 0x5140, 0x60c0, 0x60c0, 0x4040, 0x0, 0x0, 0x0 } }, // 'M'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x4100, 0x4300, 0x4500, 0x4500, 0x4900, 0x5100, 0x5100, 0x6100, 0x4100, 0x0, 0x0, 0x0 } }, // 'N'
+    { 10, { 0x0, 0x0, 0x0, 0x0, 0x1e00, 0x2100, 0x4080, 0x4080, 0x4080, 0x4080, 0x4080, 0x2100, 0x1e00, 0x0, 0x0, 0x0 } }, // 'O'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x7c00, 0x4200, 0x4200, 0x4200, 0x7c00, 0x0, 0x0, 0x0 } }, // 'P'
+    { 10, { 0x0, 0x0, 0x0, 0x0, 0x1e80, 0x2100, 0x4280, 0x4480, 0x4080, 0x4080, 0x4080, 0x2100, 0x1e00, 0x0, 0x0, 0x0 } }, // 'Q'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x4200, 0x4200, 0x4200, 0x4400, 0x7c00, 0x4200, 0x4200, 0x4200, 0x7c00, 0x0, 0x0, 0x0 } }, // 'R'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x3c00, 0x4200, 0x4200, 0x200, 0xc00, 0x3000, 0x4000, 0x4200, 0x3c00, 0x0, 0x0, 0x0 } }, // 'S'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0xfe00, 0x0, 0x0, 0x0 } }, // 'T'
+    {  8, { 0x0, 0x0, 0x0, 0x0, 0x3c00, 0x4200, 0x4200, 0x4200, 0x4200, 0x4200, 0x4200, 0x4200, 0x4200, 0x0, 0x0, 0x0 } }, // 'U'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x800, 0x800, 0x1400, 0x1400, 0x2200, 0x2200, 0x2200, 0x4100, 0x4100, 0x0, 0x0, 0x0 } }, // 'V'
+    { 11, { 0x0, 0x0, 0x0, 0x0, 0x1100, 0x1100, 0x1100, 0x2a80, 0x2a80, 0x2480, 0x4440, 0x4440, 0x4440, 0x0, 0x0, 0x0 } }, // 'W'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x4100, 0x2200, 0x2200, 0x1400, 0x800, 0x1400, 0x2200, 0x2200, 0x4100, 0x0, 0x0, 0x0 } }, // 'X'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x800, 0x800, 0x800, 0x800, 0x1400, 0x2200, 0x2200, 0x4100, 0x4100, 0x0, 0x0, 0x0 } }, // 'Y'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x7f00, 0x4000, 0x2000, 0x1000, 0x800, 0x400, 0x200, 0x100, 0x7f00, 0x0, 0x0, 0x0 } }, // 'Z'
+    {  3, { 0x0, 0x6000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x6000, 0x0, 0x0, 0x0 } }, // '['
+    {  4, { 0x0, 0x0, 0x0, 0x0, 0x1000, 0x1000, 0x2000, 0x2000, 0x2000, 0x4000, 0x4000, 0x8000, 0x8000, 0x0, 0x0, 0x0 } }, // '\'
+    {  3, { 0x0, 0xc000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0xc000, 0x0, 0x0, 0x0 } }, // ']'
+    {  6, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x8800, 0x5000, 0x2000, 0x0, 0x0, 0x0, 0x0 } }, // '^'
+    {  7, { 0x0, 0x0, 0xfe00, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '_'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0xc000, 0x8000, 0x4000, 0x0, 0x0, 0x0 } }, // '`'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3a00, 0x4400, 0x4400, 0x3c00, 0x400, 0x4400, 0x3800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'a'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x5800, 0x6400, 0x4400, 0x4400, 0x4400, 0x6400, 0x5800, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 'b'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4000, 0x4000, 0x4000, 0x4400, 0x3800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'c'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3400, 0x4c00, 0x4400, 0x4400, 0x4400, 0x4c00, 0x3400, 0x400, 0x400, 0x0, 0x0, 0x0 } }, // 'd'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4000, 0x7c00, 0x4400, 0x4400, 0x3800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'e'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0xe000, 0x4000, 0x3000, 0x0, 0x0, 0x0 } }, // 'f'
+    {  7, { 0x0, 0x3800, 0x4400, 0x400, 0x3400, 0x4c00, 0x4400, 0x4400, 0x4400, 0x4c00, 0x3400, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'g'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x6400, 0x5800, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 'h'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x4000, 0x0, 0x0, 0x0 } }, // 'i'
+    {  3, { 0x0, 0x8000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x4000, 0x0, 0x0, 0x0 } }, // 'j'
+    {  6, { 0x0, 0x0, 0x0, 0x0, 0x4400, 0x4800, 0x5000, 0x6000, 0x6000, 0x5000, 0x4800, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 'k'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 'l'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x4900, 0x4900, 0x4900, 0x4900, 0x4900, 0x6d00, 0x5200, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'm'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x6400, 0x5800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'n'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3800, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x3800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'o'
+    {  7, { 0x0, 0x4000, 0x4000, 0x4000, 0x5800, 0x6400, 0x4400, 0x4400, 0x4400, 0x6400, 0x5800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'p'
+    {  7, { 0x0, 0x400, 0x400, 0x400, 0x3400, 0x4c00, 0x4400, 0x4400, 0x4400, 0x4c00, 0x3400, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'q'
+    {  4, { 0x0, 0x0, 0x0, 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x6000, 0x5000, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'r'
+    {  6, { 0x0, 0x0, 0x0, 0x0, 0x3000, 0x4800, 0x800, 0x3000, 0x4000, 0x4800, 0x3000, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 's'
+    {  3, { 0x0, 0x0, 0x0, 0x0, 0x6000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0xe000, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // 't'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x3400, 0x4c00, 0x4400, 0x4400, 0x4400, 0x4400, 0x4400, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'u'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x1000, 0x1000, 0x2800, 0x2800, 0x4400, 0x4400, 0x4400, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'v'
+    {  9, { 0x0, 0x0, 0x0, 0x0, 0x2200, 0x2200, 0x5500, 0x4900, 0x4900, 0x8880, 0x8880, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'w'
+    {  6, { 0x0, 0x0, 0x0, 0x0, 0x8400, 0x8400, 0x4800, 0x3000, 0x3000, 0x4800, 0x8400, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'x'
+    {  7, { 0x0, 0x4000, 0x2000, 0x1000, 0x1000, 0x2800, 0x2800, 0x4800, 0x4400, 0x4400, 0x4400, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'y'
+    {  6, { 0x0, 0x0, 0x0, 0x0, 0x7800, 0x4000, 0x2000, 0x2000, 0x1000, 0x800, 0x7800, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // 'z'
+    {  4, { 0x0, 0x3000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x8000, 0x4000, 0x4000, 0x4000, 0x4000, 0x3000, 0x0, 0x0, 0x0 } }, // '{'
+    {  3, { 0x0, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x4000, 0x0, 0x0, 0x0 } }, // '|'
+    {  4, { 0x0, 0xc000, 0x2000, 0x2000, 0x2000, 0x2000, 0x2000, 0x1000, 0x2000, 0x2000, 0x2000, 0x2000, 0xc000, 0x0, 0x0, 0x0 } }, // '}'
+    {  7, { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x9800, 0x6400, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 } }, // '~'
+};
+
+/******************************************
+ * Tao texture atlas tu bang font va bo dinh cho HUD
+ ******************************************/
+void initHud(void)
+{
+    static GLubyte atlas[HUD_ATLAS_H][HUD_ATLAS_W];
+    int c, row, col;
+
+    for (c = 0; c < HUD_NUM_CHARS; c++)
+    {
+        const HudGlyph *g = &hudFont[c];
+        int x0 = (c % HUD_ATLAS_COLS) * HUD_CELL;
+        int y0 = (c / HUD_ATLAS_COLS) * HUD_CELL;
+
+        for (row = 0; row < HUD_GLYPH_HEIGHT; row++)
+        {
+            for (col = 0; col < g->width; col++)
+            {
+                if (g->rows[row] & (0x8000 >> col)) atlas[y0 + row][x0 + col] = 255;
+            }
+        }
+    }
+
+    glGenTextures(1, &hudTexture);
+    glBindTexture(GL_TEXTURE_2D, hudTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, HUD_ATLAS_W, HUD_ATLAS_H, 0,
+                 GL_ALPHA, GL_UNSIGNED_BYTE, atlas);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glAlphaFunc(GL_GREATER, 0.5f);
+
+    if (pglGenBuffers)
+    {
+        pglGenBuffers(1, &hudVbo);
+        pglBindBuffer(GL_ARRAY_BUFFER, hudVbo);
+        pglBufferData(GL_ARRAY_BUFFER, sizeof(hudVertices), NULL, GL_DYNAMIC_DRAW);
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+/******************************************
+ * Them mot dong chu vao bo dinh tu tu giac 'first'; (x, y) la
+ * diem dau duong chan chu (pixel). Tra ve so tu giac da them
+ ******************************************/
+static int hudText(int first, int x, int y, const char *str,
+                   GLubyte r, GLubyte g, GLubyte b)
+{
+    int n = 0;
+
+    for (; *str; str++)
+    {
+        int c = (unsigned char)*str - HUD_FIRST_CHAR;
+        const HudGlyph *glyph;
+        HudVertex *v;
+        GLfloat x0, y0, x1, y1, u0, v0, u1, v1;
+        int k;
+
+        if (c < 0 || c >= HUD_NUM_CHARS) continue;
+        glyph = &hudFont[c];
+        if (glyph->width == 0) continue;
+        if (first + n == MAX_HUD_QUADS) break;
+        if (*str != ' ')
+        {
+            x0 = (GLfloat)x;
+            y0 = (GLfloat)(y - HUD_GLYPH_BASELINE);
+            x1 = x0 + glyph->width;
+            y1 = y0 + HUD_GLYPH_HEIGHT;
+            u0 = (GLfloat)((c % HUD_ATLAS_COLS) * HUD_CELL) / HUD_ATLAS_W;
+            v0 = (GLfloat)((c / HUD_ATLAS_COLS) * HUD_CELL) / HUD_ATLAS_H;
+            u1 = u0 + (GLfloat)glyph->width / HUD_ATLAS_W;
+            v1 = v0 + (GLfloat)HUD_GLYPH_HEIGHT / HUD_ATLAS_H;
+
+            v = &hudVertices[(first + n) * 4];
+            v[0].x = x0; v[0].y = y0; v[0].u = u0; v[0].v = v0;
+            v[1].x = x1; v[1].y = y0; v[1].u = u1; v[1].v = v0;
+            v[2].x = x1; v[2].y = y1; v[2].u = u1; v[2].v = v1;
+            v[3].x = x0; v[3].y = y1; v[3].u = u0; v[3].v = v1;
+            for (k = 0; k < 4; k++)
+            {
+                v[k].r = r; v[k].g = g; v[k].b = b; v[k].a = 255;
+            }
+            n++;
+        }
+        x += glyph->width;
+    }
+    return n;
+}
+
+/******************************************
+ * Bang thoi gian: min / trung binh / p99 (ms) cua tung giai doan,
+ * dong dau o toa do y; tra ve so o chu
+ ******************************************/
+static int hudTimingText(int first, int x, int y)
+{
+    char line[160];
+    int n = 0, len;
+
+#ifdef XEDAP_ALLOC_TRACK
+    sprintf(line, "Thoi gian (ms) min/tb/p99 - CPU%s   (ma tran tinh lai: %lu, cap phat: %lu + driver %lu)",
+            gpuTimers ? " | GPU" : "", sgMatrixUpdates, frameAllocs, frameDriverAllocs);
+#else
+    sprintf(line, "Thoi gian (ms) min/tb/p99 - CPU%s   (ma tran tinh lai: %lu)",
+            gpuTimers ? " | GPU" : "", sgMatrixUpdates);
+#endif
+    n += hudText(first + n, x, y, line, 153, 230, 255);
+
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        double mn, avg, p99;
+
+        timingStats(0, i, &mn, &avg, &p99);
+        len = sprintf(line, "%-16s %6.2f %6.2f %6.2f", phaseNames[i], mn, avg, p99);
+        if (gpuTimers && isGpuPhase(i))
+        {
+            timingStats(1, i, &mn, &avg, &p99);
+            sprintf(line + len, "  | %6.2f %6.2f %6.2f", mn, avg, p99);
+        }
+        n += hudText(first + n, x, y - (1 + i) * HUD_LINE_HEIGHT, line, 153, 230, 255);
+    }
+
+    len = sprintf(line, "Ngoai khung nhin%s: xe %d/%d, bo phan %d/%d, o dat %d/%d",
+                  useCulling ? "" : " (tat)",
+                  cullStats.bikesCulled, cullStats.bikes,
+                  cullStats.partsCulled, cullStats.parts,
+                  cullStats.chunksCulled, cullStats.chunks);
+    if (terrainLoaded)
+    {
+        sprintf(line + len, "   dia hinh: %d/%d o, %lu lan nap",
+                terrainResident, terrainCacheCap, terrainLoads);
+    }
+    n += hudText(first + n, x, y - (1 + NUM_PHASES) * HUD_LINE_HEIGHT, line, 153, 230, 255);
+
+    if (inputLatencyCount > 0)
+    {
+        static double p50, p95, p99, mx;
+        static int statsCount = 0;
+
+        // Chi sap xep lai mau khi co lan nhan moi
+        if (statsCount != inputLatencyCount)
+        {
+            inputStats(&p50, &p95, &p99, &mx);
+            statsCount = inputLatencyCount;
+        }
+        sprintf(line, "Nhap -> hien (ms) p50/p95/p99/max: %.1f %.1f %.1f %.1f  (%d lan)",
+                p50, p95, p99, mx, inputLatencyCount);
+        n += hudText(first + n, x, y - (2 + NUM_PHASES) * HUD_LINE_HEIGHT, line, 153, 230, 255);
+    }
+    return n;
+}
+
+/******************************************
+ * Ve nhan dieu khien tren man hinh: dong huong dan chi dung lai
+ * khi doi kich thuoc, dong toc do khi gia tri doi, bang thoi gian
+ * HUD_TIMING_HZ lan/giay; tat ca ve bang mot lenh
+ ******************************************/
+void drawControlsText(void)
+{
+    static const char *controls[] =
+    {
+        "Project made by: NGUYEN HUU PHONG & HOANG MINH TRI",
+        "R: Dat lai",
+        "W: Di toi",
+        "A: Re trai",
+        "S: Lui lai",
+        "D: Re phai",
+        "L: Tu dong chay",
+        "K: Dung lai",
+        "T: Bat/tat bang thoi gian",
+        "Esc: thoat chuong trinh"
+    };
+    static GLfloat lastSpeed = 0.0f;
+    static int lastCount = -1, lastInstanced = -1, lastLod[NUM_LODS];
+    static int lastShowTiming = 0;
+    static double lastTimingTime = 0.0;
+    const int numControls = sizeof(controls) / sizeof(controls[0]);
+    int x = 10;
+    int y = viewHeight - 20;
+    int dirtyFrom = -1;
+    int speedChanged, speedFirst;
+    double now = nowSeconds();
+    const char *base = (const char *)hudVertices;
+
+    if (hudStaticDirty)
+    {
+        hudStaticQuads = 0;
+        for (int i = 0; i < numControls; i++)
+        {
+            hudStaticQuads += hudText(hudStaticQuads, x, y - i * HUD_LINE_HEIGHT,
+                                      controls[i], 255, 255, 0);
+        }
+        hudStaticDirty = 0;
+        dirtyFrom = 0;
+    }
+
+    // Bang thoi gian nam sau cac dong huong dan; giua cac lan lam moi
+    // giu nguyen chu va vung dem
+    if (showTiming != lastShowTiming ||
+        (showTiming && (dirtyFrom >= 0 || now - lastTimingTime >= 1.0 / HUD_TIMING_HZ)))
+    {
+        hudTimingQuads = showTiming ?
+            hudTimingText(hudStaticQuads, x, y - (numControls + 2) * HUD_LINE_HEIGHT) : 0;
+        lastShowTiming = showTiming;
+        lastTimingTime = now;
+        if (dirtyFrom < 0) dirtyFrom = hudStaticQuads;
+    }
+    speedFirst = hudStaticQuads + hudTimingQuads;
+
+    speedChanged = pose.speed != lastSpeed || fleet.count != lastCount ||
+                   drawInstanced != lastInstanced ||
+                   (fleet.count > 1 && memcmp(lodCounts, lastLod, sizeof(lastLod)) != 0);
+    if (dirtyFrom >= 0 || speedChanged)
+    {
+        char speedStr[128];
+        int len = sprintf(speedStr, "Toc do: %.2f", pose.speed);
+        if (fleet.count > 1)
+        {
+            sprintf(speedStr + len, "   So xe: %d%s   LOD: %d/%d/%d", fleet.count,
+                    drawInstanced ? " (instancing)" : "",
+                    lodCounts[0], lodCounts[1], lodCounts[2]);
+        }
+        hudSpeedQuads = hudText(speedFirst, x, y - numControls * HUD_LINE_HEIGHT,
+                                speedStr, 255, 255, 0);
+        lastSpeed = pose.speed;
+        lastCount = fleet.count;
+        lastInstanced = drawInstanced;
+        memcpy(lastLod, lodCounts, sizeof(lastLod));
+        if (dirtyFrom < 0) dirtyFrom = speedFirst;
+    }
+    hudQuads = speedFirst + hudSpeedQuads;
+
+    if (hudVbo)
+    {
+        pglBindBuffer(GL_ARRAY_BUFFER, hudVbo);
+        if (dirtyFrom >= 0 && dirtyFrom < hudQuads)
+        {
+            pglBufferSubData(GL_ARRAY_BUFFER, dirtyFrom * 4 * sizeof(HudVertex),
+                             (hudQuads - dirtyFrom) * 4 * sizeof(HudVertex),
+                             &hudVertices[dirtyFrom * 4]);
+        }
+        base = NULL;
+    }
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, viewWidth, 0, viewHeight, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_ALPHA_TEST);
+    glBindTexture(GL_TEXTURE_2D, hudTexture);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(HudVertex), base);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(HudVertex), base + 2 * sizeof(GLfloat));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(HudVertex), base + 4 * sizeof(GLfloat));
+    glDrawArrays(GL_QUADS, 0, hudQuads * 4);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (hudVbo) pglBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_ALPHA_TEST);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_DEPTH_TEST);
+
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+}
+
+/******************************************
+ * Khoi tao OpenGL
+ ******************************************/
+void init()
+{
+    GLfloat mat_specular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    GLfloat mat_shininess[] = {100.0f};
+    GLfloat light_directional[] = {1.0f, 1.0f, 1.0f, 0.0f};
+    GLfloat light_diffuse[] = {1.0f, 1.0f, 1.0f, 1.0f};
+
+    reset();
+    if (replayPath) replayStart();
+    else if (recordPath) recordOpen(recordPath);
+    if (tracePath) traceOpen(tracePath);
+    initPrimitives();
+    initGrid();
+    initInstancing();
+    initSkinning();
+    initHud();
+    if (gpuTimers) pglGenQueries(GPU_QUERY_LAG * NUM_PHASES, &gpuQueries[0][0]);
+    if (timingCsvPath) openTimingCsv(timingCsvPath);
+    if (inputLogPath)
+    {
+        inputLog = fopen(inputLogPath, "w");
+        if (inputLog) fprintf(inputLog, "key,input_ms,tick,frame,present_ms,latency_ms\n");
+        else fprintf(stderr, "Khong mo duoc %s\n", inputLogPath);
+    }
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glShadeModel(GL_SMOOTH);
+    glLightfv(GL_LIGHT0, GL_POSITION, light_directional);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glColorMaterial(GL_FRONT, GL_DIFFUSE);
+
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+    glEnable(GL_COLOR_MATERIAL);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_NORMALIZE);
+}
+
+/******************************************
+ * Doc / ghi so nguyen little-endian va so bien do dai (7 bit moi byte)
+ ******************************************/
+static void logPut8(FILE *f, unsigned int v)
+{
+    fputc(v & 0xff, f);
+}
+
+static void logPut16(FILE *f, unsigned int v)
+{
+    logPut8(f, v);
+    logPut8(f, v >> 8);
+}
+
+static void logPut32(FILE *f, unsigned int v)
+{
+    logPut16(f, v);
+    logPut16(f, v >> 16);
+}
+
+static void logPutVarint(FILE *f, unsigned long v)
+{
+    while (v >= 0x80)
+    {
+        logPut8(f, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    logPut8(f, v);
+}
+
+static int logGet8(FILE *f, unsigned int *v)
+{
+    int c = fgetc(f);
+    if (c == EOF) return 0;
+    *v = (unsigned int)c;
+    return 1;
+}
+
+static int logGet16(FILE *f, unsigned int *v)
+{
+    unsigned int lo, hi;
+    if (!logGet8(f, &lo) || !logGet8(f, &hi)) return 0;
+    *v = lo | (hi << 8);
+    return 1;
+}
+
+static int logGet32(FILE *f, unsigned int *v)
+{
+    unsigned int lo, hi;
+    if (!logGet16(f, &lo) || !logGet16(f, &hi)) return 0;
+    *v = lo | (hi << 16);
+    return 1;
+}
+
+static int logGetVarint(FILE *f, unsigned long *v)
+{
+    unsigned int c;
+    int shift = 0;
+
+    *v = 0;
+    do
+    {
+        if (!logGet8(f, &c) || shift > 56) return 0;
+        *v |= (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+/******************************************
+ * Khoa chung cua bo nho dem o dia hinh va hang doi dung luoi
+ ******************************************/
+static void terrainLockEnter(void)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&terrainLock);
+#else
+    pthread_mutex_lock(&terrainLock);
+#endif
+}
+
+static void terrainLockLeave(void)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&terrainLock);
+#else
+    pthread_mutex_unlock(&terrainLock);
+#endif
+}
+
+/******************************************
+ * Mo file dia hinh: chi doc 64 byte dau, cac o anh xa khi can.
+ *   "XDHM", phien ban, so o X, so o Z, so canh moi o (u32),
+ *   goc X, goc Z (i32), buoc do cao, cao thap nhat, cao nhat (float).
+ * Moi o: (canh + 1)^2 mau int16 little-endian, o sau lien o truoc
+ ******************************************/
+int terrainOpen(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    char magic[4];
+    unsigned int version, tilesX, tilesZ, cells, originX, originZ, scale, mn, mx;
+    unsigned long long need, size;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "Khong mo duoc %s\n", path);
+        return 0;
+    }
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TERRAIN_MAGIC, 4) != 0 ||
+        !logGet32(f, &version) || version != TERRAIN_VERSION ||
+        !logGet32(f, &tilesX) || !logGet32(f, &tilesZ) || !logGet32(f, &cells) ||
+        !logGet32(f, &originX) || !logGet32(f, &originZ) ||
+        !logGet32(f, &scale) || !logGet32(f, &mn) || !logGet32(f, &mx) ||
+        cells != GRID_CHUNK_SIZE || tilesX < 1 || tilesZ < 1 ||
+        (int)originX % GRID_CHUNK_SIZE != 0 || (int)originZ % GRID_CHUNK_SIZE != 0)
+    {
+        fprintf(stderr, "%s khong phai file dia hinh hop le (o %d x %d)\n",
+                path, GRID_CHUNK_SIZE, GRID_CHUNK_SIZE);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    terrainTilesX = tilesX;
+    terrainTilesZ = tilesZ;
+    terrainOriginX = (int)originX;
+    terrainOriginZ = (int)originZ;
+    memcpy(&terrainScale, &scale, sizeof(GLfloat));
+    memcpy(&terrainMinH, &mn, sizeof(GLfloat));
+    memcpy(&terrainMaxH, &mx, sizeof(GLfloat));
+    terrainTileBytes = (size_t)(GRID_CHUNK_SIZE + 1) * (GRID_CHUNK_SIZE + 1) * sizeof(short);
+    need = TERRAIN_HEADER + (unsigned long long)tilesX * tilesZ * terrainTileBytes;
+
+#ifdef _WIN32
+    {
+        SYSTEM_INFO info;
+        LARGE_INTEGER length;
+
+        InitializeCriticalSection(&terrainLock);
+        InitializeConditionVariable(&mesherWake);
+        GetSystemInfo(&info);
+        terrainGranularity = info.dwAllocationGranularity;
+        terrainFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (terrainFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(terrainFile, &length))
+        {
+            fprintf(stderr, "Khong mo duoc %s\n", path);
+            return 0;
+        }
+        size = (unsigned long long)length.QuadPart;
+        terrainMapping = CreateFileMappingA(terrainFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (terrainMapping == NULL) size = 0;
+    }
+#else
+    {
+        struct stat st;
+
+        terrainGranularity = (unsigned long long)sysconf(_SC_PAGESIZE);
+        terrainFd = open(path, O_RDONLY);
+        if (terrainFd < 0 || fstat(terrainFd, &st) != 0)
+        {
+            fprintf(stderr, "Khong mo duoc %s\n", path);
+            return 0;
+        }
+        size = (unsigned long long)st.st_size;
+    }
+#endif
+    // Anh xa vuot cuoi file se loi khi doc: kiem tra truoc
+    if (size < need)
+    {
+        fprintf(stderr, "%s bi cat cut (%llu / %llu byte)\n", path, size, need);
+        return 0;
+    }
+    terrainLoaded = 1;
+    printf("Dia hinh %s: %d x %d o (%d x %d don vi), cao %.2f..%.2f\n", path,
+           terrainTilesX, terrainTilesZ, terrainTilesX * GRID_CHUNK_SIZE,
+           terrainTilesZ * GRID_CHUNK_SIZE, terrainMinH, terrainMaxH);
+    return 1;
+}
+
+/******************************************
+ * Anh xa / bo anh xa mot o. Vi tri anh xa phai canh theo
+ * terrainGranularity nen vung anh xa bat dau truoc o mot chut
+ ******************************************/
+static int terrainMapTile(TerrainTile *t)
+{
+    unsigned long long offset = TERRAIN_HEADER +
+        ((unsigned long long)t->tz * terrainTilesX + t->tx) * terrainTileBytes;
+    unsigned long long aligned = offset / terrainGranularity * terrainGranularity;
+    size_t size = (size_t)(offset - aligned) + terrainTileBytes;
+    void *view;
+
+#ifdef _WIN32
+    view = MapViewOfFile(terrainMapping, FILE_MAP_READ, (DWORD)(aligned >> 32),
+                         (DWORD)aligned, size);
+    if (view == NULL) return 0;
+#else
+    view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, terrainFd, (off_t)aligned);
+    if (view == MAP_FAILED) return 0;
+#endif
+    t->view = view;
+    t->viewSize = size;
+    t->samples = (const short *)((const char *)view + (offset - aligned));
+    terrainLoads++;
+    return 1;
+}
+
+static void terrainUnmapTile(TerrainTile *t)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(t->view);
+#else
+    munmap(t->view, t->viewSize);
+#endif
+    t->view = NULL;
+    t->samples = NULL;
+}
+
+/******************************************
+ * Them 'count' o trong vao bo nho dem (giu khoa)
+ ******************************************/
+static void terrainGrowLocked(int count)
+{
+    int i;
+
+    terrainTiles = (TerrainTile **)realloc(terrainTiles,
+                                          (terrainCacheCap + count) * sizeof(TerrainTile *));
+    for (i = 0; i < count; i++)
+    {
+        terrainTiles[terrainCacheCap + i] = (TerrainTile *)calloc(1, sizeof(TerrainTile));
+    }
+    terrainCacheCap += count;
+}
+
+/******************************************
+ * Lay o (tx, tz) (giu khoa): tang so tham chieu, anh xa neu chua co,
+ * thay o it dung nhat khong ai giu; tat ca dang giu thi tang bo nho
+ * dem gap doi. NULL ngoai ban do hoac khi khong anh xa duoc
+ ******************************************/
+static TerrainTile *terrainAcquireLocked(int tx, int tz)
+{
+    static int mapFailed = 0;
+    TerrainTile *victim = NULL;
+    int i;
+
+    if (tx < 0 || tz < 0 || tx >= terrainTilesX || tz >= terrainTilesZ) return NULL;
+    if (terrainCacheCap == 0) terrainGrowLocked(TERRAIN_CACHE_TILES);
+    for (i = 0; i < terrainCacheCap; i++)
+    {
+        TerrainTile *t = terrainTiles[i];
+        if (t->valid && t->tx == tx && t->tz == tz)
+        {
+            t->refs++;
+            t->lastUse = ++terrainClock;
+            return t;
+        }
+        if (t->refs == 0 && (victim == NULL || !t->valid ||
+                             (victim->valid && t->lastUse < victim->lastUse)))
+        {
+            if (victim == NULL || victim->valid) victim = t;
+        }
+    }
+    if (victim == NULL)
+    {
+        i = terrainCacheCap;
+        terrainGrowLocked(terrainCacheCap);
+        victim = terrainTiles[i];
+    }
+
+    if (victim->valid)
+    {
+        terrainUnmapTile(victim);
+        terrainResident--;
+    }
+    victim->valid = 0;
+    victim->tx = tx;
+    victim->tz = tz;
+    if (!terrainMapTile(victim))
+    {
+        if (!mapFailed) fprintf(stderr, "Khong anh xa duoc o dia hinh (%d, %d)\n", tx, tz);
+        mapFailed = 1;
+        return NULL;
+    }
+    victim->valid = 1;
+    victim->refs = 1;
+    victim->lastUse = ++terrainClock;
+    terrainResident++;
+    return victim;
+}
+
+static int compareKey(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long terrainKey(int tx, int tz)
+{
+    return ((long long)tz << 32) | (unsigned int)tx;
+}
+
+/******************************************
+ * Truoc moi buoc mo phong (luong goi): giu cac o duoi moi xe va
+ * quanh no TERRAIN_REACH, tha cac o cua buoc truoc. Trong buoc,
+ * luong mo phong chi doc tap nay, khong can khoa
+ ******************************************/
+void terrainPrepare(void)
+{
+    int need = fleet.count * 4, n = 0, m = 0, i;
+    long long *keys;
+    TerrainTile **tiles;
+
+    if (need > terrainSetCap)
+    {
+        terrainSetCap = need;
+        terrainSetKeys = (long long *)realloc(terrainSetKeys, need * sizeof(long long));
+        terrainNextKeys = (long long *)realloc(terrainNextKeys, need * sizeof(long long));
+        terrainSetTiles = (TerrainTile **)realloc(terrainSetTiles, need * sizeof(TerrainTile *));
+        terrainNextTiles = (TerrainTile **)realloc(terrainNextTiles, need * sizeof(TerrainTile *));
+    }
+    for (i = 0; i < fleet.count; i++)
+    {
+        GLfloat gx = fleet.xpos[i] - terrainOriginX, gz = fleet.zpos[i] - terrainOriginZ;
+        int tx0 = (int)floor((gx - TERRAIN_REACH) / GRID_CHUNK_SIZE);
+        int tx1 = (int)floor((gx + TERRAIN_REACH) / GRID_CHUNK_SIZE);
+        int tz0 = (int)floor((gz - TERRAIN_REACH) / GRID_CHUNK_SIZE);
+        int tz1 = (int)floor((gz + TERRAIN_REACH) / GRID_CHUNK_SIZE);
+        int tx, tz;
+
+        for (tz = tz0; tz <= tz1; tz++)
+        {
+            for (tx = tx0; tx <= tx1; tx++) terrainNextKeys[n++] = terrainKey(tx, tz);
+        }
+    }
+    std::sort(terrainNextKeys, terrainNextKeys + n);
+
+    // Giu tap moi truoc khi tha tap cu de o con dung khong bi bo
+    terrainLockEnter();
+    for (i = 0; i < n; i++)
+    {
+        if (m > 0 && terrainNextKeys[m - 1] == terrainNextKeys[i]) continue;
+        terrainNextKeys[m] = terrainNextKeys[i];
+        terrainNextTiles[m] = terrainAcquireLocked((int)(unsigned int)terrainNextKeys[i],
+                                                   (int)(terrainNextKeys[i] >> 32));
+        m++;
+    }
+    for (i = 0; i < terrainSetCount; i++)
+    {
+        if (terrainSetTiles[i]) terrainSetTiles[i]->refs--;
+    }
+    terrainLockLeave();
+
+    keys = terrainSetKeys;
+    terrainSetKeys = terrainNextKeys;
+    terrainNextKeys = keys;
+    tiles = terrainSetTiles;
+    terrainSetTiles = terrainNextTiles;
+    terrainNextTiles = tiles;
+    terrainSetCount = m;
+}
+
+/******************************************
+ * Do cao mat dat tai (x, z) so voi mat phang cu, noi suy song tuyen.
+ * Chi dung o trong tap cua buoc hien tai; o khac coi la phang
+ ******************************************/
+GLfloat terrainHeight(GLfloat x, GLfloat z)
+{
+    const int side = GRID_CHUNK_SIZE + 1;
+    GLfloat gx = x - terrainOriginX, gz = z - terrainOriginZ;
+    int tx = (int)floor(gx / GRID_CHUNK_SIZE), tz = (int)floor(gz / GRID_CHUNK_SIZE);
+    long long key = terrainKey(tx, tz);
+    const long long *found;
+    const short *h;
+    GLfloat fx, fz;
+    int i, j;
+
+    found = (const long long *)bsearch(&key, terrainSetKeys, terrainSetCount,
+                                       sizeof(long long), compareKey);
+    if (found == NULL || terrainSetTiles[found - terrainSetKeys] == NULL) return 0.0f;
+    h = terrainSetTiles[found - terrainSetKeys]->samples;
+
+    fx = gx - (GLfloat)tx * GRID_CHUNK_SIZE;
+    fz = gz - (GLfloat)tz * GRID_CHUNK_SIZE;
+    i = (int)fx;
+    j = (int)fz;
+    if (i > GRID_CHUNK_SIZE - 1) i = GRID_CHUNK_SIZE - 1;
+    if (j > GRID_CHUNK_SIZE - 1) j = GRID_CHUNK_SIZE - 1;
+    fx -= i;
+    fz -= j;
+    h += j * side + i;
+    return terrainScale * ((h[0] * (1.0f - fx) + h[1] * fx) * (1.0f - fz) +
+                           (h[side] * (1.0f - fx) + h[side + 1] * fx) * fz);
+}
+
+/******************************************
+ * Diem tiep dat hai banh cua cac xe [begin, end): xe dat theo
+ * banh sau, nghieng quanh truc banh sau cho banh truoc cham dat
+ ******************************************/
+void terrainContact(Fleet *f, int begin, int end)
+{
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        GLfloat a = radians(f->direction[i]);
+        GLfloat c = cos(a), s = sin(a);
+        GLfloat rear = terrainHeight(f->xpos[i] + c * REAR_WHEEL_X, f->zpos[i] - s * REAR_WHEEL_X);
+        GLfloat front = terrainHeight(f->xpos[i] + c * FRONT_WHEEL_X, f->zpos[i] - s * FRONT_WHEEL_X);
+
+        f->groundY[i] = rear;
+        f->pitch[i] = degrees(atan2(front - rear, FRONT_WHEEL_X - REAR_WHEEL_X));
+    }
+}
+
+/******************************************
+ * Luong dung luoi: lay khoi tu hang doi, doc o dia hinh qua bo
+ * nho dem, dung luoi vao 'build'. Luong ve chi con dua len GPU.
+ * 0 neu khoi nam trong ban do ma khong lay duoc o (dung lai sau)
+ ******************************************/
+static int terrainBuildChunk(GridChunk *c)
+{
+    const int side = GRID_CHUNK_SIZE + 1;
+    Mesh *m = &c->build;
+    TerrainTile *tile;
+    const short *h = NULL;
+    GLfloat x0 = (GLfloat)c->cx * GRID_CHUNK_SIZE, z0 = (GLfloat)c->cz * GRID_CHUNK_SIZE;
+    int tx = c->cx - terrainOriginX / GRID_CHUNK_SIZE, tz = c->cz - terrainOriginZ / GRID_CHUNK_SIZE;
+    int i, k;
+
+    terrainLockEnter();
+    tile = terrainAcquireLocked(tx, tz);
+    terrainLockLeave();
+    if (tile) h = tile->samples;
+    else if (tx >= 0 && tz >= 0 && tx < terrainTilesX && tz < terrainTilesZ) return 0;
+
+    // Nhu luoi phang: moi khoi ve canh duoi va canh trai, nhung di theo mat dat
+    meshReset(m);
+    for (i = 0; i < GRID_CHUNK_SIZE; i++)
+    {
+        GLuint prevX = 0, prevZ = 0;
+
+        for (k = 0; k <= GRID_CHUNK_SIZE; k++)
+        {
+            // (k, i): doc theo X; (i, k): doc theo Z
+            GLfloat hx = h ? terrainScale * h[i * side + k] : 0.0f;
+            GLfloat hz = h ? terrainScale * h[k * side + i] : 0.0f;
+            GLfloat sx = 0.0f, sz = 0.0f;
+            GLuint a, b;
+
+            if (h)
+            {
+                // Phap tuyen theo sai phan: (-dh/dx, 1, -dh/dz)
+                int kk = k < GRID_CHUNK_SIZE ? k : k - 1;
+                sx = terrainScale * (h[i * side + kk + 1] - h[i * side + kk]);
+                sz = terrainScale * (h[(kk + 1) * side + i] - h[kk * side + i]);
+            }
+            a = meshVertex(m, x0 + k, -RADIUS_WHEEL + hx, z0 + i, -sx, 1.0f, 0.0f);
+            b = meshVertex(m, x0 + i, -RADIUS_WHEEL + hz, z0 + k, 0.0f, 1.0f, -sz);
+            if (k > 0)
+            {
+                meshLine(m, prevX, a);
+                meshLine(m, prevZ, b);
+            }
+            prevX = a;
+            prevZ = b;
+        }
+    }
+
+    if (tile)
+    {
+        terrainLockEnter();
+        tile->refs--;
+        terrainLockLeave();
+    }
+    return 1;
+}
+
+static void mesherLoop(void)
+{
+    for (;;)
+    {
+        GridChunk *c;
+
+        terrainLockEnter();
+        while (meshQueueCount == 0)
+        {
+#ifdef _WIN32
+            SleepConditionVariableCS(&mesherWake, &terrainLock, INFINITE);
+#else
+            pthread_cond_wait(&mesherWake, &terrainLock);
+#endif
+        }
+        c = meshQueue[meshQueueHead];
+        meshQueueHead = (meshQueueHead + 1) % (GRID_CACHE_DIM * GRID_CACHE_DIM);
+        meshQueueCount--;
+        terrainLockLeave();
+
+        if (terrainBuildChunk(c))
+        {
+            c->state.store(CHUNK_READY);
+        }
+        else
+        {
+            // Khong danh dau da co luoi: luong ve xep hang lai o khung sau
+            c->state.store(CHUNK_RETRY);
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI mesherThreadMain(LPVOID arg)
+{
+    mesherLoop();
+    return 0;
+}
+#else
+static void *mesherThreadMain(void *arg)
+{
+    mesherLoop();
+    return NULL;
+}
+#endif
+
+/******************************************
+ * Khoi dia hinh (luong ve): dua len GPU neu luong dung luoi da
+ * xong, xep hang neu o vua doi khoi. NULL khi chua co luoi de ve
+ ******************************************/
+static GridChunk *terrainChunk(GridChunk *c, int cx, int cz)
+{
+    int state = c->state.load();
+
+    if (c->valid && c->cx == cx && c->cz == cz && state != CHUNK_RETRY)
+    {
+        if (state == CHUNK_READY)
+        {
+            Mesh built = c->build;
+
+            // Doi mang dinh giua 'build' va 'mesh', giu bo dem GPU cua 'mesh'
+            c->build.vertices = c->mesh.vertices;
+            c->build.indices = c->mesh.indices;
+            c->build.capVertices = c->mesh.capVertices;
+            c->build.capIndices = c->mesh.capIndices;
+            c->mesh.vertices = built.vertices;
+            c->mesh.indices = built.indices;
+            c->mesh.capVertices = built.capVertices;
+            c->mesh.capIndices = built.capIndices;
+            c->mesh.numVertices = built.numVertices;
+            c->mesh.numIndices = built.numIndices;
+            c->mesh.numLines = built.numLines;
+            meshUpload(&c->mesh);
+            c->state.store(CHUNK_IDLE);
+            c->meshed = 1;
+        }
+        return c->meshed ? c : NULL;
+    }
+    // Luong dung luoi dang lam o nay cho khoi cu: doi khung sau
+    if (state == CHUNK_QUEUED) return NULL;
+
+    if (!mesherStarted)
+    {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, mesherThreadMain, NULL, 0, NULL);
+        if (thread) CloseHandle(thread);
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, mesherThreadMain, NULL) == 0) pthread_detach(thread);
+#endif
+        mesherStarted = 1;
+    }
+    c->cx = cx;
+    c->cz = cz;
+    c->valid = GL_TRUE;
+    c->meshed = 0;
+    c->state.store(CHUNK_QUEUED);
+
+    terrainLockEnter();
+    meshQueue[(meshQueueHead + meshQueueCount) % (GRID_CACHE_DIM * GRID_CACHE_DIM)] = c;
+    meshQueueCount++;
+#ifdef _WIN32
+    WakeConditionVariable(&mesherWake);
+#else
+    pthread_cond_signal(&mesherWake);
+#endif
+    terrainLockLeave();
+    return NULL;
+}
+
+/******************************************
+ * Do cao mau cho --terrain-gen: doi thoai va gon song, bang 0 o goc
+ ******************************************/
+static GLfloat terrainGenHeight(GLfloat x, GLfloat z)
+{
+    return 1.2f * sin(x * 0.05f) * cos(z * 0.043f) +
+           0.6f * sin((x + z) * 0.11f) +
+           0.25f * sin(x * 0.31f - z * 0.27f);
+}
+
+static void terrainWriteHeader(FILE *f, int tiles, int origin, GLfloat scale,
+                               GLfloat mn, GLfloat mx)
+{
+    unsigned int bits;
+    int i;
+
+    fwrite(TERRAIN_MAGIC, 1, 4, f);
+    logPut32(f, TERRAIN_VERSION);
+    logPut32(f, tiles);
+    logPut32(f, tiles);
+    logPut32(f, GRID_CHUNK_SIZE);
+    logPut32(f, (unsigned int)origin);
+    logPut32(f, (unsigned int)origin);
+    memcpy(&bits, &scale, sizeof(bits));
+    logPut32(f, bits);
+    memcpy(&bits, &mn, sizeof(bits));
+    logPut32(f, bits);
+    memcpy(&bits, &mx, sizeof(bits));
+    logPut32(f, bits);
+    for (i = 40; i < TERRAIN_HEADER; i += 4) logPut32(f, 0);
+}
+
+/******************************************
+ * --terrain-gen FILE: ghi ban do terrainGenTiles x terrainGenTiles o,
+ * tam o goc toa do; ghi tung o nen bo nho khong doi theo kich thuoc
+ ******************************************/
+int runTerrainGen(void)
+{
+    const int side = GRID_CHUNK_SIZE + 1;
+    const GLfloat scale = 0.001f;
+    int tiles = terrainGenTiles;
+    int origin = -(tiles / 2) * GRID_CHUNK_SIZE;
+    short *buf = (short *)malloc(side * side * sizeof(short));
+    FILE *f;
+    GLfloat mn = 0.0f, mx = 0.0f;
+    int tx, tz, i, j;
+    long long bytes;
+
+    if (tiles < 1 || buf == NULL) return 1;
+    f = fopen(terrainGenPath, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Khong mo duoc %s\n", terrainGenPath);
+        return 1;
+    }
+    terrainWriteHeader(f, tiles, origin, scale, 0.0f, 0.0f);
+    for (tz = 0; tz < tiles; tz++)
+    {
+        for (tx = 0; tx < tiles; tx++)
+        {
+            for (j = 0; j < side; j++)
+            {
+                for (i = 0; i < side; i++)
+                {
+                    GLfloat h = terrainGenHeight((GLfloat)(origin + tx * GRID_CHUNK_SIZE + i),
+                                                 (GLfloat)(origin + tz * GRID_CHUNK_SIZE + j));
+                    long q = lround(h / scale);
+                    if (q > 32767) q = 32767;
+                    if (q < -32768) q = -32768;
+                    if (q * scale < mn) mn = q * scale;
+                    if (q * scale > mx) mx = q * scale;
+                    // int16 little-endian
+                    ((unsigned char *)&buf[j * side + i])[0] = (unsigned char)(q & 0xff);
+                    ((unsigned char *)&buf[j * side + i])[1] = (unsigned char)((q >> 8) & 0xff);
+                }
+            }
+            fwrite(buf, sizeof(short), side * side, f);
+        }
+    }
+    bytes = TERRAIN_HEADER + (long long)tiles * tiles * side * side * sizeof(short);
+    fseek(f, 0, SEEK_SET);
+    terrainWriteHeader(f, tiles, origin, scale, mn, mx);
+    fclose(f);
+    free(buf);
+    printf("Da tao %s: %d x %d o (%d x %d don vi), %lld byte, cao %.2f..%.2f\n",
+           terrainGenPath, tiles, tiles, tiles * GRID_CHUNK_SIZE, tiles * GRID_CHUNK_SIZE,
+           bytes, mn, mx);
+    return 0;
+}
+
+/******************************************
+ * Cap truoc ban client cho moi o luoi phang (kich thuoc co dinh)
+ * va giu lai sau khi nap: doi khoi khong cap phat lai
+ ******************************************/
+void initGrid(void)
+{
+    const int count = 4 * GRID_CHUNK_SIZE;
+    int i;
+
+    for (i = 0; i < GRID_CACHE_DIM * GRID_CACHE_DIM; i++)
+    {
+        Mesh *m = &gridCache[i / GRID_CACHE_DIM][i % GRID_CACHE_DIM].mesh;
+
+        m->keepClient = GL_TRUE;
+        gridCache[i / GRID_CACHE_DIM][i % GRID_CACHE_DIM].build.keepClient = GL_TRUE;
+        if (terrainLoaded) continue;   // Luong dung luoi tu cap
+        m->capVertices = m->capIndices = count;
+        m->vertices = (MeshVertex *)malloc(count * sizeof(MeshVertex));
+        m->indices = (GLuint *)malloc(count * sizeof(GLuint));
+    }
+}
+
+/******************************************
+ * Lay khoi luoi dat (cx, cz), tao lai neu o da chua khoi khac
+ ******************************************/
+GridChunk *gridChunk(int cx, int cz)
+{
+    int sx = ((cx % GRID_CACHE_DIM) + GRID_CACHE_DIM) % GRID_CACHE_DIM;
+    int sz = ((cz % GRID_CACHE_DIM) + GRID_CACHE_DIM) % GRID_CACHE_DIM;
+    GridChunk *c = &gridCache[sz][sx];
+    Mesh *m = &c->mesh;
+    GLfloat x0, z0;
+    int i;
+
+    if (terrainLoaded) return terrainChunk(c, cx, cz);
+    if (c->valid && c->cx == cx && c->cz == cz) return c;
+
+    c->cx = cx;
+    c->cz = cz;
+    c->valid = GL_TRUE;
+    x0 = (GLfloat)cx * GRID_CHUNK_SIZE;
+    z0 = (GLfloat)cz * GRID_CHUNK_SIZE;
+
+    // Moi khoi chi ve canh duoi va canh trai; canh con lai thuoc khoi ke ben
+    meshReset(m);
+    for (i = 0; i < GRID_CHUNK_SIZE; i++)
+    {
+        GLuint a = meshVertex(m, x0, -RADIUS_WHEEL, z0 + i, 0.0f, 1.0f, 0.0f);
+        GLuint b = meshVertex(m, x0 + GRID_CHUNK_SIZE, -RADIUS_WHEEL, z0 + i,
+                              0.0f, 1.0f, 0.0f);
+        meshLine(m, a, b);
+        a = meshVertex(m, x0 + i, -RADIUS_WHEEL, z0, 0.0f, 1.0f, 0.0f);
+        b = meshVertex(m, x0 + i, -RADIUS_WHEEL, z0 + GRID_CHUNK_SIZE,
+                       0.0f, 1.0f, 0.0f);
+        meshLine(m, a, b);
+    }
+    meshUpload(m);
+    return c;
+}
+
+/******************************************
+ * Ve luoi mat dat: chi cac khoi quanh nguoi lai,
+ * nen luoi vo han ma chi phi moi khung khong doi.
+ * Khoi dia hinh chua dung xong thi bo qua khung nay
+ ******************************************/
+void landmarks(void)
+{
+    int cx = (int)floor(pose.xpos / GRID_CHUNK_SIZE);
+    int cz = (int)floor(pose.zpos / GRID_CHUNK_SIZE);
+    int dx, dz;
+
+    glColor3f(0.0f, 1.0f, 0.0f);
+    for (dz = -GRID_VIEW_CHUNKS; dz <= GRID_VIEW_CHUNKS; dz++)
+    {
+        for (dx = -GRID_VIEW_CHUNKS; dx <= GRID_VIEW_CHUNKS; dx++)
+        {
+            GLfloat x0 = (GLfloat)(cx + dx) * GRID_CHUNK_SIZE;
+            GLfloat z0 = (GLfloat)(cz + dz) * GRID_CHUNK_SIZE;
+
+            GridChunk *chunk;
+
+            cullStats.chunks++;
+            if (useCulling)
+            {
+                // O luoi phang tai y = -RADIUS_WHEEL: hop mong quanh o;
+                // dia hinh: hop cao theo khoang do cao cua ca ban do
+                GLfloat lo = terrainLoaded ? terrainMinH : 0.0f;
+                GLfloat hi = terrainLoaded ? terrainMaxH : 0.0f;
+                GLfloat mn[3] = { x0, -RADIUS_WHEEL + lo, z0 };
+                GLfloat mx[3] = { x0 + GRID_CHUNK_SIZE, -RADIUS_WHEEL + hi,
+                                  z0 + GRID_CHUNK_SIZE };
+                if (!boxVisible(0.0f, 0.0f, 0.0f, 0.0f, mn, mx))
+                {
+                    cullStats.chunksCulled++;
+                    continue;
+                }
+            }
+            chunk = gridChunk(cx + dx, cz + dz);
+            if (chunk) drawMesh(&chunk->mesh);
+        }
+    }
+}
+
+/******************************************
+ * Trang thai cho khung nay: doan xe hai buoc, he so noi suy, camera
+ * va lan nhan phim dau tien co trong khung. Luong mo phong rieng:
+ * lay tu anh chup moi nhat, thoi gian mo phong gui kem anh chup
+ ******************************************/
+static void frameSource(const Fleet **prev, const Fleet **cur, GLfloat *t, GLfloat view[6])
+{
+    static double simMsShown = 0.0;
+    static unsigned long simStepsShown = 0;
+
+    if (simThreaded)
+    {
+        const SimSnapshot *snap = simSnapshotTake();
+        double alpha = (nowSeconds() - snap->time) / SIM_DT;
+
+        *prev = &snap->prev;
+        *cur = &snap->cur;
+        *t = (GLfloat)(alpha < 0.0 ? 0.0 : alpha > 1.0 ? 1.0 : alpha);
+        memcpy(view, snap->camera, 6 * sizeof(GLfloat));
+
+        timingCurrent.cpu[PHASE_SIM] = snap->simMs - simMsShown;
+        timingCurrent.simSteps = (int)(snap->simSteps - simStepsShown);
+        simMsShown = snap->simMs;
+        simStepsShown = snap->simSteps;
+
+        if (snap->inputTime > inputLastShown)
+        {
+            inputLastShown = inputShownTime = snap->inputTime;
+            inputShownKey = snap->inputKey;
+            inputShownTick = snap->inputTick;
+        }
+        return;
+    }
+
+    *prev = &fleetBack;
+    *cur = &fleet;
+    *t = (GLfloat)(simAccumulator / SIM_DT);
+    view[0] = camx;
+    view[1] = camy;
+    view[2] = camz;
+    view[3] = anglex;
+    view[4] = angley;
+    view[5] = anglez;
+    if (inputAppliedTime >= 0.0)
+    {
+        inputShownTime = inputAppliedTime;
+        inputShownKey = inputAppliedKey;
+        inputShownTick = inputAppliedTick;
+        inputAppliedTime = -1.0;
+    }
+}
+
+/******************************************
+ * Ham hien thi
+ ******************************************/
+void display(void)
+{
+    const Fleet *prev, *cur;
+    GLfloat t, view[6];
+    int i;
+
+    allocTracking = 1;
+    frameSource(&prev, &cur, &t, view);
+    for (i = 0; i < fleet.count; i++)
+    {
+        fleetPose(prev, cur, i, t, &poses[i]);
+    }
+    pose = poses[PLAYER];
+    redrawPending = 0;
+    chainPhase = !chainPhase;
+    sgMatrixUpdates = 0;
+    drawInstanced = instancingAvailable && fleet.count > 1;
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    gluLookAt(view[0], view[1], view[2], pose.xpos, 0.0f, pose.zpos, 0.0f, 1.0f, 0.0f);
+
+    glPushMatrix();
+    {
+        glRotatef(view[4], 1.0f, 0.0f, 0.0f);
+        glRotatef(view[3], 0.0f, 1.0f, 0.0f);
+        glRotatef(view[5], 0.0f, 0.0f, 1.0f);
+        glGetFloatv(GL_MODELVIEW_MATRIX, viewMatrix);
+        frustumExtract();
+        memset(lodCounts, 0, sizeof(lodCounts));
+        memset(&cullStats, 0, sizeof(cullStats));
+
+        timerBegin(PHASE_LANDMARKS);
+        landmarks();
+        timerEnd(PHASE_LANDMARKS);
+
+        drawBikes(PHASE_FRAME);
+        drawBikes(PHASE_CHAIN);
+        drawBikes(PHASE_PEDALS);
+        drawBikes(PHASE_PERSON);
+
+        if (drawInstanced)
+        {
+            timerBegin(PHASE_INSTANCES);
+            flushInstances();
+            timerEnd(PHASE_INSTANCES);
+        }
+    }
+    glPopMatrix();
+
+    timerBegin(PHASE_HUD);
+    drawControlsText();
+    timerEnd(PHASE_HUD);
+
+    timerBegin(PHASE_SWAP);
+    presentFrame();
+    timerEnd(PHASE_SWAP);
+
+    timingEndFrame();
+
+    // Du lieu tam cua khung nam trong frameArena: bo het mot lan
+    instanceBatchesReset();
+    frameArenaReset();
+    allocFrameEnd();
+    allocTracking = 0;
+
+    if (benchScenario && benchmarkFrameDone() && !headless)
+    {
+        benchmarkReport();
+        inputReport();
+        exit(0);
+    }
+}
+
+/******************************************
+ * Ve mot bo phan (giai doan) cho ca doan xe
+ ******************************************/
+void drawBikes(int phase)
+{
+    // Xich ve cung khung nen dung chung hop bao cua khung
+    int part = phase == PHASE_PEDALS ? PART_PEDALS :
+               phase == PHASE_PERSON ? PART_PERSON : PART_FRAME;
+    int mask = 1 << part;
+    int i;
+
+    timerBegin(phase);
+    // Luoi khop xuong gom ca ban dap: ve mot lan trong giai doan nguoi
+    if (skinningAvailable && phase == PHASE_PEDALS) mask = 0;
+    if (skinningAvailable && phase == PHASE_PERSON) mask |= 1 << PART_PEDALS;
+    for (i = 0; i < fleet.count; i++)
+    {
+        // Truoc beginBike: sgUpdateBike dung tam matStack[0]
+        if (phase == PHASE_FRAME) prepareBike(i);
+        if (!(bikeTransforms[i].visible & mask)) continue;
+        beginBike(i);
+        switch (phase)
+        {
+            case PHASE_FRAME:  drawFrame();  break;
+            case PHASE_CHAIN:  drawChain();  break;
+            case PHASE_PEDALS: drawPedals(); break;
+            case PHASE_PERSON:
+                if (skinningAvailable) drawRider();
+                else drawPerson();
+                break;
+        }
+        endBike();
+    }
+    timerEnd(phase);
+}
+
+/******************************************
+ * Dua khung hinh ra man hinh (hoac cho GPU ve xong khi chay ngam)
+ ******************************************/
+void presentFrame(void)
+{
+    if (headless)
+    {
+        glFinish();
+    }
+    else
+    {
+        glutSwapBuffers();
+    }
+    inputPresented();
+}
+
+/******************************************
+ * Ham tien ich
+ ******************************************/
+GLfloat Abs(GLfloat a)
+{
+    return (a < 0.0f) ? -a : a;
+}
+
+GLfloat degrees(GLfloat a)
+{
+    return a * 180.0f / PI;
+}
+
+GLfloat radians(GLfloat a)
+{
+    return a * PI / 180.0f;
+}
+
+/******************************************
+ * Dong ho don dieu (giay)
+ ******************************************/
+double nowSeconds(void)
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+/******************************************
+ * Giai doan co do thoi gian GPU (chi cac buoc ve)
+ ******************************************/
+int isGpuPhase(int phase)
+{
+    return phase >= PHASE_LANDMARKS && phase <= PHASE_HUD;
+}
+
+/******************************************
+ * Bat dau / ket thuc do mot giai doan; cong don neu
+ * giai doan chay nhieu lan trong mot khung (vd. sim)
+ ******************************************/
+void timerBegin(int phase)
+{
+    timingStart[phase] = nowSeconds();
+    if (gpuTimers && isGpuPhase(phase))
+    {
+        pglBeginQuery(GL_TIME_ELAPSED, gpuQueries[timingFrames % GPU_QUERY_LAG][phase]);
+    }
+}
+
+void timerEnd(int phase)
+{
+    if (gpuTimers && isGpuPhase(phase)) pglEndQuery(GL_TIME_ELAPSED);
+    timingCurrent.cpu[phase] += (nowSeconds() - timingStart[phase]) * 1000.0;
+}
+
+/******************************************
+ * Cap n byte (canh 16) tu vung nho tam cua khung; chi dung tren
+ * luong ve, con hieu luc den cuoi display()
+ ******************************************/
+void *frameAlloc(size_t bytes)
+{
+    FrameArena *a = &frameArena;
+    void **block;
+
+    bytes = (bytes + 15) & ~(size_t)15;
+    a->wanted += bytes;
+    if (a->base == NULL)
+    {
+        a->size = FRAME_ARENA_SIZE;
+        a->base = (unsigned char *)malloc(a->size);
+    }
+    if (a->base && a->used + bytes <= a->size)
+    {
+        a->last = a->base + a->used;
+        a->used += bytes;
+        return a->last;
+    }
+
+    // Day: khoi heap rieng, giai phong cuoi khung
+    block = (void **)malloc(16 + bytes);
+    if (block == NULL)
+    {
+        fprintf(stderr, "Khong du bo nho tam cho khung (%lu byte)\n", (unsigned long)bytes);
+        exit(1);
+    }
+    block[0] = a->overflow;
+    a->overflow = block;
+    a->last = NULL;
+    return (unsigned char *)block + 16;
+}
+
+/******************************************
+ * Noi rong mot lan cap: tai cho neu la lan cap cuoi cung,
+ * neu khong thi cap moi va chep (cho cu bo den cuoi khung)
+ ******************************************/
+void *frameGrow(void *p, size_t oldBytes, size_t newBytes)
+{
+    FrameArena *a = &frameArena;
+    void *q;
+
+    oldBytes = (oldBytes + 15) & ~(size_t)15;
+    newBytes = (newBytes + 15) & ~(size_t)15;
+    if (p != NULL && p == a->last && a->used - oldBytes + newBytes <= a->size)
+    {
+        a->used += newBytes - oldBytes;
+        a->wanted += newBytes - oldBytes;
+        return p;
+    }
+    q = frameAlloc(newBytes);
+    if (p != NULL) memcpy(q, p, oldBytes);
+    return q;
+}
+
+/******************************************
+ * Cuoi khung: bo tat ca; neu khung vua roi bi tran thi
+ * lon vung nho len gap doi nhu cau cho cac khung sau
+ ******************************************/
+void frameArenaReset(void)
+{
+    FrameArena *a = &frameArena;
+
+    while (a->overflow)
+    {
+        void *next = *(void **)a->overflow;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    if (a->wanted > a->size)
+    {
+        free(a->base);
+        a->size = a->wanted * 2;
+        a->base = (unsigned char *)malloc(a->size);
+    }
+    a->used = 0;
+    a->wanted = 0;
+    a->last = NULL;
+}
+
+/******************************************
+ * Dem cap phat (-DXEDAP_ALLOC_TRACK). glibc: thay malloc / calloc /
+ * realloc cua ca tien trinh, phan loai theo noi goi: chuong trinh va
+ * thu vien chay (libc, libstdc++, GLU, GLUT) la loi; driver OpenGL
+ * (vd. llvmpipe cap phat moi lenh ve) chi dem de bao. Noi khac chi
+ * dem new / new[]. Ban dich thuong khong thay gi cua bo cap phat
+ ******************************************/
+#ifdef XEDAP_ALLOC_TRACK
+#ifdef __GLIBC__
+#define MAX_APP_RANGES 32
+
+uintptr_t appRangeLo[MAX_APP_RANGES], appRangeHi[MAX_APP_RANGES];
+int appRanges = -1;             // < 0: chua quet, coi moi cap phat la cua chuong trinh
+
+static int allocScanModule(struct dl_phdr_info *info, size_t size, void *data)
+{
+    static const char *appLibs[] =
+    {
+        "libc.so", "libstdc++", "libgcc_s", "libm.so", "libGLU", "libglut"
+    };
+    const char *base = strrchr(info->dlpi_name, '/');
+    int app = info->dlpi_name[0] == '\0';     // Ten rong: chinh chuong trinh
+    int i;
+
+    base = base ? base + 1 : info->dlpi_name;
+    for (i = 0; !app && i < (int)(sizeof(appLibs) / sizeof(appLibs[0])); i++)
+    {
+        app = strncmp(base, appLibs[i], strlen(appLibs[i])) == 0;
+    }
+    for (i = 0; app && i < info->dlpi_phnum && appRanges < MAX_APP_RANGES; i++)
+    {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) continue;
+        appRangeLo[appRanges] = info->dlpi_addr + ph->p_vaddr;
+        appRangeHi[appRanges] = appRangeLo[appRanges] + ph->p_memsz;
+        appRanges++;
+    }
+    return 0;
+}
+
+/******************************************
+ * Quet ma lenh cua chuong trinh va thu vien chay; goi sau khi
+ * driver da nap (khung dau tien)
+ ******************************************/
+static void allocScanModules(void)
+{
+    appRanges = 0;
+    dl_iterate_phdr(allocScanModule, NULL);
+}
+
+static void allocCounted(void *caller)
+{
+    uintptr_t pc = (uintptr_t)caller;
+    int i;
+
+    if (!allocTracking) return;
+    for (i = 0; i < appRanges; i++)
+    {
+        if (pc >= appRangeLo[i] && pc < appRangeHi[i]) break;
+    }
+    if (appRanges < 0 || i < appRanges) allocCount++;
+    else driverAllocCount++;
+}
+
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) noexcept
+{
+    allocCounted(__builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+    allocCounted(__builtin_return_address(0));
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) noexcept
+{
+    allocCounted(__builtin_return_address(0));
+    return __libc_realloc(p, size);
+}
+}
+#endif
+
+void *operator new(size_t size)
+{
+    void *p;
+
+#ifndef __GLIBC__
+    if (allocTracking) allocCount++;
+#endif
+    p = malloc(size ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+#endif
+
+/******************************************
+ * Cuoi moi khung: lay so cap phat tu khung truoc (ca cac buoc mo
+ * phong, ca luong mo phong rieng); sau khoi dong thi bao loi,
+ * thua dan theo luy thua 2 de khong tran stderr
+ ******************************************/
+void allocFrameEnd(void)
+{
+#if defined(XEDAP_ALLOC_TRACK) && defined(__GLIBC__)
+    // Driver da nap sau khung dau tien
+    if (appRanges < 0) allocScanModules();
+#endif
+    frameAllocs = allocCount.exchange(0);
+    frameDriverAllocs = driverAllocCount.exchange(0);
+    if (timingFrames <= ALLOC_WARMUP_FRAMES) return;
+
+    driverAllocs += frameDriverAllocs;
+    if (frameAllocs == 0) return;
+    steadyAllocs += frameAllocs;
+    steadyAllocFrames++;
+    if ((steadyAllocFrames & (steadyAllocFrames - 1)) == 0)
+    {
+        fprintf(stderr, "Khung %lu: %lu lan cap phat heap sau khoi dong (%lu khung nhu vay)\n",
+                timingFrames, frameAllocs, steadyAllocFrames);
+    }
+}
+
+/******************************************
+ * Mo file CSV; ghi dong tieu de
+ ******************************************/
+void openTimingCsv(const char *path)
+{
+    int i;
+    timingCsv = fopen(path, "w");
+    if (timingCsv == NULL)
+    {
+        fprintf(stderr, "Khong mo duoc %s\n", path);
+        return;
+    }
+    fprintf(timingCsv, "frame,sim_steps");
+    for (i = 0; i < NUM_PHASES; i++) fprintf(timingCsv, ",cpu_%s", phaseNames[i]);
+    for (i = 0; i < NUM_PHASES; i++)
+    {
+        if (isGpuPhase(i)) fprintf(timingCsv, ",gpu_%s", phaseNames[i]);
+    }
+    fprintf(timingCsv, "\n");
+}
+
+/******************************************
+ * Dua mot khung da co du so lieu vao lich su va CSV
+ ******************************************/
+static void timingCommit(const FrameTiming *t)
+{
+    int slot = timingCount % TIMING_WINDOW;
+    int i;
+
+    for (i = 0; i < NUM_PHASES; i++)
+    {
+        timingHistory[0][i][slot] = t->cpu[i];
+        timingHistory[1][i][slot] = t->gpu[i];
+    }
+    timingCount++;
+
+    if (timingCsv)
+    {
+        fprintf(timingCsv, "%lu,%d", t->frame, t->simSteps);
+        for (i = 0; i < NUM_PHASES; i++)
+        {
+            if (t->cpu[i] >= 0.0) fprintf(timingCsv, ",%.4f", t->cpu[i]);
+            else fprintf(timingCsv, ",");
+        }
+        for (i = 0; i < NUM_PHASES; i++)
+        {
+            if (!isGpuPhase(i)) continue;
+            if (t->gpu[i] >= 0.0) fprintf(timingCsv, ",%.4f", t->gpu[i]);
+            else fprintf(timingCsv, ",");
+        }
+        fprintf(timingCsv, "\n");
+    }
+}
+
+/******************************************
+ * Ket thuc khung: lay ket qua GPU cua khung cu nhat,
+ * chuyen khung hien tai vao hang doi
+ ******************************************/
+void timingEndFrame(void)
+{
+    int slot = timingFrames % GPU_QUERY_LAG;
+    double now = nowSeconds();
+    int i;
+
+    // Khung dau khong co khung truoc de do khoang cach: danh dau khong do
+    timingCurrent.cpu[PHASE_TOTAL] =
+        timingLastFrameEnd >= 0.0 ? (now - timingLastFrameEnd) * 1000.0 : -1.0;
+    timingLastFrameEnd = now;
+    timingCurrent.frame = timingFrames;
+
+    if (!gpuTimers)
+    {
+        for (i = 0; i < NUM_PHASES; i++) timingCurrent.gpu[i] = -1.0;
+        timingCommit(&timingCurrent);
+    }
+    else
+    {
+        // O nay dang giu khung cach day GPU_QUERY_LAG khung: doc roi ghi de
+        if (timingFrames >= GPU_QUERY_LAG)
+        {
+            FrameTiming *old = &timingPending[slot];
+            for (i = 0; i < NUM_PHASES; i++)
+            {
+                GLuint64 ns;
+                old->gpu[i] = -1.0;
+                if (!isGpuPhase(i)) continue;
+                pglGetQueryObjectui64v(gpuQueries[slot][i], GL_QUERY_RESULT, &ns);
+                old->gpu[i] = ns / 1.0e6;
+            }
+            timingCommit(old);
+        }
+        timingPending[slot] = timingCurrent;
+    }
+
+    timingFrames++;
+    memset(&timingCurrent, 0, sizeof(timingCurrent));
+}
+
+/******************************************
+ * min / trung binh / p99 tren TIMING_WINDOW khung gan nhat,
+ * bo cac gia tri khong do (< 0)
+ ******************************************/
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void timingStats(int gpu, int phase, double *mn, double *avg, double *p99)
+{
+    int count = timingCount < TIMING_WINDOW ? timingCount : TIMING_WINDOW;
+    double *sorted, sum = 0.0;
+    int i, n = 0;
+
+    *mn = *avg = *p99 = 0.0;
+    if (count == 0) return;
+    sorted = (double *)frameAlloc(count * sizeof(double));
+    for (i = 0; i < count; i++)
+    {
+        double v = timingHistory[gpu][phase][i];
+        if (v < 0.0) continue;
+        sorted[n++] = v;
+        sum += v;
+    }
+    if (n == 0) return;
+    // std::sort khong cap phat (qsort cua glibc co the malloc bo dem phu)
+    std::sort(sorted, sorted + n);
+    *mn = sorted[0];
+    *avg = sum / n;
+    *p99 = sorted[(n * 99 - 1) / 100];
+}
+
+/******************************************
+ * Danh sach kich ban do hieu nang
+ ******************************************/
+const char *benchScenarios[] =
+{
+    "idle",         // Xe dung yen, camera mac dinh
+    "fullspeed",    // Toc do toi da, danh lai qua lai, wheelie dinh ky
+    "camera-near",  // Nhu fullspeed, camera sat xe
+    "camera-far",   // Nhu fullspeed, camera gan mat phang xa
+    "orbit",        // Nhu fullspeed, xoay canh lien tuc qua anglex/y/z
+    "crowd"         // Nhu fullspeed, doan 500 xe (neu khong chi dinh --bikes)
+};
+
+int benchmarkValid(const char *name)
+{
+    int i;
+    for (i = 0; i < (int)(sizeof(benchScenarios) / sizeof(benchScenarios[0])); i++)
+    {
+        if (strcmp(name, benchScenarios[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/******************************************
+ * Dat trang thai canh cho khung thu 'frame' cua kich ban.
+ * Goi truoc moi buoc mo phong, thay cho ban phim va chuot
+ ******************************************/
+void benchmarkTick(int frame)
+{
+    GLfloat t = (GLfloat)frame / SIM_RATE;
+    GLfloat dist = 0.0f;
+
+    if (strcmp(benchScenario, "idle") == 0) return;
+
+    // Nhap gia lap 4 lan/giay de do tre nhap -> hien khi may dang tai nang
+    if (frame % (SIM_RATE / 4) == 0) inputStamp('a');
+
+    // Lo trinh chung: chay toc do toi da, lai hinh sin, wheelie 1 s moi 4 s
+    fleet.speed[PLAYER] = MAX_SPEED;
+    fleet.steering[PLAYER] = 0.5f * HANDLE_LIMIT * sin(2.0 * PI * t / 6.0);
+    if (frame % (4 * SIM_RATE) < SIM_RATE)
+    {
+        wheelieActive = 1;
+        fleet.wheelieAngle[PLAYER] = WHEELIE_ANGLE;
+    }
+    else
+    {
+        wheelieActive = 0;
+        fleet.wheelieAngle[PLAYER] = 0.0f;
+    }
+
+    if (strcmp(benchScenario, "camera-near") == 0) dist = 1.5f;
+    else if (strcmp(benchScenario, "camera-far") == 0) dist = 90.0f;
+    else if (strcmp(benchScenario, "orbit") == 0)
+    {
+        anglex = fmod(t * 45.0f, 360.0f);
+        angley = fmod(t * 20.0f, 360.0f);
+        anglez = fmod(t * 10.0f, 360.0f);
+    }
+
+    // Camera di theo xe o khoang cach co dinh
+    if (dist > 0.0f)
+    {
+        camx = fleet.xpos[PLAYER] - dist * cos(radians(fleet.direction[PLAYER]));
+        camy = 0.4f * dist;
+        camz = fleet.zpos[PLAYER] + dist * sin(radians(fleet.direction[PLAYER]));
+    }
+}
+
+/******************************************
+ * Ghi thoi gian khung vua xong; tra ve 1 khi du so khung
+ ******************************************/
+int benchmarkFrameDone(void)
+{
+    double now = nowSeconds();
+
+    if (benchTimes == NULL)
+    {
+        benchTimes = (double *)malloc(runFrames * sizeof(double));
+        if (benchTimes == NULL) return 1;
+    }
+    if (benchFrame < runFrames)
+    {
+        // Khung dau tien chua co moc truoc: tinh tu luc bat dau ve
+        benchTimes[benchFrame] = benchLastEnd < 0.0 ? 0.0 : (now - benchLastEnd) * 1000.0;
+    }
+    benchLastEnd = now;
+    benchFrame++;
+    return benchFrame >= runFrames;
+}
+
+/******************************************
+ * Chep chuoi vao dst (size byte) o dang chuoi JSON: thoat ", \ va
+ * ky tu dieu khien; cat bot neu khong du cho
+ ******************************************/
+static void jsonEscape(char *dst, size_t size, const char *src)
+{
+    size_t n = 0;
+
+    for (; src && *src; src++)
+    {
+        unsigned char c = (unsigned char)*src;
+        char esc[8];
+        size_t len;
+
+        if (c == '"' || c == '\\') sprintf(esc, "\\%c", c);
+        else if (c < 0x20) sprintf(esc, "\\u%04x", c);
+        else sprintf(esc, "%c", c);
+        len = strlen(esc);
+        if (n + len >= size) break;
+        memcpy(dst + n, esc, len);
+        n += len;
+    }
+    dst[n] = '\0';
+}
+
+/******************************************
+ * In ket qua: FPS trung binh, p50/p95/p99 thoi gian khung.
+ * Mot dong JSON tren stdout (va them vao --bench-out neu co)
+ ******************************************/
+void benchmarkReport(void)
+{
+    int n = benchFrame < runFrames ? benchFrame : runFrames;
+    int first = n > BENCH_WARMUP ? BENCH_WARMUP : 0;
+    int count = n - first;
+    double sum = 0.0, p50, p95, p99, mx;
+    double in50, in95, in99, inMax;
+    double *sorted;
+    char json[1024], renderer[256];
+    int i;
+
+    if (count <= 0 || benchTimes == NULL) return;
+    sorted = (double *)malloc(count * sizeof(double));
+    if (sorted == NULL) return;
+    for (i = 0; i < count; i++)
+    {
+        sorted[i] = benchTimes[first + i];
+        sum += sorted[i];
+    }
+    qsort(sorted, count, sizeof(double), compareDouble);
+    p50 = sorted[(count * 50 - 1) / 100];
+    p95 = sorted[(count * 95 - 1) / 100];
+    p99 = sorted[(count * 99 - 1) / 100];
+    mx = sorted[count - 1];
+    free(sorted);
+    inputStats(&in50, &in95, &in99, &inMax);
+    // Ten driver co the chua " hay \: thoat de dong JSON con hop le
+    jsonEscape(renderer, sizeof(renderer), (const char *)glGetString(GL_RENDERER));
+
+    snprintf(json, sizeof(json), "{\"scenario\":\"%s\",\"frames\":%d,\"headless\":%d,"
+            "\"bikes\":%d,\"instancing\":%d,\"skinning\":%d,\"lod\":[%d,%d,%d],"
+            "\"culled_bikes\":%d,\"culled_parts\":%d,\"culled_chunks\":%d,"
+            "\"mean_fps\":%.2f,\"mean_ms\":%.4f,\"p50_ms\":%.4f,"
+            "\"p95_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f,"
+            "\"inputs\":%d,\"input_p50_ms\":%.4f,\"input_p95_ms\":%.4f,"
+            "\"input_p99_ms\":%.4f,\"input_max_ms\":%.4f,"
+            "\"renderer\":\"%s\"}",
+            benchScenario, count, headless, fleet.count, drawInstanced, skinningAvailable,
+            lodCounts[0], lodCounts[1], lodCounts[2],
+            cullStats.bikesCulled, cullStats.partsCulled, cullStats.chunksCulled,
+            sum > 0.0 ? count * 1000.0 / sum : 0.0, sum / count,
+            p50, p95, p99, mx, inputLatencyCount, in50, in95, in99, inMax, renderer);
+    printf("%s\n", json);
+
+    if (benchOutPath)
+    {
+        FILE *f = fopen(benchOutPath, "a");
+        if (f)
+        {
+            fprintf(f, "%s\n", json);
+            fclose(f);
+        }
+        else
+        {
+            fprintf(stderr, "Khong mo duoc %s\n", benchOutPath);
+        }
+    }
+}
+
+/******************************************
+ * Cap phat mang trang thai cho 'count' xe
+ ******************************************/
+void fleetAlloc(Fleet *f, int count)
+{
+    if (count < 1) count = 1;
+    f->count = count;
+    f->xpos = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->zpos = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->direction = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->speed = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->steering = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->pedalAngle = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->wheelieAngle = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->autoMove = (int *)calloc(count, sizeof(int));
+    f->groundY = (GLfloat *)calloc(count, sizeof(GLfloat));
+    f->pitch = (GLfloat *)calloc(count, sizeof(GLfloat));
+    if (!f->xpos || !f->zpos || !f->direction || !f->speed || !f->steering ||
+        !f->pedalAngle || !f->wheelieAngle || !f->autoMove || !f->groundY || !f->pitch)
+    {
+        fprintf(stderr, "Khong du bo nho cho %d xe\n", count);
+        exit(1);
+    }
+}
+
+void fleetFree(Fleet *f)
+{
+    free(f->xpos);
+    free(f->zpos);
+    free(f->direction);
+    free(f->speed);
+    free(f->steering);
+    free(f->pedalAngle);
+    free(f->wheelieAngle);
+    free(f->autoMove);
+    free(f->groundY);
+    free(f->pitch);
+    memset(f, 0, sizeof(*f));
+}
+
+/******************************************
+ * Cap phat doan xe gom 'count' xe va tu the ve cua chung
+ ******************************************/
+void fleetInit(int count)
+{
+    fleetAlloc(&fleet, count);
+    fleetAlloc(&fleetBack, count);
+    poses = (BikePose *)calloc(fleet.count, sizeof(BikePose));
+    if (!poses)
+    {
+        fprintf(stderr, "Khong du bo nho cho %d xe\n", fleet.count);
+        exit(1);
+    }
+}
+
+/******************************************
+ * Dat trang thai truoc bang trang thai hien tai (khi dat lai)
+ ******************************************/
+void fleetSavePrevious(void)
+{
+    fleetCopyRange(&fleetBack, &fleet, 0, fleet.count);
+}
+
+/******************************************
+ * Tu the ve cua xe i: noi suy vi tri, huong, ban dap
+ * giua hai buoc mo phong prev -> cur, t trong [0, 1]
+ ******************************************/
+void fleetPose(const Fleet *prev, const Fleet *cur, int i, GLfloat t, BikePose *out)
+{
+    out->xpos = prev->xpos[i] + (cur->xpos[i] - prev->xpos[i]) * t;
+    out->zpos = prev->zpos[i] + (cur->zpos[i] - prev->zpos[i]) * t;
+    out->direction = lerpAngle(prev->direction[i], cur->direction[i], t);
+    out->pedalAngle = lerpAngle(prev->pedalAngle[i], cur->pedalAngle[i], t);
+    out->steering = cur->steering[i];
+    out->wheelieAngle = cur->wheelieAngle[i];
+    out->speed = cur->speed[i];
+    out->groundY = prev->groundY[i] + (cur->groundY[i] - prev->groundY[i]) * t;
+    out->pitch = prev->pitch[i] + (cur->pitch[i] - prev->pitch[i]) * t;
+}
+
+/******************************************
+ * Noi suy goc (do) theo duong ngan nhat
+ ******************************************/
+GLfloat lerpAngle(GLfloat a, GLfloat b, GLfloat t)
+{
+    GLfloat d = b - a;
+    if (d > 180.0f) d -= 360.0f;
+    else if (d < -180.0f) d += 360.0f;
+    return a + d * t;
+}
+
+/******************************************
+ * Mot buoc mo phong co dinh SIM_DT
+ ******************************************/
+void stepSimulation(void)
+{
+    double start, ms;
+
+    // Phat lai: dua su kien cua buoc nay vao truoc; het file thi dung
+    if (replayLog && !replayStep()) return;
+    // Luong rieng: su kien nhan tu luong GLUT tu buoc truoc
+    if (simThreaded) inputQueueDrain();
+
+    allocTracking = 1;
+    start = nowSeconds();
+    applyInput();
+    updateScene();
+    simTicks++;
+    if (traceFile) traceTick();
+    ms = (nowSeconds() - start) * 1000.0;
+    allocTracking = 0;
+
+    // Bang thoi gian thuoc luong ve: luong rieng gui qua anh chup
+    if (simThreaded)
+    {
+        simWorkMs += ms;
+        simWorkSteps++;
+    }
+    else
+    {
+        timingCurrent.cpu[PHASE_SIM] += ms;
+        timingCurrent.simSteps++;
+    }
+}
+
+/******************************************
+ * Ham idle: chay mo phong theo buoc co dinh SIM_DT,
+ * phan thoi gian du duoc giu lai cho khung sau
+ ******************************************/
+static int advanceSimulation(void)
+{
+    double now = nowSeconds();
+    int steps = 0;
+
+    if (simLastTime < 0.0) simLastTime = now;
+    simAccumulator += now - simLastTime;
+    simLastTime = now;
+
+    while (simAccumulator >= SIM_DT && steps < MAX_SIM_STEPS)
+    {
+        stepSimulation();
+        simAccumulator -= SIM_DT;
+        steps++;
+    }
+    // May qua cham: bo phan thoi gian khong kip mo phong thay vi don lai
+    if (steps == MAX_SIM_STEPS && simAccumulator >= SIM_DT)
+    {
+        simAccumulator = 0.0;
+    }
+    return steps;
+}
+
+void idle(void)
+{
+    // Do hieu nang: dung mot buoc moi khung de canh giong nhau tren moi may
+    if (benchScenario)
+    {
+        benchmarkTick(benchFrame);
+        stepSimulation();
+        glutPostRedisplay();
+        return;
+    }
+
+    if (!simThreaded) advanceSimulation();
+    glutPostRedisplay();
+}
+
+/******************************************
+ * Buoc mo phong cuoi co lam doi trang thai doan xe khong
+ * (so bo dem truoc va sau)
+ ******************************************/
+static int fleetChanged(void)
+{
+    size_t bytes = fleet.count * sizeof(GLfloat);
+
+    return memcmp(fleet.xpos, fleetBack.xpos, bytes) != 0 ||
+           memcmp(fleet.zpos, fleetBack.zpos, bytes) != 0 ||
+           memcmp(fleet.direction, fleetBack.direction, bytes) != 0 ||
+           memcmp(fleet.speed, fleetBack.speed, bytes) != 0 ||
+           memcmp(fleet.steering, fleetBack.steering, bytes) != 0 ||
+           memcmp(fleet.pedalAngle, fleetBack.pedalAngle, bytes) != 0 ||
+           memcmp(fleet.wheelieAngle, fleetBack.wheelieAngle, bytes) != 0;
+}
+
+/******************************************
+ * Hen frameTick() vao nhip ke tiep cua fpsCap
+ ******************************************/
+static void scheduleTick(void)
+{
+    double now = nowSeconds();
+    int delay;
+
+    // Sau khi ngu hoac khi ve khong kip: bat dau nhip moi tu bay gio
+    if (nextFrameTime < now) nextFrameTime = now;
+    delay = (int)((nextFrameTime - now) * 1000.0 + 0.5);
+    if (fpsCap > 0) nextFrameTime += 1.0 / fpsCap;
+    else if (simThreaded) nextFrameTime += 0.001;   // Khong gioi han: hoi anh chup moi ms
+    tickScheduled = 1;
+    glutTimerFunc(delay, frameTick, 0);
+}
+
+/******************************************
+ * Nhip cua che do ve theo yeu cau: chay mo phong theo thoi gian
+ * thuc, ve neu co thay doi, va ngu khi moi thu dung yen
+ ******************************************/
+void frameTick(int value)
+{
+    int steps;
+
+    tickScheduled = 0;
+    if (simThreaded)
+    {
+        // Mo phong o luong rieng: chi hoi anh chup moi. Luong do da ngu
+        // (doc truoc co anh chup) va khong con anh moi thi ngung nhip;
+        // su kien GLUT tiep theo hen lai qua tickWake()
+        int asleep = simAsleep.load();
+        if (simSnapshotFresh()) redrawPending = 1;
+        if (redrawPending) glutPostRedisplay();
+        if (!asleep || redrawPending) scheduleTick();
+        return;
+    }
+    steps = advanceSimulation();
+    if (steps > 0) simActive = fleetChanged() || inputActive();
+    if (simActive) redrawPending = 1;
+    if (redrawPending) glutPostRedisplay();
+    if (simActive || redrawPending) scheduleTick();
+}
+
+/******************************************
+ * Danh dau can ve lai (camera, phim, cua so); danh thuc vong
+ * frameTick neu dang ngu. Nhieu su kien trong mot nhip chi
+ * gay ra mot lan ve
+ ******************************************/
+void requestRedraw(void)
+{
+    if (!windowed) return;      // Chay ngam / phat lai nhanh: khong co vong GLUT
+    if (simThreaded) return;    // Goi tu luong mo phong: anh chup moi se duoc ve
+    if (!onDemand)
+    {
+        glutPostRedisplay();
+        return;
+    }
+    redrawPending = 1;
+    // Trang thai co the vua bi doi tu ban phim: de nhip sau tu kiem tra
+    simActive = 1;
+    if (!tickScheduled)
+    {
+        // Dang ngu: khong tinh khoang thoi gian ngu vao mo phong
+        simLastTime = nowSeconds();
+        scheduleTick();
+    }
+}
+
+/******************************************
+ * Khoa hang doi su kien giua luong GLUT va luong mo phong
+ ******************************************/
+static void simLockEnter(void)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&simLock);
+#else
+    pthread_mutex_lock(&simLock);
+#endif
+}
+
+static void simLockLeave(void)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&simLock);
+#else
+    pthread_mutex_unlock(&simLock);
+#endif
+}
+
+static void simSignal(void)
+{
+#ifdef _WIN32
+    WakeConditionVariable(&simWake);
+#else
+    pthread_cond_signal(&simWake);
+#endif
+}
+
+/******************************************
+ * Cho (giu khoa) den khi co su kien hoac het 'seconds' giay;
+ * seconds < 0: cho mai
+ ******************************************/
+static void simWaitLocked(double seconds)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&simWake, &simLock,
+                             seconds < 0.0 ? INFINITE : (DWORD)ceil(seconds * 1000.0));
+#else
+    if (seconds < 0.0)
+    {
+        pthread_cond_wait(&simWake, &simLock);
+    }
+    else
+    {
+        struct timespec until;
+        long long ns;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        ns = until.tv_nsec + (long long)(seconds * 1.0e9);
+        until.tv_sec += (time_t)(ns / 1000000000LL);
+        until.tv_nsec = (long)(ns % 1000000000LL);
+        pthread_cond_timedwait(&simWake, &simLock, &until);
+    }
+#endif
+}
+
+/******************************************
+ * Dua mot su kien da ghi / da nhan vao cac ham xu ly nhu luc choi
+ ******************************************/
+void dispatchEvent(const InputEvent *ev)
+{
+    switch (ev->type)
+    {
+        case EV_KEY_DOWN:
+            keyboard(ev->a, ev->x, ev->y);
+            break;
+        case EV_KEY_UP:
+            keyboardUp(ev->a, ev->x, ev->y);
+            break;
+        case EV_SPECIAL:
+            special(ev->a, ev->x, ev->y);
+            break;
+        case EV_MOUSE:
+            mouse(ev->a, ev->b, ev->x, ev->y);
+            break;
+        case EV_MOTION:
+            motion(ev->x, ev->y);
+            break;
+    }
+}
+
+/******************************************
+ * Luong GLUT: hen lai frameTick neu da ngung vi luong mo phong ngu
+ ******************************************/
+static void tickWake(void)
+{
+    if (onDemand && !tickScheduled) scheduleTick();
+}
+
+/******************************************
+ * Luong GLUT: xep su kien cho luong mo phong, danh thuc no neu dang ngu.
+ * Hang doi day (luong mo phong treo) thi bo su kien
+ ******************************************/
+static void postEvent(int type, int a, int b, int x, int y)
+{
+    InputEvent *ev;
+
+    simLockEnter();
+    if (inputQueueCount == INPUT_QUEUE_SIZE)
+    {
+        inputQueueDropped++;
+        simLockLeave();
+        return;
+    }
+    ev = &inputQueue[(inputQueueHead + inputQueueCount) % INPUT_QUEUE_SIZE];
+    ev->tick = 0;
+    ev->type = type;
+    ev->a = a;
+    ev->b = b;
+    ev->x = x;
+    ev->y = y;
+    ev->time = nowSeconds();
+    inputQueueCount++;
+    simAsleep.store(0);
+    simSignal();
+    simLockLeave();
+    tickWake();
+}
+
+void postKeyboard(unsigned char key, int x, int y)
+{
+    switch (key)
+    {
+        // Thoat va bang thoi gian thuoc luong ve: xu ly ngay
+        case 27:
+            simThreadStop();
+            inputReport();
+            exit(0);
+            break;
+        case 't':
+        case 'T':
+            showTiming = !showTiming;
+            redrawPending = 1;
+            tickWake();
+            return;
+    }
+    postEvent(EV_KEY_DOWN, key, 0, x, y);
+}
+
+void postKeyboardUp(unsigned char key, int x, int y)
+{
+    postEvent(EV_KEY_UP, key, 0, x, y);
+}
+
+void postSpecial(int key, int x, int y)
+{
+    postEvent(EV_SPECIAL, key, 0, x, y);
+}
+
+void postMouse(int button, int state, int x, int y)
+{
+    postEvent(EV_MOUSE, button, state, x, y);
+}
+
+void postMotion(int x, int y)
+{
+    postEvent(EV_MOTION, 0, 0, x, y);
+}
+
+/******************************************
+ * Luong mo phong, dau moi buoc: xu ly cac su kien da xep hang.
+ * Ghi phien (--record) cung dien ra o day nen so buoc luon dung
+ ******************************************/
+void inputQueueDrain(void)
+{
+    InputEvent batch[INPUT_QUEUE_SIZE];
+    int n, i;
+
+    simLockEnter();
+    n = inputQueueCount;
+    for (i = 0; i < n; i++)
+    {
+        batch[i] = inputQueue[(inputQueueHead + i) % INPUT_QUEUE_SIZE];
+    }
+    inputQueueHead = (inputQueueHead + n) % INPUT_QUEUE_SIZE;
+    inputQueueCount = 0;
+    simLockLeave();
+
+    for (i = 0; i < n; i++)
+    {
+        inputEventTime = batch[i].time;
+        dispatchEvent(&batch[i]);
+    }
+    inputEventTime = -1.0;
+}
+
+/******************************************
+ * Bo dem ba: luong mo phong ghi o snapWrite roi doi no voi o dang
+ * cho; luong ve doi o cua no voi o dang cho neu co anh chup moi.
+ * Moi ben luon giu rieng mot o nen khong ai phai doi ai
+ ******************************************/
+static void simPublish(void)
+{
+    SimSnapshot *snap = &snapshots[snapWrite];
+
+    fleetCopyRange(&snap->prev, &fleetBack, 0, fleet.count);
+    fleetCopyRange(&snap->cur, &fleet, 0, fleet.count);
+    snap->time = simLastTime - simAccumulator;
+    snap->camera[0] = camx;
+    snap->camera[1] = camy;
+    snap->camera[2] = camz;
+    snap->camera[3] = anglex;
+    snap->camera[4] = angley;
+    snap->camera[5] = anglez;
+    snap->tick = simTicks;
+    snap->simMs = simWorkMs;
+    snap->simSteps = simWorkSteps;
+
+    // Anh chup co the bi bo qua: giu lan nhan moi nhat cho anh sau
+    if (inputAppliedTime >= 0.0)
+    {
+        simInputTime = inputAppliedTime;
+        simInputKey = inputAppliedKey;
+        simInputTick = inputAppliedTick;
+        inputAppliedTime = -1.0;
+    }
+    snap->inputTime = simInputTime;
+    snap->inputKey = simInputKey;
+    snap->inputTick = simInputTick;
+
+    snapWrite = snapState.exchange(snapWrite | SNAP_FRESH, std::memory_order_acq_rel) & SNAP_INDEX;
+}
+
+int simSnapshotFresh(void)
+{
+    return (snapState.load(std::memory_order_acquire) & SNAP_FRESH) != 0;
+}
+
+const SimSnapshot *simSnapshotTake(void)
+{
+    if (simSnapshotFresh())
+    {
+        snapRead = snapState.exchange(snapRead, std::memory_order_acq_rel) & SNAP_INDEX;
+    }
+    return &snapshots[snapRead];
+}
+
+/******************************************
+ * Vong luong mo phong: buoc co dinh SIM_DT theo dong ho thuc, cho
+ * giua cac buoc; ngu han khi doan xe dung yen cho den su kien ke tiep
+ ******************************************/
+static void simLoop(void)
+{
+    while (!simQuit.load())
+    {
+        int sleeping = 0;
+
+        if (advanceSimulation() > 0)
+        {
+            simActive = fleetChanged() || inputActive();
+            simPublish();
+        }
+
+        simLockEnter();
+        if (simActive)
+        {
+            if (!simQuit.load()) simWaitLocked(SIM_DT - simAccumulator);
+        }
+        else
+        {
+            // Anh chup cuoi da dang truoc khi bao ngu; postEvent() xoa co
+            if (inputQueueCount == 0) simAsleep.store(1);
+            while (!simQuit.load() && inputQueueCount == 0) simWaitLocked(-1.0);
+            sleeping = 1;
+        }
+        simLockLeave();
+
+        if (sleeping)
+        {
+            // Khong tinh khoang thoi gian ngu vao mo phong
+            simLastTime = nowSeconds();
+            simActive = 1;
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI simThreadMain(LPVOID arg)
+{
+    simLoop();
+    return 0;
+}
+#else
+static void *simThreadMain(void *arg)
+{
+    simLoop();
+    return NULL;
+}
+#endif
+
+/******************************************
+ * Chuyen mo phong sang luong rieng (sau init()); that bai thi
+ * giu mo phong tren luong GLUT nhu cu
+ ******************************************/
+void simThreadStart(void)
+{
+    int i, ok;
+
+    for (i = 0; i < 3; i++)
+    {
+        fleetAlloc(&snapshots[i].prev, fleet.count);
+        fleetAlloc(&snapshots[i].cur, fleet.count);
+    }
+#ifdef _WIN32
+    InitializeCriticalSection(&simLock);
+    InitializeConditionVariable(&simWake);
+#endif
+    simLastTime = nowSeconds();
+    simAccumulator = 0.0;
+    simActive = 1;
+    simPublish();       // Khung dau tien da co anh chup
+
+    simThreaded = 1;
+#ifdef _WIN32
+    simThreadHandle = CreateThread(NULL, 0, simThreadMain, NULL, 0, NULL);
+    ok = simThreadHandle != NULL;
+#else
+    ok = pthread_create(&simThreadHandle, NULL, simThreadMain, NULL) == 0;
+#endif
+    if (!ok)
+    {
+        fprintf(stderr, "Khong tao duoc luong mo phong, mo phong tren luong ve\n");
+        simThreaded = 0;
+        return;
+    }
+    simThreadRunning = 1;
+    atexit(simThreadStop);
+}
+
+/******************************************
+ * Dung luong mo phong truoc khi thoat (file ghi, quy dao dong sau)
+ ******************************************/
+void simThreadStop(void)
+{
+    if (!simThreadRunning) return;
+#ifdef _WIN32
+    if (GetCurrentThreadId() == GetThreadId(simThreadHandle)) return;
+#else
+    if (pthread_equal(pthread_self(), simThreadHandle)) return;
+#endif
+    simThreadRunning = 0;
+    simQuit.store(1);
+    simLockEnter();
+    simSignal();
+    simLockLeave();
+#ifdef _WIN32
+    WaitForSingleObject(simThreadHandle, INFINITE);
+    CloseHandle(simThreadHandle);
+#else
+    pthread_join(simThreadHandle, NULL);
+#endif
+    if (inputQueueDropped > 0)
+    {
+        fprintf(stderr, "Hang doi su kien day: bo %lu su kien\n", inputQueueDropped);
+    }
+}
+
+/******************************************
+ * Mo phong co chay o luong rieng khong: mac dinh chi khi co cua so.
+ * Do hieu nang va phat lai can moi khung dung mot buoc nen khong
+ ******************************************/
+static int simThreadWanted(void)
+{
+    if (benchScenario || replayPath) return 0;
+    return simThreadMode > 0 || (simThreadMode < 0 && !headless);
+}
+
+/******************************************
+ * Bat/tat dong bo man hinh (swap interval) neu driver ho tro
+ ******************************************/
+static void setSwapInterval(int interval)
+{
+    typedef int (APIENTRY *SwapIntervalProc)(int);
+    SwapIntervalProc swapInterval;
+
+#ifdef _WIN32
+    swapInterval = (SwapIntervalProc)getGLProc("wglSwapIntervalEXT");
+#else
+    swapInterval = (SwapIntervalProc)getGLProc("glXSwapIntervalMESA");
+    if (swapInterval == NULL) swapInterval = (SwapIntervalProc)getGLProc("glXSwapIntervalSGI");
+#endif
+    if (swapInterval)
+    {
+        swapInterval(interval);
+    }
+    else if (interval)
+    {
+        fprintf(stderr, "Driver khong ho tro --vsync\n");
+    }
+}
+
+/******************************************
+ * Ham dat lai wheelie (khi het wheelieTimer buoc)
+ ******************************************/
+void wheelieReset(int value)
+{
+    if (wheelieActive)
+    {
+        fleet.wheelieAngle[PLAYER] = 0.0f;
+        wheelieActive = 0;
+        wheelieTimer = 0;
+        requestRedraw();
+    }
+}
+
+/******************************************
+ * Xu ly phim dac biet
+ ******************************************/
+void special(int key, int x, int y)
+{
+    if (benchScenario) return;  // Kich ban do hieu nang dieu khien canh
+    if (recordLog) recordEvent(EV_SPECIAL, key, 0, 0, 0);
+
+    switch (key)
+    {
+        case GLUT_KEY_UP:
+            camz -= 0.1f;
+            break;
+        case GLUT_KEY_DOWN:
+            camz += 0.1f;
+            break;
+        case GLUT_KEY_LEFT:
+            camx -= 0.1f;
+            break;
+        case GLUT_KEY_RIGHT:
+            camx += 0.1f;
+            break;
+    }
+    requestRedraw();
+}
+
+/******************************************
+ * Dat lai canh
+ ******************************************/
+void reset()
+{
+    int i;
+
+    anglex = angley = anglez = 0.0f;
+    Mouse = GLUT_UP;
+    camx = 0.0f;
+    camy = 2.0f;
+    camz = 5.0f;
+    wheelieActive = 0;
+    wheelieTimer = 0;
+
+    for (i = 0; i < fleet.count; i++)
+    {
+        fleet.pedalAngle[i] = 0.0f;
+        fleet.speed[i] = 0.0f;
+        fleet.wheelieAngle[i] = 0.0f;
+        if (i == PLAYER)
+        {
+            fleet.xpos[i] = fleet.zpos[i] = 0.0f;
+            fleet.direction[i] = 0.0f;
+            fleet.steering[i] = 0.0f;
+            fleet.autoMove[i] = startAuto;
+        }
+        else
+        {
+            // Xe khac: xep xoan oc quanh nguoi choi, huong va tay lai
+            // co dinh theo chi so de lan chay nao cung giong nhau
+            GLfloat a = radians(i * 137.508f);
+            GLfloat r = 4.0f + 2.5f * sqrt((GLfloat)i);
+            fleet.xpos[i] = r * cos(a);
+            fleet.zpos[i] = r * sin(a);
+            fleet.direction[i] = fmod(i * 97.0f, 360.0f);
+            fleet.steering[i] = (GLfloat)((i * 7919) % 41 - 20) * 0.5f;
+            fleet.autoMove[i] = 1;
+        }
+    }
+    if (terrainLoaded)
+    {
+        terrainPrepare();
+        terrainContact(&fleet, 0, fleet.count);
+    }
+    fleetSavePrevious();
+    // Luong mo phong rieng: tu the do luong ve tinh tu anh chup
+    if (!simThreaded) fleetPose(&fleetBack, &fleet, PLAYER, 0.0f, &pose);
+}
+
+/******************************************
+ * Ghi moc thoi gian cho mot lan nhan phim (hoac nhap gia lap khi
+ * do hieu nang); chi giu lan som nhat chua duoc mo phong
+ ******************************************/
+void inputStamp(int key)
+{
+    if (inputPendingTime < 0.0)
+    {
+        inputPendingTime = inputEventTime >= 0.0 ? inputEventTime : nowSeconds();
+        inputPendingKey = key;
+    }
+}
+
+/******************************************
+ * Tang toc theo chieu dang di (W) hoac lui (S)
+ ******************************************/
+static void throttle(GLfloat sign)
+{
+    if (fleet.speed[PLAYER] * sign < 0.0f)
+    {
+        fleet.speed[PLAYER] = -fleet.speed[PLAYER];
+    }
+    fleet.speed[PLAYER] += sign * INC_SPEED;
+    if (fleet.speed[PLAYER] > MAX_SPEED) fleet.speed[PLAYER] = MAX_SPEED;
+    if (fleet.speed[PLAYER] < MIN_SPEED) fleet.speed[PLAYER] = MIN_SPEED;
+    fleet.autoMove[PLAYER] = 0;
+}
+
+/******************************************
+ * Lay mau ban phim mot lan moi buoc mo phong (truoc updateScene).
+ * W/S va A/D tac dung khi dang giu; lan nhan dau tien cua A/D quay
+ * mot nac INC_STEERING, sau do quay deu STEER_RATE. +/- tac dung
+ * moi lan nhan
+ ******************************************/
+void applyInput(void)
+{
+    GLfloat step;
+
+    if (keyHeld['w'] || keyLatched['w']) throttle(1.0f);
+    if (keyHeld['s'] || keyLatched['s']) throttle(-1.0f);
+
+    step = 0.0f;
+    if (keyLatched['a']) step += INC_STEERING;
+    else if (keyHeld['a']) step += STEER_RATE * SIM_DT;
+    if (keyLatched['d']) step -= INC_STEERING;
+    else if (keyHeld['d']) step -= STEER_RATE * SIM_DT;
+    if (step != 0.0f)
+    {
+        fleet.steering[PLAYER] += step;
+        if (fleet.steering[PLAYER] > HANDLE_LIMIT) fleet.steering[PLAYER] = HANDLE_LIMIT;
+        if (fleet.steering[PLAYER] < -HANDLE_LIMIT) fleet.steering[PLAYER] = -HANDLE_LIMIT;
+    }
+
+    // + tang toc theo chieu dang di, throttle() chan ca hai dau
+    if (keyLatched['+']) throttle(fleet.speed[PLAYER] >= 0.0f ? 1.0f : -1.0f);
+    if (keyLatched['-'])
+    {
+        if (fleet.speed[PLAYER] >= 0.0f)
+        {
+            fleet.speed[PLAYER] -= INC_SPEED;
+            if (fleet.speed[PLAYER] < 0.0f) fleet.speed[PLAYER] = 0.0f;
+        }
+        else
+        {
+            fleet.speed[PLAYER] += INC_SPEED;
+            if (fleet.speed[PLAYER] > 0.0f) fleet.speed[PLAYER] = 0.0f;
+        }
+        fleet.autoMove[PLAYER] = 0;
+    }
+    memset(keyLatched, 0, sizeof(keyLatched));
+
+    // Wheelie dem theo buoc mo phong de phat lai cho cung ket qua
+    if (wheelieTimer > 0 && --wheelieTimer == 0) wheelieReset(0);
+
+    // Lan nhan nay da vao mo phong: khung hien ke tiep se phan anh no
+    if (inputPendingTime >= 0.0)
+    {
+        if (inputAppliedTime < 0.0)
+        {
+            inputAppliedTime = inputPendingTime;
+            inputAppliedKey = inputPendingKey;
+            inputAppliedTick = simTicks;
+        }
+        inputPendingTime = -1.0;
+    }
+}
+
+/******************************************
+ * Con phim dieu khien nao dang giu (de vong ve theo yeu cau khong ngu)
+ ******************************************/
+int inputActive(void)
+{
+    return keyHeld['w'] || keyHeld['s'] || keyHeld['a'] || keyHeld['d'] ||
+           wheelieTimer > 0 || replayLog != NULL;
+}
+
+/******************************************
+ * Goi ngay sau khi doi bo dem: ghi do tre nhap -> hien
+ ******************************************/
+void inputPresented(void)
+{
+    double now, latency;
 
-    glBegin(GL_QUAD_STRIP);
-    for (i = 0; i < teeth; i++)
-    {
-        angle = i * 2.0 * PI / teeth;
-        glVertex3f(r1 * cos(angle), r1 * sin(angle), width * 0.5f);
-        glVertex3f(r1 * cos(angle), r1 * sin(angle), -width * 0.5f);
-        GLfloat u = r2 * cos(angle + da) - r1 * cos(angle);
-        GLfloat v = r2 * sin(angle + da) - r1 * sin(angle);
-        GLfloat len = sqrt(u * u + v * v);
-        glNormal3f(v / len, -u / len, 0.0f);
-        glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), width * 0.5f);
-        glVertex3f(r2 * cos(angle + da), r2 * sin(angle + da), -width * 0.5f);
-        glNormal3f(cos(angle), sin(angle), 0.0f);
-        glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), width * 0.5f);
-        glVertex3f(r2 * cos(angle + 2 * da), r2 * sin(angle + 2 * da), -width * 0.5f);
-        u = r1 * cos(angle + 3 * da) - r2 * cos(angle + 2 * da);
-        v = r1 * sin(angle + 3 * da) - r2 * sin(angle + 2 * da);
-        glNormal3f(v / len, -u / len, 0.0f);
-        glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), width * 0.5f);
-        glVertex3f(r1 * cos(angle + 3 * da), r1 * sin(angle + 3 * da), -width * 0.5f);
-        glNormal3f(cos(angle), sin(angle), 0.0f);
-    }
-    glVertex3f(r1 * cos(0.0f), r1 * sin(0.0f), width * 0.5f);
-    glVertex3f(r1 * cos(0.0f), r1 * sin(0.0f), -width * 0.5f);
-    glEnd();
+    presentCount++;
+    if (inputShownTime < 0.0) return;
 
-    glShadeModel(GL_SMOOTH);
-    glBegin(GL_QUAD_STRIP);
-    for (i = 0; i <= teeth; i++)
+    now = nowSeconds();
+    latency = (now - inputShownTime) * 1000.0;
+    inputLatency[inputLatencyCount % MAX_INPUT_SAMPLES] = latency;
+    inputLatencyCount++;
+    if (inputLog)
     {
-        angle = i * 2.0 * PI / teeth;
-        glNormal3f(-cos(angle), -sin(angle), 0.0f);
-        glVertex3f(r0 * cos(angle), r0 * sin(angle), -width * 0.5f);
-        glVertex3f(r0 * cos(angle), r0 * sin(angle), width * 0.5f);
+        fprintf(inputLog, "%d,%.3f,%lu,%lu,%.3f,%.3f\n", inputShownKey,
+                inputShownTime * 1000.0, inputShownTick, presentCount,
+                now * 1000.0, latency);
     }
-    glEnd();
+    inputShownTime = -1.0;
 }
 
 /******************************************
- * Ve xich xe dap
+ * p50 / p95 / p99 / max do tre tren MAX_INPUT_SAMPLES lan gan nhat
  ******************************************/
-void drawChain()
+void inputStats(double *p50, double *p95, double *p99, double *mx)
 {
-    GLfloat depth;
-    static int mode = 0;
+    int n = inputLatencyCount < MAX_INPUT_SAMPLES ? inputLatencyCount : MAX_INPUT_SAMPLES;
+    double *sorted;
 
-    glColor3f(0.0f, 1.0f, 0.5f);
-    glEnable(GL_LINE_STIPPLE);
-    mode = (mode + 1) % 2;
+    *p50 = *p95 = *p99 = *mx = 0.0;
+    if (n == 0) return;
+    sorted = (double *)frameAlloc(n * sizeof(double));
+    memcpy(sorted, inputLatency, n * sizeof(double));
+    std::sort(sorted, sorted + n);
+    *p50 = sorted[(n * 50 - 1) / 100];
+    *p95 = sorted[(n * 95 - 1) / 100];
+    *p99 = sorted[(n * 99 - 1) / 100];
+    *mx = sorted[n - 1];
+}
 
-    if (mode == 0 && Abs(speed) > 0) glLineStipple(1, 0x1c47);
-    else if (mode == 1 && Abs(speed) > 0) glLineStipple(1, 0x00FF);
+/******************************************
+ * In tom tat do tre khi thoat
+ ******************************************/
+void inputReport(void)
+{
+    double p50, p95, p99, mx;
 
-    glBegin(GL_LINES);
-    for (depth = 0.06f; depth <= 0.12f; depth += 0.01f)
+    if (inputLatencyCount == 0) return;
+    inputStats(&p50, &p95, &p99, &mx);
+    printf("Do tre nhap -> hien (ms, %d lan): p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+           inputLatencyCount, p50, p95, p99, mx);
+    if (inputLog)
     {
-        glVertex3f(-1.6f, 0.15f, ROD_RADIUS);
-        glVertex3f(0.0f, 0.3f, depth);
-        glVertex3f(-1.6f, -0.15f, ROD_RADIUS);
-        glVertex3f(0.0f, -0.3f, depth);
+        fclose(inputLog);
+        inputLog = NULL;
     }
-    glEnd();
-    glDisable(GL_LINE_STIPPLE);
 }
 
 /******************************************
- * Ve ghe ngoi
+ * Ma bam FNV-1a cua trang thai doan xe va camera, de kiem tra
+ * phat lai cho dung ket qua nhu luc ghi
  ******************************************/
-void drawSeat()
+static unsigned int hashBytes(unsigned int h, const void *data, size_t size)
 {
-    glColor3f(1.0f, 1.0f, 0.0f);
-    glBegin(GL_POLYGON);
-    {
-        glVertex3f(-0.20f, 1.2f, -0.60f);
-        glVertex3f(1.2f, 1.0f, -0.40f);
-        glVertex3f(1.0f, 1.1f, 0.30f);
-        glVertex3f(-0.20f, 1.3f, 0.70f);
-        glVertex3f(-0.70f, 1.0f, 1.2f);
-        glVertex3f(-1.2f, 1.1f, 1.2f);
-        glVertex3f(-1.2f, 1.0f, -1.2f);
-        glVertex3f(-0.70f, 1.0f, -1.2f);
-    }
-    glEnd();
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
 
-    glColor3f(0.0f, 1.0f, 1.0f);
-    glBegin(GL_POLYGON);
+    for (i = 0; i < size; i++)
     {
-        glVertex3f(-0.20f, -1.2f, -0.60f);
-        glVertex3f(1.2f, -1.0f, -0.40f);
-        glVertex3f(1.0f, -1.1f, 0.30f);
-        glVertex3f(-0.20f, -1.3f, 0.70f);
-        glVertex3f(-0.70f, -1.0f, 1.2f);
-        glVertex3f(-1.2f, -1.1f, 1.2f);
-        glVertex3f(-1.2f, -1.0f, -1.2f);
-        glVertex3f(-0.70f, -1.0f, -1.2f);
+        h ^= p[i];
+        h *= 16777619u;
     }
-    glEnd();
+    return h;
+}
 
-    glBegin(GL_QUADS);
-    {
-        glVertex3f(1.2f, 1.0f, -0.40f); glVertex3f(1.2f, 1.0f, 0.30f);
-        glVertex3f(1.2f, -1.0f, 0.30f); glVertex3f(1.2f, -1.0f, -0.40f);
-        glVertex3f(1.2f, 1.0f, 0.30f); glVertex3f(-0.20f, 1.3f, 0.70f);
-        glVertex3f(-0.20f, -1.3f, 0.70f); glVertex3f(1.2f, -1.0f, 0.30f);
-        glVertex3f(1.2f, 1.0f, -0.40f); glVertex3f(-0.20f, 1.2f, -0.60f);
-        glVertex3f(-0.20f, -1.2f, -0.60f); glVertex3f(1.2f, -1.0f, -0.40f);
-        glVertex3f(-0.20f, 1.3f, 0.70f); glVertex3f(-0.70f, 1.0f, 1.2f);
-        glVertex3f(-0.70f, -1.0f, 1.2f); glVertex3f(-0.20f, -1.3f, 0.70f);
-        glVertex3f(-0.20f, 1.2f, -0.60f); glVertex3f(-0.70f, 1.0f, -1.2f);
-        glVertex3f(-0.70f, -1.0f, -1.2f); glVertex3f(-0.20f, -1.2f, -0.60f);
-        glVertex3f(-0.70f, 1.0f, 1.2f); glVertex3f(-1.2f, 1.0f, 1.2f);
-        glVertex3f(-1.2f, -1.0f, 1.2f); glVertex3f(-0.70f, -1.0f, 1.2f);
-        glVertex3f(-0.70f, 1.0f, -1.2f); glVertex3f(-1.2f, 1.0f, -1.2f);
-        glVertex3f(-1.2f, -1.0f, -1.2f); glVertex3f(-1.2f, -1.0f, 1.2f);
-    }
-    glEnd();
+unsigned int stateHash(void)
+{
+    size_t bytes = fleet.count * sizeof(GLfloat);
+    GLfloat camera[6] = {camx, camy, camz, anglex, angley, anglez};
+    unsigned int h = 2166136261u;
+
+    h = hashBytes(h, fleet.xpos, bytes);
+    h = hashBytes(h, fleet.zpos, bytes);
+    h = hashBytes(h, fleet.direction, bytes);
+    h = hashBytes(h, fleet.speed, bytes);
+    h = hashBytes(h, fleet.steering, bytes);
+    h = hashBytes(h, fleet.pedalAngle, bytes);
+    h = hashBytes(h, fleet.wheelieAngle, bytes);
+    h = hashBytes(h, fleet.autoMove, fleet.count * sizeof(int));
+    return hashBytes(h, camera, sizeof(camera));
 }
 
 /******************************************
- * Ve ban dap
+ * Mang trang thai cua doan xe theo thu tu luu trong file ghi
  ******************************************/
-void drawPedals()
+static GLfloat *fleetField(int field)
 {
-    glColor3f(0.25f, 0.15f, 0.1f);
-    glPushMatrix();
-    {
-        glTranslatef(0.0f, 0.0f, 0.105f);
-        glRotatef(-pedalAngle, 0.0f, 0.0f, 1.0f);
-        glTranslatef(0.25f, 0.0f, 0.0f);
-        glPushMatrix();
-        {
-            glScalef(0.5f, 0.1f, 0.1f);
-            glutSolidCube(1.0f);
-        }
-        glPopMatrix();
-        glPushMatrix();
-        {
-            glTranslatef(0.25f, 0.0f, 0.15f);
-            glRotatef(pedalAngle, 0.0f, 0.0f, 1.0f);
-            glScalef(0.2f, 0.02f, 0.3f);
-            glutSolidCube(1.0f);
-        }
-        glPopMatrix();
-    }
-    glPopMatrix();
-
-    glPushMatrix();
+    GLfloat *fields[] =
     {
-        glTranslatef(0.0f, 0.0f, -0.105f);
-        glRotatef(180.0f - pedalAngle, 0.0f, 0.0f, 1.0f);
-        glTranslatef(0.25f, 0.0f, 0.0f);
-        glPushMatrix();
-        {
-            glScalef(0.5f, 0.1f, 0.1f);
-            glutSolidCube(1.0f);
-        }
-        glPopMatrix();
-        glPushMatrix();
-        {
-            glTranslatef(0.25f, 0.0f, -0.15f);
-            glRotatef(pedalAngle - 180.0f, 0.0f, 0.0f, 1.0f);
-            glScalef(0.2f, 0.02f, 0.3f);
-            glutSolidCube(1.0f);
-        }
-        glPopMatrix();
-    }
-    glPopMatrix();
-
-    glColor3f(0.4f, 0.0f, 0.0f);
+        fleet.xpos, fleet.zpos, fleet.direction, fleet.speed,
+        fleet.steering, fleet.pedalAngle, fleet.wheelieAngle
+    };
+    return fields[field];
 }
 
 /******************************************
- * Ve lop xe
+ * Bat dau ghi: dau file la trang thai ngay sau reset()
+ *   "XDRL", phien ban (u32), so xe (u32), camera (6 float),
+ *   7 mang float theo xe, autoMove (u8 moi xe).
+ * Float luu theo thu tu byte cua may (x86: little-endian)
  ******************************************/
-void drawTyre(void)
+void recordOpen(const char *path)
 {
+    GLfloat camera[6] = {camx, camy, camz, anglex, angley, anglez};
     int i;
-    glColor3f(0.3f, 0.0f, 0.3f);
-    glutSolidTorus(0.06f, 0.92f, 4, 30);
-    glColor3f(1.0f, 1.0f, 0.5f);
-    glPushMatrix();
+
+    recordLog = fopen(path, "wb");
+    if (recordLog == NULL)
     {
-        glTranslatef(0.0f, 0.0f, -0.06f);
-        ZCylinder(0.02f, 0.12f);
+        fprintf(stderr, "Khong mo duoc %s\n", path);
+        return;
     }
-    glPopMatrix();
-    glutSolidTorus(0.02f, 0.02f, 3, 20);
-    glColor3f(0.8f, 0.6f, 0.5f);
-    for (i = 0; i < NUM_SPOKES; ++i)
+    fwrite(LOG_MAGIC, 1, 4, recordLog);
+    logPut32(recordLog, LOG_VERSION);
+    logPut32(recordLog, fleet.count);
+    fwrite(camera, sizeof(GLfloat), 6, recordLog);
+    for (i = 0; i < LOG_FLEET_FIELDS; i++)
     {
-        glPushMatrix();
-        {
-            glRotatef(i * SPOKE_ANGLE, 0.0f, 0.0f, 1.0f);
-            glBegin(GL_LINES);
-            {
-                glVertex3f(0.0f, 0.02f, 0.0f);
-                glVertex3f(0.0f, 0.86f, 0.0f);
-            }
-            glEnd();
-        }
-        glPopMatrix();
+        fwrite(fleetField(i), sizeof(GLfloat), fleet.count, recordLog);
     }
-    glColor3f(0.0f, 0.0f, 0.0f);
-    glutSolidTorus(TUBE_WIDTH, RADIUS_WHEEL, 10, 30);
-    glColor3f(0.4f, 0.0f, 0.0f);
+    for (i = 0; i < fleet.count; i++) logPut8(recordLog, fleet.autoMove[i]);
+
+    recordTick = simTicks;
+    recordEvents = 0;
+    // Esc, dong cua so hay ket thuc chay ngam deu di qua exit()
+    atexit(recordClose);
 }
 
 /******************************************
- * Ve nguoi tren xe dap
+ * Ghi mot su kien: so buoc tu su kien truoc (so bien do dai),
+ * loai (u8) va du lieu cua loai do
  ******************************************/
-void drawPerson(void)
+void recordEvent(int type, int a, int b, int x, int y)
 {
-    glColor3f(0.8f, 0.6f, 0.4f);
-
-    glPushMatrix();
+    logPutVarint(recordLog, simTicks - recordTick);
+    recordTick = simTicks;
+    logPut8(recordLog, type);
+    switch (type)
     {
-        glTranslatef(-0.2f, 0.3f, 0.0f);
-        glRotatef(-10.0f + wheelieAngle * 0.5f, 0.0f, 0.0f, 1.0f);
-
-        glPushMatrix();
-        {
-            glRotatef(90.0f, 1.0f, 0.0f, 0.0f);
-            ZCylinder(0.15f, 0.6f);
-        }
-        glPopMatrix();
-
-        glPushMatrix();
-        {
-            glTranslatef(0.0f, 0.7f, 0.0f);
-            glutSolidSphere(0.1f, 10, 10);
-        }
-        glPopMatrix();
-
-        glPushMatrix();
-        {
-            glTranslatef(0.2f, 0.5f, 0.0f);
-            glRotatef(-45.0f + wheelieAngle * 0.3f, 0.0f, 0.0f, 1.0f);
-            glPushMatrix();
-            {
-                ZCylinder(0.05f, 0.3f);
-            }
-            glPopMatrix();
-            glPushMatrix();
-            {
-                glTranslatef(0.0f, 0.0f, 0.3f);
-                glRotatef(-30.0f, 0.0f, 0.0f, 1.0f);
-                ZCylinder(0.05f, 0.3f);
-            }
-            glPopMatrix();
-        }
-        glPopMatrix();
-
-        glPushMatrix();
-        {
-            glTranslatef(-0.2f, 0.5f, 0.0f);
-            glRotatef(-45.0f + wheelieAngle * 0.3f, 0.0f, 0.0f, 1.0f);
-            glPushMatrix();
-            {
-                ZCylinder(0.05f, 0.3f);
-            }
-            glPopMatrix();
-            glPushMatrix();
-            {
-                glTranslatef(0.0f, 0.0f, 0.3f);
-                glRotatef(-30.0f, 0.0f, 0.0f, 1.0f);
-                ZCylinder(0.05f, 0.3f);
-            }
-            glPopMatrix();
-        }
-        glPopMatrix();
-
-        glPushMatrix();
-        {
-            glTranslatef(0.1f, 0.0f, 0.105f);
-            glRotatef(-pedalAngle - 90.0f, 0.0f, 0.0f, 1.0f);
-            glPushMatrix();
-            {
-                ZCylinder(0.07f, 0.4f);
-            }
-            glPopMatrix();
-            glPushMatrix();
-            {
-                glTranslatef(0.0f, 0.0f, 0.4f);
-                glRotatef(60.0f * sin(radians(pedalAngle)) + 30.0f, 0.0f, 0.0f, 1.0f);
-                ZCylinder(0.07f, 0.4f);
-            }
-            glPopMatrix();
-        }
-        glPopMatrix();
-
-        glPushMatrix();
-        {
-            glTranslatef(-0.1f, 0.0f, -0.105f);
-            glRotatef(180.0f - pedalAngle - 90.0f, 0.0f, 0.0f, 1.0f);
-            glPushMatrix();
-            {
-                ZCylinder(0.07f, 0.4f);
-            }
-            glPopMatrix();
-            glPushMatrix();
-            {
-                glTranslatef(0.0f, 0.0f, 0.4f);
-                glRotatef(60.0f * sin(radians(pedalAngle + 180.0f)) + 30.0f, 0.0f, 0.0f, 1.0f);
-                ZCylinder(0.07f, 0.4f);
-            }
-            glPopMatrix();
-        }
-        glPopMatrix();
+        case EV_KEY_DOWN:
+        case EV_KEY_UP:
+        case EV_SPECIAL:
+            logPut8(recordLog, a);
+            break;
+        case EV_MOUSE:
+            logPut8(recordLog, a);
+            logPut8(recordLog, b);
+            logPut16(recordLog, x);
+            logPut16(recordLog, y);
+            break;
+        case EV_MOTION:
+            logPut16(recordLog, x);
+            logPut16(recordLog, y);
+            break;
     }
-    glPopMatrix();
-
-    glColor3f(0.4f, 0.0f, 0.0f);
+    recordEvents++;
 }
 
 /******************************************
- * Ve nhan dieu khien tren man hinh
+ * Ket thuc file ghi bang ma bam trang thai cuoi
  ******************************************/
-void drawControlsText(void)
+void recordClose(void)
 {
-    glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
-    glOrtho(0, WIN_WIDTH, 0, WIN_HEIGHT, -1, 1);
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
-
-    glDisable(GL_LIGHTING);
-    glDisable(GL_DEPTH_TEST);
+    long size;
 
-    glColor3f(1.0f, 1.0f, 0.0f);
-
-    int x = 10;
-    int y = WIN_HEIGHT - 20;
-
-    const char *controls[] =
-    {
-        "Project made by: NGUYEN HUU PHONG & HOANG MINH TRI",
-        "R: Dat lai",
-        "W: Di toi",
-        "A: Re trai",
-        "S: Lui lai",
-        "D: Re phai",
-        "L: Tu dong chay",
-        "K: Dung lai",
-        "Esc: thoat chuong trinh"
-    };
-    int numControls = sizeof(controls) / sizeof(controls[0]);
-    void *font = GLUT_BITMAP_HELVETICA_12;
+    if (recordLog == NULL) return;
+    logPutVarint(recordLog, simTicks - recordTick);
+    logPut8(recordLog, EV_END);
+    logPut32(recordLog, stateHash());
+    size = ftell(recordLog);
+    fclose(recordLog);
+    recordLog = NULL;
+    printf("Da ghi %lu su kien trong %lu buoc mo phong vao %s (%ld byte)\n",
+           recordEvents, simTicks, recordPath, size);
+}
 
-    char speedStr[32];
-    sprintf(speedStr, "Toc do: %.2f", speed);
+/******************************************
+ * Doc su kien ke tiep; het file (phien bi ngat) coi nhu ket thuc
+ * khong co ma bam
+ ******************************************/
+static void replayRead(InputEvent *ev)
+{
+    unsigned long delta;
+    unsigned int type, a = 0, b = 0, x = 0, y = 0;
+    int ok;
 
-    for (int i = 0; i < numControls; i++)
+    ok = logGetVarint(replayLog, &delta) && logGet8(replayLog, &type);
+    if (ok)
     {
-        glRasterPos2i(x, y - i * 15);
-        const char *str = controls[i];
-        for (int j = 0; j < strlen(str); j++)
+        switch (type)
         {
-            glutBitmapCharacter(font, str[j]);
+            case EV_END:
+                ok = logGet32(replayLog, &a);
+                b = 1;
+                break;
+            case EV_KEY_DOWN:
+            case EV_KEY_UP:
+            case EV_SPECIAL:
+                ok = logGet8(replayLog, &a);
+                break;
+            case EV_MOUSE:
+                ok = logGet8(replayLog, &a) && logGet8(replayLog, &b) &&
+                     logGet16(replayLog, &x) && logGet16(replayLog, &y);
+                break;
+            case EV_MOTION:
+                ok = logGet16(replayLog, &x) && logGet16(replayLog, &y);
+                break;
+            default:
+                ok = 0;
+                break;
         }
     }
-
-    glRasterPos2i(x, y - numControls * 15);
-    for (int j = 0; j < strlen(speedStr); j++)
+    if (!ok)
     {
-        glutBitmapCharacter(font, speedStr[j]);
+        ev->type = EV_END;
+        ev->b = 0;
+        return;
     }
+    ev->tick += delta;
+    ev->type = type;
+    ev->a = a;
+    ev->b = b;
+    // Toa do chuot am khi keo ra ngoai cua so: mo rong dau tu 16 bit
+    ev->x = (short)x;
+    ev->y = (short)y;
+}
 
-    glEnable(GL_LIGHTING);
-    glEnable(GL_DEPTH_TEST);
+/******************************************
+ * Mo file ghi va doc so xe (goi truoc fleetInit)
+ ******************************************/
+int replayOpen(const char *path)
+{
+    char magic[4];
+    unsigned int version, count;
 
-    glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
-    glMatrixMode(GL_MODELVIEW);
-    glPopMatrix();
+    replayLog = fopen(path, "rb");
+    if (replayLog == NULL)
+    {
+        fprintf(stderr, "Khong mo duoc %s\n", path);
+        return 0;
+    }
+    if (fread(magic, 1, 4, replayLog) != 4 || memcmp(magic, LOG_MAGIC, 4) != 0 ||
+        !logGet32(replayLog, &version) || version != LOG_VERSION ||
+        !logGet32(replayLog, &count) || count < 1)
+    {
+        fprintf(stderr, "%s khong phai file ghi hop le\n", path);
+        fclose(replayLog);
+        replayLog = NULL;
+        return 0;
+    }
+    fleetSize = count;
+    return 1;
 }
 
 /******************************************
- * Khoi tao OpenGL
+ * Dat trang thai dau tu file ghi (goi sau reset())
  ******************************************/
-void init()
+void replayStart(void)
 {
-    GLfloat mat_specular[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat mat_shininess[] = {100.0f};
-    GLfloat light_directional[] = {1.0f, 1.0f, 1.0f, 0.0f};
-    GLfloat light_diffuse[] = {1.0f, 1.0f, 1.0f, 1.0f};
-
-    reset();
+    GLfloat camera[6];
+    unsigned int autoMove = 0;
+    int i, ok;
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glShadeModel(GL_SMOOTH);
-    glLightfv(GL_LIGHT0, GL_POSITION, light_directional);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glColorMaterial(GL_FRONT, GL_DIFFUSE);
+    ok = fread(camera, sizeof(GLfloat), 6, replayLog) == 6;
+    for (i = 0; ok && i < LOG_FLEET_FIELDS; i++)
+    {
+        ok = fread(fleetField(i), sizeof(GLfloat), fleet.count, replayLog) == (size_t)fleet.count;
+    }
+    for (i = 0; ok && i < fleet.count; i++)
+    {
+        ok = logGet8(replayLog, &autoMove);
+        fleet.autoMove[i] = autoMove;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "File ghi bi cat cut o phan trang thai dau\n");
+        exit(1);
+    }
+    camx = camera[0];
+    camy = camera[1];
+    camz = camera[2];
+    anglex = camera[3];
+    angley = camera[4];
+    anglez = camera[5];
+    fleetSavePrevious();
 
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-    glEnable(GL_COLOR_MATERIAL);
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_NORMALIZE);
+    replayNext.tick = simTicks;
+    replayEvents = 0;
+    replayRead(&replayNext);
 }
 
 /******************************************
- * Ve luoi mat dat
+ * Goi truoc moi buoc mo phong khi phat lai: dua cac su kien da ghi
+ * sau buoc hien tai vao cac ham xu ly nhu luc choi. Tra ve 0 khi het
+ * phien (kiem tra ma bam, dong file)
  ******************************************/
-void landmarks(void)
+int replayStep(void)
 {
-    GLfloat i;
-    glColor3f(0.0f, 1.0f, 0.0f);
-    glBegin(GL_LINES);
-    for (i = -100.0f; i <= 100.0f; i += 1.0f)
+    while (replayNext.type != EV_END && replayNext.tick <= simTicks)
+    {
+        dispatchEvent(&replayNext);
+        replayEvents++;
+        replayRead(&replayNext);
+    }
+    if (replayNext.type != EV_END || replayNext.tick > simTicks) return 1;
+
+    if (!replayNext.b)
     {
-        glVertex3f(-100.0f, -RADIUS_WHEEL, i);
-        glVertex3f(100.0f, -RADIUS_WHEEL, i);
-        glVertex3f(i, -RADIUS_WHEEL, -100.0f);
-        glVertex3f(i, -RADIUS_WHEEL, 100.0f);
+        printf("Phat lai %lu buoc: file ghi khong co ban ghi ket thuc, khong kiem tra duoc\n",
+               simTicks);
     }
-    glEnd();
+    else
+    {
+        unsigned int hash = stateHash();
+        replayOk = hash == (unsigned int)replayNext.a;
+        printf("Phat lai %lu buoc, %lu su kien: trang thai cuoi %s (%08x / %08x)\n",
+               simTicks, replayEvents, replayOk ? "khop" : "KHONG khop",
+               hash, (unsigned int)replayNext.a);
+    }
+    fclose(replayLog);
+    replayLog = NULL;
+    replayDone = 1;
+    if (windowed) exit(replayOk ? 0 : 2);
+    return 0;
 }
 
 /******************************************
- * Ham hien thi
+ * --replay-fast: chay lai phien nhanh nhat co the, khong mo cua so,
+ * khong ve; de do thoi gian mo phong cua mot phien that
  ******************************************/
-void display(void)
+int runReplayFast(void)
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    double start, elapsed;
 
-    gluLookAt(camx, camy, camz, xpos, 0.0f, zpos, 0.0f, 1.0f, 0.0f);
-
-    glPushMatrix();
-    {
-        glRotatef(angley, 1.0f, 0.0f, 0.0f);
-        glRotatef(anglex, 0.0f, 1.0f, 0.0f);
-        glRotatef(anglez, 0.0f, 0.0f, 1.0f);
+    reset();
+    replayStart();
+    if (tracePath) traceOpen(tracePath);
+    start = nowSeconds();
+    while (!replayDone) stepSimulation();
+    elapsed = nowSeconds() - start;
+    printf("%lu buoc (%d xe) trong %.3f s: %.0f buoc/giay, %.1fx thoi gian thuc\n",
+           simTicks, fleet.count, elapsed,
+           elapsed > 0.0 ? simTicks / elapsed : 0.0,
+           elapsed > 0.0 ? simTicks / (elapsed * SIM_RATE) : 0.0);
+    return replayOk ? 0 : 2;
+}
 
-        landmarks();
+/******************************************
+ * --replay-check: ghi mot phien keo chuot ra ngoai cua so (toa do
+ * am, ca hai dau cua khoang 16 bit) roi phat lai, so ma bam va goc
+ * camera voi luc ghi. Goc camera chi phu thuoc diem keo cuoi nen
+ * diem cuoi de am
+ ******************************************/
+int runReplayCheck(void)
+{
+    static const int drag[][2] = {{799, -1}, {-32768, 32767}, {5, 5}, {-20, -300}};
+    const char *path = "xedap_replay_check.xdr";
+    GLfloat recAnglex, recAngley;
+    unsigned int recHash;
+    int i, k, ok;
 
-        glPushMatrix();
-        {
-            glTranslatef(xpos, 0.0f, zpos);
-            glRotatef(direction, 0.0f, 1.0f, 0.0f);
-            drawFrame();
-            drawChain();
-            drawPedals();
-            drawPerson();
-        }
-        glPopMatrix();
+    reset();
+    recordPath = path;
+    recordOpen(path);
+    if (recordLog == NULL) return 1;
+    mouse(GLUT_LEFT_BUTTON, GLUT_DOWN, 10, 10);
+    for (i = 0; i < (int)(sizeof(drag) / sizeof(drag[0])); i++)
+    {
+        motion(drag[i][0], drag[i][1]);
+        for (k = 0; k < 3; k++) stepSimulation();
     }
-    glPopMatrix();
+    mouse(GLUT_LEFT_BUTTON, GLUT_UP, -20, -300);
+    stepSimulation();
+    recAnglex = anglex;
+    recAngley = angley;
+    recHash = stateHash();
+    recordClose();
+    recordPath = NULL;
 
-    drawControlsText();
+    reset();
+    if (!replayOpen(path)) return 1;
+    replayStart();
+    while (!replayDone) stepSimulation();
+    remove(path);
 
-    glutSwapBuffers();
+    ok = replayOk && anglex == recAnglex && angley == recAngley;
+    printf("Kiem tra ghi/phat lai (%d lan keo chuot, toa do am)\n",
+           (int)(sizeof(drag) / sizeof(drag[0])));
+    printf("  goc camera ghi   %.1f %.1f\n", recAnglex, recAngley);
+    printf("  goc camera phat  %.1f %.1f\n", anglex, angley);
+    printf("  ma bam           %08x / %08x\n", stateHash(), recHash);
+    printf("%s\n", ok ? "DAT" : "KHONG DAT");
+    return ok ? 0 : 1;
 }
 
 /******************************************
- * Ham tien ich
+ * Dat vi tri doc 64 bit (file quy dao co the lon hon 2 GB)
  ******************************************/
-GLfloat Abs(GLfloat a)
-{
-    return (a < 0.0f) ? -a : a;
-}
-
-GLfloat degrees(GLfloat a)
+static int fileSeek(FILE *f, unsigned long long offset)
 {
-    return a * 180.0f / PI;
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
 }
 
-GLfloat radians(GLfloat a)
+/******************************************
+ * Bat dau ghi quy dao (goi sau reset() / replayStart()). Dau file (24 byte):
+ *   "XDTR", phien ban, so xe, so cot, so buoc moi khoi, SIM_RATE (u32).
+ * Moi khoi: tung cot lien nhau, trong cot la [buoc][xe] float.
+ * Dong dau la trang thai truoc buoc mo phong dau tien
+ ******************************************/
+void traceOpen(const char *path)
 {
-    return a * PI / 180.0f;
+    traceFile = fopen(path, "wb");
+    traceBuffer = (GLfloat *)malloc((size_t)LOG_FLEET_FIELDS * TRACE_CHUNK_TICKS *
+                                    fleet.count * sizeof(GLfloat));
+    if (traceFile == NULL || traceBuffer == NULL)
+    {
+        fprintf(stderr, "Khong mo duoc %s\n", path);
+        if (traceFile) fclose(traceFile);
+        traceFile = NULL;
+        return;
+    }
+    fwrite(TRACE_MAGIC, 1, 4, traceFile);
+    logPut32(traceFile, TRACE_VERSION);
+    logPut32(traceFile, fleet.count);
+    logPut32(traceFile, LOG_FLEET_FIELDS);
+    logPut32(traceFile, TRACE_CHUNK_TICKS);
+    logPut32(traceFile, SIM_RATE);
+    traceOffset = 24;
+    traceTicks = 0;
+    traceChunks = 0;
+    atexit(traceClose);
+    traceTick();
 }
 
 /******************************************
- * Ham idle
+ * Ghi khoi dang gom ra file bang mot lan ghi moi cot
  ******************************************/
-void idle(void)
+static void traceFlush(void)
 {
-    updateScene();
-    glutPostRedisplay();
+    size_t rows = (size_t)traceTicks * fleet.count;
+    int i;
+
+    if (traceChunks == traceIndexCap)
+    {
+        traceIndexCap = traceIndexCap ? 2 * traceIndexCap : 64;
+        traceIndex = (TraceChunk *)realloc(traceIndex, traceIndexCap * sizeof(TraceChunk));
+    }
+    traceIndex[traceChunks].offset = traceOffset;
+    traceIndex[traceChunks].firstTick = traceFirstTick;
+    traceIndex[traceChunks].ticks = traceTicks;
+    traceChunks++;
+
+    for (i = 0; i < LOG_FLEET_FIELDS; i++)
+    {
+        fwrite(traceBuffer + (size_t)i * TRACE_CHUNK_TICKS * fleet.count,
+               sizeof(GLfloat), rows, traceFile);
+    }
+    traceOffset += (unsigned long long)LOG_FLEET_FIELDS * rows * sizeof(GLfloat);
+    traceTicks = 0;
 }
 
 /******************************************
- * Ham dat lai wheelie
+ * Goi khi mo file va sau moi buoc mo phong: chep trang thai moi
+ * vao khoi dang gom
  ******************************************/
-void wheelieReset(int value)
+void traceTick(void)
 {
-    if (wheelieActive)
+    size_t bytes = fleet.count * sizeof(GLfloat);
+    int i;
+
+    if (traceTicks == 0) traceFirstTick = simTicks;
+    for (i = 0; i < LOG_FLEET_FIELDS; i++)
     {
-        wheelieAngle = 0.0f;
-        wheelieActive = 0;
-        wheelieTimer = 0;
+        memcpy(traceBuffer + ((size_t)i * TRACE_CHUNK_TICKS + traceTicks) * fleet.count,
+               fleetField(i), bytes);
     }
+    if (++traceTicks == TRACE_CHUNK_TICKS) traceFlush();
 }
 
 /******************************************
- * Xu ly phim dac biet
+ * Ghi khoi cuoi, bang chi muc (vi tri u64, buoc dau, so buoc moi khoi)
+ * va 16 byte cuoi: so khoi, vi tri chi muc (u64), "XDTI"
  ******************************************/
-void special(int key, int x, int y)
+void traceClose(void)
 {
-    switch (key)
+    unsigned long long indexOffset;
+    int i;
+
+    if (traceFile == NULL) return;
+    if (traceTicks > 0) traceFlush();
+    indexOffset = traceOffset;
+    for (i = 0; i < traceChunks; i++)
     {
-        case GLUT_KEY_UP:
-            camz -= 0.1f;
-            break;
-        case GLUT_KEY_DOWN:
-            camz += 0.1f;
-            break;
-        case GLUT_KEY_LEFT:
-            camx -= 0.1f;
-            break;
-        case GLUT_KEY_RIGHT:
-            camx += 0.1f;
-            break;
+        logPut32(traceFile, (unsigned int)traceIndex[i].offset);
+        logPut32(traceFile, (unsigned int)(traceIndex[i].offset >> 32));
+        logPut32(traceFile, traceIndex[i].firstTick);
+        logPut32(traceFile, traceIndex[i].ticks);
     }
-    glutPostRedisplay();
+    logPut32(traceFile, traceChunks);
+    logPut32(traceFile, (unsigned int)indexOffset);
+    logPut32(traceFile, (unsigned int)(indexOffset >> 32));
+    fwrite(TRACE_INDEX_MAGIC, 1, 4, traceFile);
+    fclose(traceFile);
+    traceFile = NULL;
+    printf("Da ghi quy dao %d xe, %d khoi vao %s (%llu byte)\n", fleet.count,
+           traceChunks, tracePath, indexOffset + 16ull * traceChunks + 16);
+    free(traceBuffer);
+    free(traceIndex);
+    traceBuffer = NULL;
+    traceIndex = NULL;
 }
 
 /******************************************
- * Dat lai canh
+ * --trace-dump: in quy dao trong [--from, --to] giay (tuy chon chi
+ * xe --bike) ra CSV. Chi doc chi muc va phan cua cac khoi giao voi
+ * doan can in, moi lan toi da mot khoi
  ******************************************/
-void reset()
+int runTraceDump(void)
 {
-    anglex = angley = anglez = 0.0f;
-    pedalAngle = steering = 0.0f;
-    Mouse = GLUT_UP;
-    speed = 0.0f;
-    camx = 0.0f;
-    camy = 2.0f;
-    camz = 5.0f;
-    xpos = zpos = 0.0f;
-    direction = 0.0f;
-    wheelieAngle = 0.0f;
-    wheelieActive = 0;
-    wheelieTimer = 0;
-    autoMove = 0;
+    FILE *f = fopen(traceDumpPath, "rb");
+    char magic[4];
+    unsigned int version, bikes, fields, chunkTicks, rate, chunks, lo, hi;
+    unsigned long long indexOffset;
+    unsigned long long from, to;
+    TraceChunk *index;
+    GLfloat *cols;
+    int b0, b1, read = 0;
+    unsigned int c, i, t0, t1, t;
+    int b;
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "Khong mo duoc %s\n", traceDumpPath);
+        return 1;
+    }
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+        !logGet32(f, &version) || version != TRACE_VERSION ||
+        !logGet32(f, &bikes) || !logGet32(f, &fields) || fields != LOG_FLEET_FIELDS ||
+        !logGet32(f, &chunkTicks) || !logGet32(f, &rate) || bikes < 1 || rate < 1 ||
+        fseek(f, -16, SEEK_END) != 0 || !logGet32(f, &chunks) ||
+        !logGet32(f, &lo) || !logGet32(f, &hi) ||
+        fread(magic, 1, 4, f) != 4 || memcmp(magic, TRACE_INDEX_MAGIC, 4) != 0)
+    {
+        fprintf(stderr, "%s khong phai file quy dao hop le (hoac ghi chua xong)\n",
+                traceDumpPath);
+        fclose(f);
+        return 1;
+    }
+    indexOffset = lo | ((unsigned long long)hi << 32);
+
+    index = (TraceChunk *)malloc((chunks ? chunks : 1) * sizeof(TraceChunk));
+    cols = (GLfloat *)malloc((size_t)fields * chunkTicks * bikes * sizeof(GLfloat));
+    if (index == NULL || cols == NULL || fileSeek(f, indexOffset) != 0)
+    {
+        fprintf(stderr, "Khong doc duoc chi muc cua %s\n", traceDumpPath);
+        fclose(f);
+        return 1;
+    }
+    for (c = 0; c < chunks; c++)
+    {
+        unsigned int first, ticks;
+        if (!logGet32(f, &lo) || !logGet32(f, &hi) ||
+            !logGet32(f, &first) || !logGet32(f, &ticks) || ticks > chunkTicks)
+        {
+            fprintf(stderr, "Chi muc cua %s bi hong\n", traceDumpPath);
+            fclose(f);
+            return 1;
+        }
+        index[c].offset = lo | ((unsigned long long)hi << 32);
+        index[c].firstTick = first;
+        index[c].ticks = ticks;
+    }
+
+    from = (unsigned long long)(traceFrom * rate + 0.5);
+    to = traceTo < 0.0 ? ~0ull : (unsigned long long)(traceTo * rate + 0.5);
+    b0 = traceBike < 0 ? 0 : traceBike;
+    b1 = traceBike < 0 ? (int)bikes - 1 : traceBike;
+    if (b1 >= (int)bikes)
+    {
+        fprintf(stderr, "Chi co %u xe trong %s\n", bikes, traceDumpPath);
+        fclose(f);
+        return 1;
+    }
+
+    printf("tick,time,bike");
+    for (i = 0; i < fields; i++) printf(",%s", fleetFieldNames[i]);
+    printf("\n");
+
+    for (c = 0; c < chunks; c++)
+    {
+        unsigned long long first = index[c].firstTick;
+        unsigned long long last = first + index[c].ticks - 1;
+        unsigned int rows;
+
+        if (index[c].ticks == 0 || last < from || first > to) continue;
+        t0 = first < from ? (unsigned int)(from - first) : 0;
+        t1 = last > to ? (unsigned int)(to - first) : index[c].ticks - 1;
+        rows = t1 - t0 + 1;
+
+        // Moi cot: chi doc cac hang [t0, t1] cua khoi
+        for (i = 0; i < fields; i++)
+        {
+            unsigned long long pos = index[c].offset +
+                ((unsigned long long)i * index[c].ticks + t0) * bikes * sizeof(GLfloat);
+            if (fileSeek(f, pos) != 0 ||
+                fread(cols + (size_t)i * chunkTicks * bikes, sizeof(GLfloat),
+                      (size_t)rows * bikes, f) != (size_t)rows * bikes)
+            {
+                fprintf(stderr, "Khoi %u cua %s bi cat cut\n", c, traceDumpPath);
+                fclose(f);
+                return 1;
+            }
+        }
+        read++;
+
+        for (t = 0; t < rows; t++)
+        {
+            unsigned long long tick = first + t0 + t;
+            for (b = b0; b <= b1; b++)
+            {
+                printf("%llu,%.4f,%d", tick, (double)tick / rate, b);
+                for (i = 0; i < fields; i++)
+                {
+                    printf(",%.6g", cols[((size_t)i * chunkTicks + t) * bikes + b]);
+                }
+                printf("\n");
+            }
+        }
+    }
+    fprintf(stderr, "Doc %d/%u khoi, %u xe, %u buoc/khoi\n", read, chunks, bikes, chunkTicks);
+    free(cols);
+    free(index);
+    fclose(f);
+    return 0;
 }
 
 /******************************************
- * Xu ly ban phim
+ * Xu ly ban phim: phim dieu khien chi doi trang thai giu,
+ * buoc mo phong ke tiep moi doc (applyInput)
  ******************************************/
 void keyboard(unsigned char key, int x, int y)
 {
+    // Khi do hieu nang chi nhan Esc de dung giua chung
+    if (benchScenario && key != 27) return;
+    if (recordLog && key != 27) recordEvent(EV_KEY_DOWN, key, 0, 0, 0);
+
     switch (key)
     {
         case 'w':
         case 'W':
-            if (speed >= 0.0f)
-            {
-                speed += INC_SPEED;
-            }
-            else
-            {
-                speed = -speed;
-                speed += INC_SPEED;
-            }
-            if (speed > MAX_SPEED) speed = MAX_SPEED;
-            autoMove = 0;
-            break;
         case 's':
         case 'S':
-            if (speed <= 0.0f)
-            {
-                speed -= INC_SPEED;
-            }
-            else
-            {
-                speed = -speed;
-                speed -= INC_SPEED;
-            }
-            if (speed < MIN_SPEED) speed = MIN_SPEED;
-            autoMove = 0;
-            break;
         case 'a':
         case 'A':
-            if (steering < HANDLE_LIMIT) steering += INC_STEERING;
-            break;
         case 'd':
         case 'D':
-            if (steering > -HANDLE_LIMIT) steering -= INC_STEERING;
-            break;
         case '+':
-            if (speed >= 0.0f)
-            {
-                speed += INC_SPEED;
-                if (speed > MAX_SPEED) speed = MAX_SPEED;
-            }
-            else
-            {
-                speed -= INC_SPEED;
-                if (speed < MIN_SPEED) speed = MIN_SPEED;
-            }
-            autoMove = 0;
-            break;
         case '-':
-            if (speed >= 0.0f)
-            {
-                speed -= INC_SPEED;
-                if (speed < 0.0f) speed = 0.0f;
-            }
-            else
-            {
-                speed += INC_SPEED;
-                if (speed > 0.0f) speed = 0.0f;
-            }
-            autoMove = 0;
+            key = tolower(key);
+            keyHeld[key] = 1;
+            keyLatched[key] = 1;
+            inputStamp(key);
             break;
         case 'q':
         case 'Q':
             if (!wheelieActive)
             {
-                wheelieAngle = WHEELIE_ANGLE;
+                fleet.wheelieAngle[PLAYER] = WHEELIE_ANGLE;
                 wheelieActive = 1;
-                wheelieTimer = glutGet(GLUT_ELAPSED_TIME);
-                glutTimerFunc(WHEELIE_DURATION, wheelieReset, 0);
+                wheelieTimer = WHEELIE_DURATION * SIM_RATE / 1000;
             }
             break;
         case 'l':
         case 'L':
-            autoMove = 1;
+            fleet.autoMove[PLAYER] = 1;
             break;
         case 'k':
         case 'K':
-            autoMove = 0;
-            speed = 0.0f;
+            fleet.autoMove[PLAYER] = 0;
+            fleet.speed[PLAYER] = 0.0f;
+            break;
+        case 't':
+        case 'T':
+            showTiming = !showTiming;
             break;
         case 'r':
         case 'R':
             reset();
             break;
         case 27:
+            inputReport();
             exit(0);
             break;
     }
-    glutPostRedisplay();
+    requestRedraw();
+}
+
+/******************************************
+ * Nha phim
+ ******************************************/
+void keyboardUp(unsigned char key, int x, int y)
+{
+    if (recordLog) recordEvent(EV_KEY_UP, key, 0, 0, 0);
+    keyHeld[tolower(key)] = 0;
 }
 
 /******************************************
@@ -1040,6 +8120,9 @@ void keyboard(unsigned char key, int x, int y)
  ******************************************/
 void mouse(int button, int state, int x, int y)
 {
+    if (benchScenario) return;  // Kich ban do hieu nang dieu khien canh
+    if (recordLog) recordEvent(EV_MOUSE, button, state, x, y);
+
     if (button == GLUT_LEFT_BUTTON)
     {
         if (state == GLUT_DOWN)
@@ -1053,7 +8136,6 @@ void mouse(int button, int state, int x, int y)
             Mouse = GLUT_UP;
         }
     }
-    glutPostRedisplay();
 }
 
 /******************************************
@@ -1061,6 +8143,9 @@ void mouse(int button, int state, int x, int y)
  ******************************************/
 void motion(int x, int y)
 {
+    if (benchScenario) return;  // Kich ban do hieu nang dieu khien canh
+    if (recordLog) recordEvent(EV_MOTION, 0, 0, x, y);
+
     if (Mouse == GLUT_DOWN)
     {
         int deltax = prevx - x;
@@ -1076,10 +8161,10 @@ void motion(int x, int y)
         while (anglex < 0.0f) anglex += 360.0f;
         while (angley < 0.0f) angley += 360.0f;
         while (anglez < 0.0f) anglez += 360.0f;
+        requestRedraw();
     }
     prevx = x;
     prevy = y;
-    glutPostRedisplay();
 }
 
 /******************************************
@@ -1095,6 +8180,9 @@ void passive(int x, int y)
 void reshape(int w, int h)
 {
     glViewport(0, 0, (GLsizei)w, (GLsizei)h);
+    viewWidth = w > 0 ? w : 1;
+    viewHeight = h > 0 ? h : 1;
+    hudStaticDirty = 1;
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     gluPerspective(60.0, (GLfloat)w / (GLfloat)h, 0.1, 100.0);
@@ -1108,12 +8196,40 @@ void glSetupFuncs(void)
 {
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
-    glutIdleFunc(idle);
-    glutSpecialFunc(special);
-    glutKeyboardFunc(keyboard);
-    glutMouseFunc(mouse);
-    glutMotionFunc(motion);
-    glutPassiveMotionFunc(passive);
+    if (onDemand && simThreaded)
+    {
+        scheduleTick();
+    }
+    else if (onDemand)
+    {
+        requestRedraw();
+    }
+    else
+    {
+        glutIdleFunc(idle);
+    }
+    if (simThreaded)
+    {
+        // Su kien qua hang doi, luong mo phong xu ly o dau buoc ke tiep
+        glutSpecialFunc(postSpecial);
+        glutKeyboardFunc(postKeyboard);
+        glutKeyboardUpFunc(postKeyboardUp);
+        glutIgnoreKeyRepeat(1);
+        glutMouseFunc(postMouse);
+        glutMotionFunc(postMotion);
+        glutPassiveMotionFunc(passive);
+    }
+    // Khi phat lai, su kien den tu file ghi thay cho ban phim va chuot
+    else if (!replayPath)
+    {
+        glutSpecialFunc(special);
+        glutKeyboardFunc(keyboard);
+        glutKeyboardUpFunc(keyboardUp);
+        glutIgnoreKeyRepeat(1); // Phim giu duoc lay mau moi buoc, khong can lap phim
+        glutMouseFunc(mouse);
+        glutMotionFunc(motion);
+        glutPassiveMotionFunc(passive);
+    }
     glutSetCursor(GLUT_CURSOR_CROSSHAIR);
 }
 
@@ -1130,8 +8246,397 @@ void help(void)
     printf("  D: Re phai\n");
     printf("  L: Tu dong chay\n");
     printf("  K: Dung lai\n");
+    printf("  T: Bat/tat bang thoi gian\n");
     printf("  R: Dat lai\n");
     printf("  ESC: Thoat\n");
+    printf("Tuy chon dong lenh:\n");
+    printf("  --headless       Ve ngoai man hinh, khong can cua so\n");
+    printf("  --frames N       So khung khi chay ngam (mac dinh 300)\n");
+    printf("  --save-every K   Ghi anh PPM moi K khung\n");
+    printf("  --out PREFIX     Tien to ten file anh (mac dinh frame)\n");
+    printf("  --auto           Bat che do tu dong chay ngay tu dau\n");
+    printf("  --bikes N        So xe trong doan (mac dinh 1)\n");
+    printf("  --no-instancing  Ve tung xe bang ham co dinh, khong dung instancing\n");
+    printf("  --continuous     Ve lien tuc moi vong lap (mac dinh: chi ve khi co thay doi)\n");
+    printf("  --fps N          Gioi han khung/giay khi ve theo yeu cau (mac dinh 60, 0 = khong)\n");
+    printf("  --vsync          Dong bo voi tan so man hinh khi doi bo dem\n");
+    printf("  --no-sim-thread  Mo phong tren luong ve nhu cu (mac dinh: luong rieng khi co cua so)\n");
+    printf("  --sim-thread     Mo phong o luong rieng ca khi chay ngam (khung khong con trung tung buoc)\n");
+    printf("  --no-skinning    Tinh khop nguoi lai va ban dap tren CPU\n");
+    printf("  --no-cull        Khong loai bo xe va o dat ngoai khung nhin\n");
+    printf("  --lod N          Co dinh muc chi tiet 0..2 (mac dinh: theo khoang cach)\n");
+    printf("  --simd-check     So sanh nhan dong hoc SIMD voi mo hinh vo huong\n");
+    printf("  --geometry-check So bang hinh hoc tinh san (banh rang, nan hoa, ghe) voi tinh luc chay\n");
+    printf("  --simd-bench N   Do so xe/giay cua hai nhan dong hoc voi N xe\n");
+    printf("  --threads N      So luong mo phong doan xe (mac dinh: so loi CPU)\n");
+    printf("  --sim-scaling N  Do thoi gian buoc mo phong N xe voi 1..16 luong\n");
+    printf("  --sweep N        Quet tham so tay lai/toc do, N buoc moi lan chay, khong ve;\n");
+    printf("                   kem --sweep-steer K, --sweep-speed K, --sweep-out F\n");
+    printf("  --timing-csv F   Ghi thoi gian tung giai doan moi khung ra file CSV\n");
+    printf("  --alloc-check    Chay ngam, loi neu con cap phat heap sau %d khung khoi dong\n",
+           ALLOC_WARMUP_FRAMES);
+    printf("                   (ban dich -DXEDAP_HEADLESS -DXEDAP_ALLOC_TRACK)\n");
+    printf("  --input-log F    Ghi do tre tu luc nhan phim den khung hien ra file CSV\n");
+    printf("  --record F       Ghi trang thai dau va moi su kien ban phim/chuot vao F\n");
+    printf("  --replay F       Phat lai phien da ghi (co the kem --headless)\n");
+    printf("  --replay-fast F  Phat lai het toc do, khong ve, in buoc/giay\n");
+    printf("  --replay-check   Ghi roi phat lai phien keo chuot co toa do am, so trang thai cuoi\n");
+    printf("  --trace F        Ghi trang thai moi xe moi buoc (theo cot, co chi muc)\n");
+    printf("  --terrain F      Chay tren dia hinh do cao trong file F\n");
+    printf("  --terrain-gen F  Tao file dia hinh mau F (kem --terrain-tiles N, mac dinh 64)\n");
+    printf("  --trace-dump F   In quy dao da ghi ra CSV, kem:\n");
+    printf("                   --from S, --to S (giay), --bike N (chi xe N)\n");
+    printf("  --benchmark K    Chay kich ban do hieu nang K (tat ban phim):\n");
+    printf("                   idle, fullspeed, camera-near, camera-far, orbit, crowd\n");
+    printf("  --bench-out F    Them ket qua (mot dong JSON) vao file F\n");
+}
+
+/******************************************
+ * Doc tuy chon dong lenh; tra ve 0 neu sai cu phap
+ ******************************************/
+int parseArgs(int argc, char *argv[])
+{
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+        {
+            headless = 1;
+        }
+        else if (strcmp(argv[i], "--auto") == 0)
+        {
+            startAuto = 1;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            runFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--save-every") == 0 && i + 1 < argc)
+        {
+            headlessSaveEvery = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            headlessOut = argv[++i];
+        }
+        else if (strcmp(argv[i], "--bikes") == 0 && i + 1 < argc)
+        {
+            fleetSize = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--no-instancing") == 0)
+        {
+            useInstancing = 0;
+        }
+        else if (strcmp(argv[i], "--continuous") == 0)
+        {
+            onDemand = 0;
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+        {
+            fpsCap = atoi(argv[++i]);
+            if (fpsCap < 0) fpsCap = 0;
+        }
+        else if (strcmp(argv[i], "--vsync") == 0)
+        {
+            vsync = 1;
+        }
+        else if (strcmp(argv[i], "--alloc-check") == 0)
+        {
+#ifndef XEDAP_ALLOC_TRACK
+            fprintf(stderr, "Ban dich nay khong dem cap phat (can -DXEDAP_ALLOC_TRACK)\n");
+            return 0;
+#endif
+            allocCheck = 1;
+            headless = 1;
+        }
+        else if (strcmp(argv[i], "--sim-thread") == 0)
+        {
+            simThreadMode = 1;
+        }
+        else if (strcmp(argv[i], "--no-sim-thread") == 0)
+        {
+            simThreadMode = 0;
+        }
+        else if (strcmp(argv[i], "--no-skinning") == 0)
+        {
+            useSkinning = 0;
+        }
+        else if (strcmp(argv[i], "--no-cull") == 0)
+        {
+            useCulling = 0;
+        }
+        else if (strcmp(argv[i], "--lod") == 0 && i + 1 < argc)
+        {
+            lodForce = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--simd-check") == 0)
+        {
+            simdCheck = 1;
+        }
+        else if (strcmp(argv[i], "--geometry-check") == 0)
+        {
+            geometryCheck = 1;
+        }
+        else if (strcmp(argv[i], "--simd-bench") == 0 && i + 1 < argc)
+        {
+            simdBenchRiders = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threadCount = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sim-scaling") == 0 && i + 1 < argc)
+        {
+            simScalingRiders = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc)
+        {
+            sweepTicks = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--sweep-steer") == 0 && i + 1 < argc)
+        {
+            sweepSteerSteps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep-speed") == 0 && i + 1 < argc)
+        {
+            sweepSpeedSteps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep-out") == 0 && i + 1 < argc)
+        {
+            sweepOutPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--timing-csv") == 0 && i + 1 < argc)
+        {
+            timingCsvPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--input-log") == 0 && i + 1 < argc)
+        {
+            inputLogPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            recordPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replayPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay-fast") == 0 && i + 1 < argc)
+        {
+            replayPath = argv[++i];
+            replayFast = 1;
+        }
+        else if (strcmp(argv[i], "--replay-check") == 0)
+        {
+            replayCheck = 1;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            tracePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--terrain") == 0 && i + 1 < argc)
+        {
+            terrainPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--terrain-gen") == 0 && i + 1 < argc)
+        {
+            terrainGenPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--terrain-tiles") == 0 && i + 1 < argc)
+        {
+            terrainGenTiles = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--trace-dump") == 0 && i + 1 < argc)
+        {
+            traceDumpPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc)
+        {
+            traceFrom = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc)
+        {
+            traceTo = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bike") == 0 && i + 1 < argc)
+        {
+            traceBike = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+        {
+            benchScenario = argv[++i];
+            if (!benchmarkValid(benchScenario))
+            {
+                fprintf(stderr, "Kich ban khong hop le: %s\n", benchScenario);
+                return 0;
+            }
+        }
+        else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc)
+        {
+            benchOutPath = argv[++i];
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "Tuy chon khong hop le: %s\n", argv[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/******************************************
+ * Ghi bo dem mau hien tai ra file PPM (P6)
+ ******************************************/
+int saveFramePPM(const char *path, int w, int h)
+{
+    unsigned char *pixels = (unsigned char *)malloc(w * h * 3);
+    FILE *f;
+    int y;
+
+    if (pixels == NULL) return 0;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+
+    f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        free(pixels);
+        return 0;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", w, h);
+    // OpenGL doc tu duoi len, PPM ghi tu tren xuong
+    for (y = h - 1; y >= 0; y--)
+    {
+        fwrite(pixels + y * w * 3, 1, w * 3, f);
+    }
+    fclose(f);
+    free(pixels);
+    return 1;
+}
+
+/******************************************
+ * Che do chay ngam: tao ngu canh EGL khong can man hinh
+ * (Mesa surfaceless / llvmpipe), ve so khung cho truoc
+ * voi moi khung mot buoc mo phong, ghi anh neu can
+ ******************************************/
+int runHeadless(void)
+{
+#ifdef XEDAP_HEADLESS
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+    EGLDisplay dpy = EGL_NO_DISPLAY;
+    EGLConfig config;
+    EGLSurface surface;
+    EGLContext context;
+    EGLint numConfigs;
+    const EGLint configAttribs[] =
+    {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    const EGLint surfaceAttribs[] =
+    {
+        EGL_WIDTH, WIN_WIDTH, EGL_HEIGHT, WIN_HEIGHT, EGL_NONE
+    };
+    double start, elapsed;
+    char path[256];
+    int frame;
+
+    getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+    {
+        dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (dpy == EGL_NO_DISPLAY) dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, NULL, NULL))
+    {
+        fprintf(stderr, "Khong khoi tao duoc EGL\n");
+        return 1;
+    }
+    eglBindAPI(EGL_OPENGL_API);
+    if (!eglChooseConfig(dpy, configAttribs, &config, 1, &numConfigs) || numConfigs < 1)
+    {
+        fprintf(stderr, "Khong tim thay cau hinh EGL phu hop\n");
+        return 1;
+    }
+    surface = eglCreatePbufferSurface(dpy, config, surfaceAttribs);
+    context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, NULL);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(dpy, surface, surface, context))
+    {
+        fprintf(stderr, "Khong tao duoc ngu canh OpenGL ngoai man hinh\n");
+        return 1;
+    }
+    printf("Renderer: %s (%s)\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+    init();
+    reshape(WIN_WIDTH, WIN_HEIGHT);
+    if (simThreadWanted()) simThreadStart();
+
+    start = nowSeconds();
+    for (frame = 0; frame < runFrames; frame++)
+    {
+        if (benchScenario) benchmarkTick(frame);
+        if (!simThreaded) stepSimulation();
+        if (replayDone) break;
+        display();
+        if (headlessSaveEvery > 0 && frame % headlessSaveEvery == 0)
+        {
+            sprintf(path, "%s_%06d.ppm", headlessOut, frame);
+            if (!saveFramePPM(path, WIN_WIDTH, WIN_HEIGHT))
+            {
+                fprintf(stderr, "Khong ghi duoc %s\n", path);
+            }
+        }
+    }
+    elapsed = nowSeconds() - start;
+    printf("%d khung trong %.3f s (%.1f FPS)\n", frame, elapsed,
+           elapsed > 0.0 ? frame / elapsed : 0.0);
+    if (simThreaded)
+    {
+        simThreadStop();
+        printf("Luong mo phong: %lu buoc (%.1f buoc/giay), %.3f ms/buoc\n", simTicks,
+               elapsed > 0.0 ? simTicks / elapsed : 0.0,
+               simWorkSteps > 0 ? simWorkMs / simWorkSteps : 0.0);
+    }
+    for (frame = 0; frame < NUM_PHASES; frame++)
+    {
+        double mn, avg, p99;
+        timingStats(0, frame, &mn, &avg, &p99);
+        printf("  %-16s cpu %7.3f %7.3f %7.3f ms", phaseNames[frame], mn, avg, p99);
+        if (gpuTimers && isGpuPhase(frame))
+        {
+            timingStats(1, frame, &mn, &avg, &p99);
+            printf("  gpu %7.3f %7.3f %7.3f ms", mn, avg, p99);
+        }
+        printf("\n");
+    }
+    if (benchScenario) benchmarkReport();
+    inputReport();
+    if (allocCheck)
+    {
+        int steady = (int)timingFrames - ALLOC_WARMUP_FRAMES;
+
+        printf("Cap phat heap sau %d khung khoi dong: %lu lan trong %lu/%d khung -> %s\n",
+               ALLOC_WARMUP_FRAMES, steadyAllocs, steadyAllocFrames, steady > 0 ? steady : 0,
+               steady <= 0 ? "KHONG DU KHUNG" : steadyAllocs == 0 ? "dat" : "LOI");
+        printf("  driver OpenGL (khong tinh): %.1f lan/khung\n",
+               steady > 0 ? (double)driverAllocs / steady : 0.0);
+        if (steady <= 0 || steadyAllocs > 0) allocCheck = -1;
+    }
+
+    eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(dpy, context);
+    eglDestroySurface(dpy, surface);
+    eglTerminate(dpy);
+    return allocCheck < 0 ? 1 : 0;
+#else
+    fprintf(stderr, "Ban dich nay khong ho tro --headless (can -DXEDAP_HEADLESS va EGL)\n");
+    return 1;
+#endif
 }
 
 /******************************************
@@ -1139,12 +8644,56 @@ void help(void)
  ******************************************/
 int main(int argc, char *argv[])
 {
+    if (!parseArgs(argc, argv))
+    {
+        help();
+        return 1;
+    }
+    if (traceDumpPath) return runTraceDump();
+    if (terrainGenPath) return runTerrainGen();
+    if (terrainPath && !terrainOpen(terrainPath)) return 1;
+    if (replayPath && benchScenario)
+    {
+        fprintf(stderr, "Khong the vua phat lai vua chay --benchmark\n");
+        return 1;
+    }
+    // So xe lay tu file ghi
+    if (replayPath && !replayOpen(replayPath)) return 1;
+    if (benchScenario && strcmp(benchScenario, "crowd") == 0 && fleetSize == 1)
+    {
+        fleetSize = 500;
+    }
+    // Do hieu nang can ve lien tuc de do duoc thoi gian khung
+    if (benchScenario) onDemand = 0;
+    if (simdCheck) return runSimdCheck();
+    if (geometryCheck) return runGeometryCheck();
+    if (simdBenchRiders > 0) return runSimdBench(simdBenchRiders);
+    if (sweepTicks > 0) return runSweep();
+    if (simScalingRiders > 0)
+    {
+        fleetInit(simScalingRiders);
+        return runSimScaling(fleet.count);
+    }
+    fleetInit(fleetSize);
+    if (fleet.count >= 2 * MIN_TASK_RIDERS)
+    {
+        poolStart(threadCount > 0 ? threadCount : cpuCount());
+    }
+    if (replayFast) return runReplayFast();
+    if (replayCheck) return runReplayCheck();
+    // Phat lai ngam: chay den het phien thay vi --frames
+    if (replayPath && headless) runFrames = INT_MAX;
+    if (headless) return runHeadless();
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowPosition(100, 100);
     glutInitWindowSize(WIN_WIDTH, WIN_HEIGHT);
     glutCreateWindow("Xe dap voi nguoi - Mo hinh 3D voi dieu khien");
+    windowed = 1;
     init();
+    if (simThreadWanted()) simThreadStart();
+    if (vsync) setSwapInterval(1);
     glSetupFuncs();
     help();
     glutMainLoop();